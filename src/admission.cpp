@@ -0,0 +1,102 @@
+#include "admission.hh"
+#include "state.hh"
+#include "settings.hh"
+
+#include <filesystem>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <nix/store/pathlocks.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/fmt.hh>
+#include <nix/util/logging.hh>
+
+bool AdmissionTicket::enabled()
+{
+    return ourSettings.maxJobsPerUser.get() || ourSettings.maxJobsPerCluster.get() || ourSettings.maxQueueWait.get();
+}
+
+/* Records that the build of drvName is postponed once more. A record that
+ * has not been renewed for max-postpone-time is left over by a build that
+ * was given up, and starts over.
+ * @return Number of seconds since the build was first postponed. */
+static time_t postponedFor(const std::string & drvName)
+{
+    if (currentLoadDir().empty())
+        return 0;
+    auto dir = currentLoadDir() + "/postponed";
+    if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST)
+        throw nix::SysError("creating '%s'", dir);
+    auto path = dir + "/" + drvName;
+    auto now = time(nullptr);
+    time_t since = now;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && now - st.st_mtime < (time_t) ourSettings.maxPostponeTime.get())
+        since = std::stoll(nix::readFile(path));
+    nix::writeFile(path, std::to_string(since));
+    return now - since;
+}
+
+AdmissionTicket::AdmissionTicket(const std::string & cluster, std::optional<std::chrono::seconds> expectedWait, const std::string & drvName)
+{
+    auto maxQueueWait = ourSettings.maxQueueWait.get();
+    if (maxQueueWait && expectedWait && expectedWait->count() > maxQueueWait) {
+        /* The wait is never expected to shrink on a busy cluster whose
+         * scheduler does not predict start times, so builds are not
+         * postponed forever. Builds handed to the normal build hook are not
+         * postponed at all. */
+        auto maxPostponeTime = ourSettings.maxPostponeTime.get();
+        if (!maxPostponeTime || ourSettings.admissionFallback.get() || postponedFor(drvName) < maxPostponeTime)
+            throw AdmissionRefused(nix::fmt("the job is expected to wait %d s before it starts, longer than max-queue-wait", expectedWait->count()));
+        using namespace nix;
+        printError("NSH Error: submitting the build anyway, as it has been postponed for longer than max-postpone-time");
+    }
+    if (!currentLoadDir().empty())
+        unlink((currentLoadDir() + "/postponed/" + drvName).c_str());
+
+    auto maxJobsPerUser = ourSettings.maxJobsPerUser.get();
+    auto maxJobsPerCluster = ourSettings.maxJobsPerCluster.get();
+    if ((!maxJobsPerUser && !maxJobsPerCluster) || currentLoadDir().empty())
+        return;
+
+    auto dir = currentLoadDir() + "/admission";
+    mkdir(dir.c_str(), 0700);
+    dir += "/" + (cluster.empty() ? ".default" : cluster);
+    if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST)
+        throw nix::SysError("creating '%s'", dir);
+
+    /* The jobs are counted and ours registered under the lock of the
+     * directory, so that concurrent builds do not all take the last
+     * place. */
+    auto dirLock = nix::openLockFile(dir + ".lock", true);
+    nix::lockFile(dirLock.get(), nix::ltWrite, true);
+    auto user = std::to_string(getuid());
+    uint64_t jobs = 0, userJobs = 0;
+    for (auto & entry : std::filesystem::directory_iterator(dir)) {
+        auto fd = nix::openLockFile(entry.path().string(), false);
+        if (!fd)
+            continue;
+        if (nix::lockFile(fd.get(), nix::ltWrite, false)) {
+            /* Left behind by a hook that is gone. */
+            unlink(entry.path().c_str());
+            continue;
+        }
+        jobs++;
+        if (entry.path().filename().string().starts_with(user + "-"))
+            userJobs++;
+    }
+    if (maxJobsPerCluster && jobs >= maxJobsPerCluster)
+        throw AdmissionRefused(nix::fmt("%d jobs are outstanding, as many as max-jobs-per-cluster allows", jobs));
+    if (maxJobsPerUser && userJobs >= maxJobsPerUser)
+        throw AdmissionRefused(nix::fmt("%d jobs of user %s are outstanding, as many as max-jobs-per-user allows", userJobs, user));
+
+    path = nix::fmt("%s/%s-%d", dir, user, getpid());
+    lock = nix::openLockFile(path, true);
+    nix::lockFile(lock.get(), nix::ltWrite, true);
+}
+
+AdmissionTicket::~AdmissionTicket()
+{
+    if (!path.empty())
+        unlink(path.c_str());
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+#include <nix/util/file-descriptor.hh>
+
+/* Refusal of a build by the admission control, with the reason. */
+struct AdmissionRefused : public std::runtime_error
+{
+    explicit AdmissionRefused(const std::string & s) : std::runtime_error(s) {}
+};
+
+/* Outstanding job of a build, counted against max-jobs-per-user and
+ * max-jobs-per-cluster for as long as it lives. Every outstanding job holds
+ * the lock on a file of its own in the 'admission' directory of the
+ * current-load directory, named after the user running the hook, so that
+ * the jobs of hooks that are gone are no longer counted. */
+class AdmissionTicket
+{
+public:
+    /* Admits the job of a build.
+     * @param cluster Cluster the build is routed to, or the empty string if
+     * clusters is not set.
+     * @param expectedWait Expected wait for the job to start, if known.
+     * @param drvName Name of the derivation of the build, under which the
+     * time it was first postponed because of max-queue-wait is recorded.
+     * @throws AdmissionRefused if the job would exceed a cap, or wait longer
+     * than max-queue-wait while the build has been postponed for less than
+     * max-postpone-time. */
+    AdmissionTicket(const std::string & cluster, std::optional<std::chrono::seconds> expectedWait, const std::string & drvName);
+
+    ~AdmissionTicket();
+
+    /* Whether any of the caps or max-queue-wait is set. */
+    static bool enabled();
+
+private:
+    std::string path;
+    nix::AutoCloseFD lock;
+};
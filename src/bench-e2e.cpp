@@ -0,0 +1,692 @@
+/* End-to-end benchmark of the overhead of NSH, running the real nsh binary
+ * as the build hook of trivial and large-closure derivations on a single
+ * machine. NSH submits the jobs to a mock slurmrestd on a Unix domain
+ * socket, which runs the job scripts locally after a configurable queue
+ * delay, and reaches the build node through an sshd on localhost. The local
+ * and the remote store are chroot stores in a temporary directory, and the
+ * output of every derivation is already present in the remote store, so the
+ * job itself does no work and only the costs of NSH are measured: the time
+ * spent in every phase, taken from metrics-textfile, and the wall time, CPU
+ * time and peak RSS of the hook process. The results are printed as JSON,
+ * to compare releases.
+ *
+ * Run with 'meson test --benchmark', which passes the path of nsh. Skipped
+ * when sshd or Nix are not available. Tuned with environment variables:
+ *
+ * - NSH_BENCH_RUNS: builds per case (default 5);
+ * - NSH_BENCH_QUEUE_DELAY_MS: time jobs spend in the mock queue (default 0);
+ * - NSH_BENCH_LARGE_PATHS, NSH_BENCH_LARGE_PATH_SIZE: number and size in
+ *   bytes of the inputs of the large-closure case (default 100 of 1 MiB);
+ * - NSH_BENCH_OUTPUT: file to write the results to as well. */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+
+using namespace nlohmann;
+using namespace std::chrono_literals;
+
+extern char ** environ;
+
+/* Exit code making meson report the benchmark as skipped. */
+#define SKIP 77
+
+struct SkipError : public std::runtime_error
+{
+    explicit SkipError(const std::string & s) : std::runtime_error(s) {}
+};
+
+static unsigned envNumber(const char * name, unsigned def)
+{
+    auto value = getenv(name);
+    return value ? std::stoul(value) : def;
+}
+
+static std::string which(const std::string & name)
+{
+    std::stringstream path(getenv("PATH") ? getenv("PATH") : "");
+    std::string dir;
+    while (std::getline(path, dir, ':'))
+        if (!dir.empty() && access((dir + "/" + name).c_str(), X_OK) == 0)
+            return dir + "/" + name;
+    for (auto dir : {"/usr/sbin", "/usr/local/sbin", "/sbin"})
+        if (access((std::string(dir) + "/" + name).c_str(), X_OK) == 0)
+            return std::string(dir) + "/" + name;
+    return "";
+}
+
+static pid_t spawn(const std::vector<std::string> & args, posix_spawn_file_actions_t * actions = nullptr)
+{
+    std::vector<char *> argv;
+    for (auto & arg : args)
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+    pid_t pid;
+    if (int err = posix_spawnp(&pid, argv[0], actions, nullptr, argv.data(), environ))
+        throw std::runtime_error("running " + args[0] + ": " + strerror(err));
+    return pid;
+}
+
+/* Runs a command to completion.
+ * @return Its standard output, without the trailing newline. */
+static std::string runCommand(const std::vector<std::string> & args)
+{
+    int out[2];
+    if (pipe(out) == -1)
+        throw std::runtime_error("creating pipe");
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+    posix_spawn_file_actions_addclose(&actions, out[0]);
+    pid_t pid = spawn(args, &actions);
+    posix_spawn_file_actions_destroy(&actions);
+    close(out[1]);
+    std::string output;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(out[0], buf, sizeof(buf))) > 0)
+        output.append(buf, n);
+    close(out[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        throw std::runtime_error("command failed: " + args[0] + " " + (args.size() > 1 ? args[1] : ""));
+    while (!output.empty() && output.back() == '\n')
+        output.pop_back();
+    return output;
+}
+
+static void writeFile(const std::string & path, const std::string & contents)
+{
+    std::ofstream file(path, std::ios::binary);
+    file << contents;
+    if (!file)
+        throw std::runtime_error("writing " + path);
+}
+
+static std::string readFile(const std::string & path)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+static json number(int64_t n)
+{
+    return {{"set", true}, {"infinite", false}, {"number", n}};
+}
+
+/* A slurmrestd that runs the submitted job scripts on this machine, each
+ * after waiting queueDelay in the queue, with batch_host 'localhost'. */
+class MockSlurm
+{
+    struct Job
+    {
+        std::string state = "PENDING";
+        int rc = 0;
+        pid_t pid = -1;
+        int64_t startTime = 0;
+    };
+
+    std::mutex mutex;
+    std::map<int, Job> jobs;
+    int nextId = 1;
+    std::chrono::milliseconds queueDelay;
+
+    void runJob(int id, json job)
+    {
+        std::this_thread::sleep_for(queueDelay);
+        std::string script = job["script"];
+        std::string stderrPath = job["standard_error"];
+        std::string path;
+        for (auto & var : job["environment"])
+            if (var.get<std::string>().starts_with("PATH="))
+                path = var.get<std::string>();
+        std::vector<char *> env = {path.data(), nullptr};
+
+        std::unique_lock lock(mutex);
+        if (jobs[id].state != "PENDING")
+            return;
+        pid_t pid = fork();
+        if (pid == 0) {
+            setpgid(0, 0);
+            int null = open("/dev/null", O_RDWR);
+            int err = open(stderrPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (null == -1 || err == -1 || chdir("/tmp") == -1)
+                _exit(1);
+            dup2(null, 0);
+            dup2(null, 1);
+            dup2(err, 2);
+            execle("/bin/sh", "sh", "-c", script.c_str(), nullptr, env.data());
+            _exit(127);
+        }
+        jobs[id].pid = pid;
+        jobs[id].state = "RUNNING";
+        jobs[id].startTime = time(nullptr);
+        lock.unlock();
+
+        int status;
+        waitpid(pid, &status, 0);
+        lock.lock();
+        auto & done = jobs[id];
+        if (done.state == "RUNNING") {
+            done.rc = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+            done.state = done.rc ? "FAILED" : "COMPLETED";
+        }
+    }
+
+    json jobDocument(int id, const Job & job)
+    {
+        bool finished = job.state != "PENDING" && job.state != "RUNNING";
+        return {
+            {"job_id", id},
+            {"job_state", {job.state}},
+            {"batch_host", job.state == "PENDING" ? "" : "localhost"},
+            {"start_time", number(job.startTime ? job.startTime : time(nullptr) + queueDelay.count() / 1000)},
+            {"time_limit", number(60)},
+            {"exit_code", {{"return_code", {{"set", finished}, {"infinite", false}, {"number", job.rc}}}}},
+        };
+    }
+
+public:
+    explicit MockSlurm(std::chrono::milliseconds queueDelay) : queueDelay(queueDelay) {}
+
+    void killJobs()
+    {
+        std::lock_guard lock(mutex);
+        for (auto & [id, job] : jobs)
+            if (job.state == "RUNNING")
+                kill(-job.pid, SIGKILL);
+    }
+
+    std::string handle(const std::string & method, const std::string & path, const std::string & body)
+    {
+        const std::string prefix = "/slurm/v0.0.43/";
+        json response = {{"errors", json::array()}};
+        if (method == "POST" && path == prefix + "job/submit") {
+            auto job = json::parse(body)["job"];
+            std::lock_guard lock(mutex);
+            int id = nextId++;
+            jobs[id] = Job();
+            std::thread(&MockSlurm::runJob, this, id, job).detach();
+            response["job_id"] = id;
+        } else if (path.starts_with(prefix + "jobs/state/?job_id=")) {
+            std::stringstream ids(path.substr(path.find('=') + 1));
+            std::string id;
+            response["jobs"] = json::array();
+            std::lock_guard lock(mutex);
+            while (std::getline(ids, id, ','))
+                if (auto job = jobs.find(std::stoi(id)); job != jobs.end())
+                    response["jobs"].push_back({{"job_id", id}, {"state", {{"current", {job->second.state}}}}});
+        } else if (path.starts_with(prefix + "job/")) {
+            int id = std::stoi(path.substr(prefix.size() + 4));
+            std::lock_guard lock(mutex);
+            auto job = jobs.find(id);
+            if (job == jobs.end()) {
+                response["errors"].push_back({{"description", "Unknown job"}, {"error_number", 2017}, {"error", "Invalid job id specified"}});
+            } else if (method == "DELETE") {
+                if (job->second.state == "RUNNING")
+                    kill(-job->second.pid, SIGTERM);
+                job->second.state = "CANCELLED";
+            } else
+                response["jobs"] = {jobDocument(id, job->second)};
+        }
+        return response.dump();
+    }
+
+    /* Serves HTTP/1.1 with keep-alive, one thread per connection. */
+    void serve(int listenFd)
+    {
+        while (true) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd == -1)
+                return;
+            std::thread([this, fd]() {
+                std::string buf;
+                char chunk[65536];
+                while (true) {
+                    auto end = buf.find("\r\n\r\n");
+                    size_t length = 0;
+                    if (end != std::string::npos) {
+                        auto headers = buf.substr(0, end);
+                        std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+                        if (auto cl = headers.find("content-length:"); cl != std::string::npos)
+                            length = std::stoul(headers.substr(cl + 15));
+                    }
+                    if (end == std::string::npos || buf.size() < end + 4 + length) {
+                        auto n = read(fd, chunk, sizeof(chunk));
+                        if (n <= 0)
+                            break;
+                        buf.append(chunk, n);
+                        continue;
+                    }
+                    std::stringstream requestLine(buf.substr(0, buf.find("\r\n")));
+                    std::string method, path;
+                    requestLine >> method >> path;
+                    auto body = handle(method, path, buf.substr(end + 4, length));
+                    buf.erase(0, end + 4 + length);
+                    auto reply = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: "
+                        + std::to_string(body.size()) + "\r\n\r\n" + body;
+                    if (write(fd, reply.data(), reply.size()) != (ssize_t) reply.size())
+                        break;
+                }
+                close(fd);
+            }).detach();
+        }
+    }
+};
+
+/* An sshd on localhost accepting a key of its own, for the ssh-ng store. */
+class LocalSshd
+{
+    pid_t pid = -1;
+
+public:
+    std::string sshOpts;
+
+    explicit LocalSshd(const std::string & dir)
+    {
+        auto sshd = which("sshd");
+        if (sshd.empty() || which("ssh-keygen").empty() || which("ssh").empty())
+            throw SkipError("OpenSSH is not installed");
+        std::filesystem::create_directories(dir);
+        for (auto key : {"host_key", "client_key"})
+            runCommand({"ssh-keygen", "-q", "-t", "ed25519", "-N", "", "-f", dir + "/" + key});
+        std::filesystem::copy_file(dir + "/client_key.pub", dir + "/authorized_keys");
+
+        /* Let the kernel pick a free port. */
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1 || getsockname(sock, (struct sockaddr *) &addr, &len) == -1)
+            throw SkipError("no free port for sshd");
+        auto port = std::to_string(ntohs(addr.sin_port));
+        close(sock);
+
+        writeFile(dir + "/sshd_config",
+            "Port " + port + "\n"
+            "ListenAddress 127.0.0.1\n"
+            "HostKey " + dir + "/host_key\n"
+            "AuthorizedKeysFile " + dir + "/authorized_keys\n"
+            "PidFile " + dir + "/sshd.pid\n"
+            "StrictModes no\n"
+            "PasswordAuthentication no\n"
+            "KbdInteractiveAuthentication no\n");
+        pid = spawn({sshd, "-D", "-e", "-f", dir + "/sshd_config"});
+
+        sshOpts = "-p " + port + " -i " + dir + "/client_key -o IdentitiesOnly=yes"
+            " -o StrictHostKeyChecking=no -o UserKnownHostsFile=/dev/null -o LogLevel=ERROR";
+        for (int i = 0; i < 50; i++) {
+            try {
+                runCommand({"ssh", "-p", port, "-i", dir + "/client_key", "-o", "IdentitiesOnly=yes", "-o", "BatchMode=yes",
+                    "-o", "StrictHostKeyChecking=no", "-o", "UserKnownHostsFile=/dev/null", "-o", "LogLevel=ERROR", "localhost", "true"});
+                return;
+            } catch (std::runtime_error &) {
+                std::this_thread::sleep_for(100ms);
+            }
+        }
+        throw SkipError("unable to log in to sshd on localhost");
+    }
+
+    ~LocalSshd()
+    {
+        if (pid != -1) {
+            kill(pid, SIGTERM);
+            waitpid(pid, nullptr, 0);
+        }
+    }
+};
+
+/* Serialisation of the build hook protocol, as written by Nix. */
+static void writeNum(std::string & buf, uint64_t n)
+{
+    for (int i = 0; i < 8; i++)
+        buf += (char) ((n >> (8 * i)) & 0xff);
+}
+
+static void writeStr(std::string & buf, const std::string & s)
+{
+    writeNum(buf, s.size());
+    buf += s;
+    buf.append((8 - s.size() % 8) % 8, '\0');
+}
+
+static void writeStrs(std::string & buf, const std::vector<std::string> & strings)
+{
+    writeNum(buf, strings.size());
+    for (auto & s : strings)
+        writeStr(buf, s);
+}
+
+static void writeAll(int fd, const std::string & data)
+{
+    if (write(fd, data.data(), data.size()) != (ssize_t) data.size())
+        throw std::runtime_error("writing to nsh");
+}
+
+struct RunResult
+{
+    double wallSeconds;
+    double cpuSeconds;
+    long maxRssKiB;
+    std::map<std::string, double> phases;
+};
+
+struct Derivation
+{
+    std::string drvPath;
+    std::vector<std::string> inputs;
+};
+
+class Bench
+{
+    std::string nsh;
+    std::string dir;
+    std::string system;
+    std::mt19937_64 random{std::random_device()()};
+    unsigned counter = 0;
+
+public:
+    Bench(const std::string & nsh, const std::string & dir, const std::string & system)
+        : nsh(nsh), dir(dir), system(system) {}
+
+    /* Instantiates a derivation with nrInputs input sources of inputSize
+     * bytes, whose output is only added to the remote store. */
+    Derivation makeDerivation(const std::string & caseName, unsigned nrInputs, size_t inputSize)
+    {
+        auto name = "nsh-bench-" + caseName + "-" + std::to_string(getpid()) + "-" + std::to_string(counter++);
+        auto inputDir = dir + "/inputs/" + name;
+        std::filesystem::create_directories(inputDir);
+
+        Derivation drv;
+        if (nrInputs) {
+            std::vector<std::string> add = {"nix-store", "--add"};
+            for (unsigned i = 0; i < nrInputs; i++) {
+                std::string contents(inputSize, '\0');
+                for (size_t j = 0; j + 8 <= contents.size(); j += 8) {
+                    uint64_t r = random();
+                    memcpy(&contents[j], &r, 8);
+                }
+                auto path = inputDir + "/input-" + std::to_string(i);
+                writeFile(path, contents);
+                add.push_back(path);
+            }
+            std::stringstream paths(runCommand(add));
+            std::string path;
+            while (std::getline(paths, path))
+                drv.inputs.push_back(path);
+        }
+
+        auto outputFile = inputDir + "/" + name;
+        writeFile(outputFile, name + "\n");
+        auto hash = runCommand({"nix-hash", "--type", "sha256", "--flat", "--base32", outputFile});
+        auto outPath = runCommand({"nix-store", "--store", "local?root=" + dir + "/remote", "--add-fixed", "sha256", outputFile});
+
+        std::string inputList;
+        for (auto & input : drv.inputs)
+            inputList += " (builtins.storePath \"" + input + "\")";
+        auto expr = "derivation { name = \"" + name + "\"; system = \"" + system + "\"; builder = \"builtin:fetchurl\"; "
+            "url = \"file:///dev/null\"; outputHashMode = \"flat\"; outputHashAlgo = \"sha256\"; outputHash = \"" + hash + "\"; "
+            "inputs = [" + inputList + " ]; }";
+        drv.drvPath = runCommand({"nix-instantiate", "--expr", expr});
+        if (runCommand({"nix-store", "--query", "--outputs", drv.drvPath}) != outPath)
+            throw std::runtime_error("output of " + drv.drvPath + " does not match " + outPath);
+        return drv;
+    }
+
+    /* Has nsh build drv, speaking the build hook protocol as Nix does. */
+    RunResult build(const Derivation & drv)
+    {
+        std::filesystem::remove(dir + "/metrics.prom");
+
+        int in[2], err[2], log[2];
+        if (pipe(in) == -1 || pipe(err) == -1 || pipe(log) == -1)
+            throw std::runtime_error("creating pipes");
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, in[0], 0);
+        posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, err[1], 2);
+        posix_spawn_file_actions_adddup2(&actions, log[1], 4);
+        posix_spawn_file_actions_addopen(&actions, 5, "/dev/null", O_RDONLY, 0);
+        for (int fd : {in[1], err[0], log[0]})
+            posix_spawn_file_actions_addclose(&actions, fd);
+
+        auto start = std::chrono::steady_clock::now();
+        pid_t pid = spawn({nsh, "1"}, &actions);
+        posix_spawn_file_actions_destroy(&actions);
+        close(in[0]);
+        close(err[1]);
+        close(log[1]);
+
+        std::thread([fd = log[0]]() {
+            char buf[4096];
+            while (read(fd, buf, sizeof(buf)) > 0)
+                ;
+            close(fd);
+        }).detach();
+
+        std::string request;
+        writeNum(request, 0);
+        writeStr(request, "try");
+        writeNum(request, 1);
+        writeStr(request, system);
+        writeStr(request, drv.drvPath);
+        writeStrs(request, {});
+        writeAll(in[1], request);
+
+        /* Read the hook's stderr up to its answer, keeping it for errors. */
+        std::string stderrText, line;
+        FILE * errFile = fdopen(err[0], "r");
+        char * buf = nullptr;
+        size_t bufSize = 0;
+        bool accepted = false;
+        while (getline(&buf, &bufSize, errFile) != -1) {
+            line = buf;
+            stderrText += line;
+            if (line.starts_with("# accept")) {
+                accepted = true;
+                break;
+            }
+            if (line.starts_with("# decline") || line.starts_with("# postpone"))
+                break;
+        }
+        if (accepted) {
+            std::string inputs;
+            writeStrs(inputs, drv.inputs);
+            writeStrs(inputs, {"out"});
+            writeAll(in[1], inputs);
+        }
+        std::thread drain([&]() {
+            while (getline(&buf, &bufSize, errFile) != -1)
+                stderrText += buf;
+        });
+
+        int status;
+        struct rusage usage;
+        wait4(pid, &status, 0, &usage);
+        std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+        drain.join();
+        free(buf);
+        fclose(errFile);
+        close(in[1]);
+
+        if (!accepted || !WIFEXITED(status) || WEXITSTATUS(status))
+            throw std::runtime_error("nsh failed to build " + drv.drvPath + ":\n" + stderrText);
+
+        RunResult result;
+        result.wallSeconds = wall.count();
+        result.cpuSeconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+        result.maxRssKiB = usage.ru_maxrss;
+        std::stringstream metrics(readFile(dir + "/metrics.prom"));
+        while (std::getline(metrics, line)) {
+            if (!line.starts_with("nsh_phase_duration_seconds_sum{"))
+                continue;
+            auto phase = line.find("phase=\"");
+            auto name = line.substr(phase + 7, line.find('"', phase + 7) - phase - 7);
+            result.phases[name] = std::stod(line.substr(line.rfind(' ') + 1));
+        }
+        return result;
+    }
+};
+
+static json summarize(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    double sum = 0;
+    for (auto v : values)
+        sum += v;
+    return {
+        {"mean", values.empty() ? 0 : sum / values.size()},
+        {"median", values.empty() ? 0 : values[values.size() / 2]},
+        {"min", values.empty() ? 0 : values.front()},
+        {"max", values.empty() ? 0 : values.back()},
+    };
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc != 2) {
+        std::cerr << "usage: " << argv[0] << " <path to nsh>" << std::endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    auto runs = envNumber("NSH_BENCH_RUNS", 5);
+    auto queueDelay = std::chrono::milliseconds(envNumber("NSH_BENCH_QUEUE_DELAY_MS", 0));
+    auto largePaths = envNumber("NSH_BENCH_LARGE_PATHS", 100);
+    auto largePathSize = envNumber("NSH_BENCH_LARGE_PATH_SIZE", 1 << 20);
+
+    auto dir = std::filesystem::temp_directory_path().string() + "/nsh-bench-e2e-" + std::to_string(getpid());
+    int rc = 0;
+    /* Never destroyed, as its server threads are never joined. */
+    MockSlurm * slurm = nullptr;
+    try {
+        for (auto tool : {"nix-store", "nix-instantiate", "nix-hash", "nix-daemon"})
+            if (which(tool).empty())
+                throw SkipError(std::string(tool) + " is not installed");
+        auto nsh = std::filesystem::absolute(argv[1]).string();
+        std::filesystem::create_directories(dir + "/conf");
+        std::filesystem::create_directories(dir + "/state");
+
+        /* Keep the stores, the configuration and the SSH setup of the user
+         * out of the benchmark. */
+        setenv("NIX_REMOTE", ("local?root=" + dir + "/local").c_str(), 1);
+        setenv("NIX_CONF_DIR", (dir + "/conf").c_str(), 1);
+        setenv("NIX_USER_CONF_FILES", (dir + "/conf/nix.conf").c_str(), 1);
+        unsetenv("NSH_CONFIG");
+        writeFile(dir + "/conf/nix.conf", "experimental-features = nix-command\n");
+        auto system = runCommand({"nix-instantiate", "--eval", "--expr", "builtins.currentSystem"});
+        system = system.substr(1, system.size() - 2);
+
+        LocalSshd sshd(dir + "/ssh");
+        setenv("NIX_SSHOPTS", sshd.sshOpts.c_str(), 1);
+
+        auto socketPath = dir + "/slurmrestd.sock";
+        int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        socketPath.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+        if (bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listenFd, 16) == -1)
+            throw SkipError("unable to listen on " + socketPath);
+        slurm = new MockSlurm(queueDelay);
+        std::thread(&MockSlurm::serve, slurm, listenFd).detach();
+
+        writeFile(dir + "/conf/nsh.conf",
+            "job-scheduler = slurm\n"
+            "system = " + system + "\n"
+            "slurm-api-socket = " + socketPath + "\n"
+            "slurm-state-dir = " + dir + "/state\n"
+            "remote-store = local?root=" + dir + "/remote\n"
+            "remote-nix-bin-dir = " + std::filesystem::path(which("nix-daemon")).parent_path().string() + "\n"
+            "metrics-textfile = " + dir + "/metrics.prom\n");
+
+        Bench bench(nsh, dir, system);
+        struct Case
+        {
+            std::string name;
+            unsigned nrInputs;
+            size_t inputSize;
+        };
+        json results = {
+            {"nsh", nsh},
+            {"system", system},
+            {"runs", runs},
+            {"queue_delay_ms", queueDelay.count()},
+            {"cases", json::array()},
+        };
+        for (auto & c : std::vector<Case>{{"trivial", 0, 0}, {"large-closure", largePaths, largePathSize}}) {
+            std::vector<double> wall, cpu, rss;
+            std::map<std::string, std::vector<double>> phases;
+            for (unsigned i = 0; i < runs; i++) {
+                auto drv = bench.makeDerivation(c.name, c.nrInputs, c.inputSize);
+                auto result = bench.build(drv);
+                wall.push_back(result.wallSeconds);
+                cpu.push_back(result.cpuSeconds);
+                rss.push_back(result.maxRssKiB);
+                for (auto & [phase, seconds] : result.phases)
+                    phases[phase].push_back(seconds);
+            }
+            json phaseSummary = json::object();
+            for (auto & [phase, seconds] : phases)
+                phaseSummary[phase] = summarize(seconds);
+            results["cases"].push_back({
+                {"name", c.name},
+                {"inputs", c.nrInputs},
+                {"input_bytes", c.nrInputs * c.inputSize},
+                {"wall_seconds", summarize(wall)},
+                {"cpu_seconds", summarize(cpu)},
+                {"max_rss_kib", summarize(rss)},
+                {"phase_seconds", phaseSummary},
+            });
+        }
+
+        std::cout << results.dump(2) << std::endl;
+        if (auto output = getenv("NSH_BENCH_OUTPUT"))
+            writeFile(output, results.dump(2) + "\n");
+    } catch (SkipError & e) {
+        std::cerr << "skipping end-to-end benchmark: " << e.what() << std::endl;
+        rc = SKIP;
+    } catch (std::exception & e) {
+        std::cerr << "end-to-end benchmark failed: " << e.what() << std::endl;
+        rc = 1;
+    }
+
+    if (slurm)
+        slurm->killJobs();
+    /* The chroot stores have read-only store paths. */
+    try {
+        if (std::filesystem::exists(dir))
+            runCommand({"chmod", "-R", "u+w", dir});
+        std::filesystem::remove_all(dir);
+    } catch (std::exception & e) {
+        std::cerr << "unable to remove " << dir << ": " << e.what() << std::endl;
+    }
+    return rc;
+}
@@ -0,0 +1,78 @@
+/* Microbenchmark for the build log splitter, reporting the throughput of
+ * BuildLogSplitter for a typical compiler log and for a log dominated by
+ * carriage return progress updates. Run with 'meson test --benchmark'. */
+
+#include "logging.hh"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <streambuf>
+
+/* Discards the forwarded log, only counting its size. */
+struct DiscardBuf : public std::streambuf
+{
+    size_t written = 0;
+
+    std::streamsize xsputn(const char *, std::streamsize n) override
+    {
+        written += n;
+        return n;
+    }
+
+    int overflow(int c) override
+    {
+        written++;
+        return c;
+    }
+};
+
+static std::string typicalLog(size_t size)
+{
+    std::string log;
+    for (size_t i = 0; log.size() < size; i++) {
+        log += "gcc -O2 -Wall -fPIC -I../include -c ../src/module" + std::to_string(i) + ".c -o module" + std::to_string(i) + ".o\n";
+        if (i % 7 == 0)
+            log += "../src/module" + std::to_string(i) + ".c:42:13: warning: unused variable 'tmp' [-Wunused-variable]\n";
+        if (i % 50 == 0)
+            log += "\n";
+    }
+    return log;
+}
+
+static std::string carriageReturnLog(size_t size)
+{
+    std::string log;
+    for (size_t i = 0; log.size() < size; i++) {
+        log += "\r[" + std::to_string(i % 100) + "%] downloading 'source.tar.xz'";
+        if (i % 100 == 99)
+            log += "\n";
+    }
+    return log;
+}
+
+static void run(const std::string & name, const std::string & log)
+{
+    const size_t rounds = 20;
+    DiscardBuf buf;
+    std::ostream logOs(&buf);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rounds; i++) {
+        BuildLogSplitter splitter;
+        for (size_t pos = 0; pos < log.size(); pos += NSH_LOG_BUFFER_SIZE)
+            splitter.handleOutput(logOs, std::string_view(log).substr(pos, NSH_LOG_BUFFER_SIZE));
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << name << ": "
+              << std::fixed << std::setprecision(1) << rounds * log.size() / 1e6 / elapsed.count() << " MB/s"
+              << " (" << buf.written / rounds << " of " << log.size() << " bytes forwarded)" << std::endl;
+}
+
+int main()
+{
+    run("typical", typicalLog(32 << 20));
+    run("carriage return heavy", carriageReturnLog(32 << 20));
+    return 0;
+}
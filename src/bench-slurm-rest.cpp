@@ -0,0 +1,207 @@
+/* Benchmark for polling the Slurm REST API, reporting the latency and the
+ * number of heap allocations per poll against a mock slurmrestd listening
+ * on a Unix domain socket. Compares reading the state from the full
+ * /job/{id} document with a complete and a selective parse, reading it from
+ * /jobs/state, and opening a new connection for every poll. Run with
+ * 'meson test --benchmark'. */
+
+#include "slurm-rest.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <restclient-cpp/connection.h>
+#include <restclient-cpp/restclient.h>
+
+using namespace nlohmann;
+
+static std::atomic<uint64_t> allocations = 0;
+
+void * operator new(size_t size)
+{
+    allocations++;
+    if (void * p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void * p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void * p, size_t) noexcept
+{
+    std::free(p);
+}
+
+static json number(int64_t n)
+{
+    return {{"set", true}, {"infinite", false}, {"number", n}};
+}
+
+/* A /job/{id} response shaped like the one of slurmrestd, with the members
+ * of a running job. */
+static std::string jobDocument()
+{
+    json job = {
+        {"job_id", 1},
+        {"name", "Nix Build - 0123456789abcdfghijklmnpqrsvwxyz-hello-2.12.1.drv"},
+        {"job_state", {"RUNNING"}},
+        {"batch_host", "node001"},
+        {"start_time", number(1700000000)},
+        {"time_limit", number(60)},
+        {"exit_code", {{"status", {"SUCCESS"}}, {"return_code", number(0)}, {"signal", {{"id", number(0)}, {"name", ""}}}}},
+        {"nodes", "node001"},
+        {"partition", "batch"},
+        {"user_name", "root"},
+        {"group_name", "root"},
+        {"current_working_directory", "/tmp"},
+        {"standard_error", "/var/lib/nsh/job-0123456789abcdfghijklmnpqrsvwxyz-hello-2.12.1.drv.stderr"},
+        {"standard_output", "/dev/null"},
+        {"standard_input", "/dev/null"},
+    };
+    for (int i = 0; i < 40; i++)
+        job["time_field_" + std::to_string(i)] = number(1700000000 + i);
+    for (int i = 0; i < 40; i++)
+        job["flag_field_" + std::to_string(i)] = {"FLAG_A", "FLAG_B", "FLAG_C"};
+    for (int i = 0; i < 40; i++)
+        job["string_field_" + std::to_string(i)] = "value of field " + std::to_string(i);
+    job["job_resources"] = {{"nodes", {{"count", 1}, {"allocation", json::array({{{"name", "node001"}, {"cpus", {{"count", 1}, {"used", 1}}}, {"memory", {{"used", 0}, {"allocated", 1024}}}}})}}}};
+    json response = {
+        {"jobs", json::array({job})},
+        {"meta", {{"plugin", {{"type", "openapi/slurmctld"}, {"name", "Slurm OpenAPI slurmctld"}, {"data_parser", "data_parser/v0.0.43"}}}}},
+        {"errors", json::array()},
+        {"warnings", json::array()},
+    };
+    return response.dump();
+}
+
+static std::string statesDocument()
+{
+    json response = {
+        {"jobs", json::array({{{"job_id", "1"}, {"state", {{"current", {"RUNNING"}}, {"reason", "None"}}}}})},
+        {"meta", {{"plugin", {{"type", "openapi/slurmctld"}, {"name", "Slurm OpenAPI slurmctld"}, {"data_parser", "data_parser/v0.0.43"}}}}},
+        {"errors", json::array()},
+        {"warnings", json::array()},
+    };
+    return response.dump();
+}
+
+/* Serves canned responses over HTTP/1.1 with keep-alive, one thread per
+ * connection. */
+static void serve(int listenFd, const std::string & job, const std::string & states)
+{
+    while (true) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd == -1)
+            return;
+        std::thread([fd, &job, &states]() {
+            std::string buf;
+            char chunk[4096];
+            while (true) {
+                auto end = buf.find("\r\n\r\n");
+                if (end == std::string::npos) {
+                    auto n = read(fd, chunk, sizeof(chunk));
+                    if (n <= 0)
+                        break;
+                    buf.append(chunk, n);
+                    continue;
+                }
+                auto & body = buf.find("/jobs/state") < end ? states : job;
+                buf.erase(0, end + 4);
+                auto reply = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: "
+                    + std::to_string(body.size()) + "\r\n\r\n" + body;
+                if (write(fd, reply.data(), reply.size()) != (ssize_t) reply.size())
+                    break;
+            }
+            close(fd);
+        }).detach();
+    }
+}
+
+static void run(const std::string & name, std::function<std::string()> poll)
+{
+    const size_t rounds = 2000;
+    std::vector<double> latencies;
+    latencies.reserve(rounds);
+    poll();
+
+    uint64_t allocated = 0;
+    for (size_t i = 0; i < rounds; i++) {
+        auto before = allocations.load();
+        auto start = std::chrono::steady_clock::now();
+        auto state = poll();
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        allocated += allocations.load() - before;
+        latencies.push_back(elapsed.count());
+        if (state != "RUNNING")
+            throw std::runtime_error("unexpected job state " + state);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    double sum = 0;
+    for (auto l : latencies)
+        sum += l;
+    std::cout << name << ": "
+              << std::fixed << std::setprecision(1) << sum / rounds << " us/poll"
+              << " (p99 " << latencies[rounds * 99 / 100] << " us), "
+              << allocated / rounds << " allocations/poll" << std::endl;
+}
+
+int main()
+{
+    auto socketPath = "/tmp/nsh-bench-slurmrestd-" + std::to_string(getpid()) + ".sock";
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    socketPath.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+    if (bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listenFd, 16) == -1) {
+        std::cerr << "unable to listen on " << socketPath << std::endl;
+        return 1;
+    }
+    auto job = jobDocument();
+    auto states = statesDocument();
+    std::thread(serve, listenFd, std::cref(job), std::cref(states)).detach();
+    std::cout << "job document: " << job.size() << " bytes, jobs/state document: " << states.size() << " bytes" << std::endl;
+
+    RestClient::init();
+    auto connect = [&]() {
+        auto conn = std::make_unique<RestClient::Connection>("http://localhost");
+        conn->SetUnixSocketPath(socketPath);
+        return conn;
+    };
+    auto conn = connect();
+
+    run("job document, full parse", [&]() -> std::string {
+        auto response = json::parse(conn->get("/slurm/v0.0.43/job/1").body);
+        return response["jobs"][0]["job_state"][0];
+    });
+    run("job document, selective parse", [&]() -> std::string {
+        auto response = parseSlurmResponse(conn->get("/slurm/v0.0.43/job/1").body, SlurmFields::placement);
+        return response["jobs"][0]["batch_host"] != "" ? "RUNNING" : "PENDING";
+    });
+    run("jobs/state, selective parse", [&]() {
+        auto response = parseSlurmResponse(conn->get("/slurm/v0.0.43/jobs/state/?job_id=1").body, SlurmFields::states);
+        return readJobStates(response)["1"];
+    });
+    run("jobs/state, new connection per poll", [&]() {
+        auto response = parseSlurmResponse(connect()->get("/slurm/v0.0.43/jobs/state/?job_id=1").body, SlurmFields::states);
+        return readJobStates(response)["1"];
+    });
+
+    unlink(socketPath.c_str());
+    return 0;
+}
@@ -0,0 +1,1138 @@
+#include "broker.hh"
+#include "settings.hh"
+#include "scheduler.hh"
+#include "cleanup.hh"
+#include "state.hh"
+
+#include <algorithm>
+#include <set>
+#include <map>
+#include <vector>
+#include <list>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+using namespace std::chrono_literals;
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <nix/util/fmt.hh>
+#include <nix/util/error.hh>
+#include <nix/util/logging.hh>
+#include <nix/util/strings.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/file-descriptor.hh>
+#include <nix/util/unix-domain-socket.hh>
+#include <nix/util/environment-variables.hh>
+
+/* Maximum number of descriptors passed along with a single request. */
+#define BROKER_MAX_FDS 8
+
+/* Number of consecutive polls a job may be missing from the scheduler's
+ * answer before its waiters are told it terminated abnormally. */
+#define BROKER_MAX_MISSES 60
+
+/* Maximum number of jobs coalesced into a single job array, below the
+ * default MaxArraySize of Slurm. */
+#define BROKER_MAX_ARRAY_SIZE 1000
+
+static std::atomic<bool> quit = false;
+
+static void handleQuit(int sig)
+{
+    quit = true;
+}
+
+static bool sendLine(int sock, const std::string & line)
+{
+    if (send(sock, line.data(), line.size(), MSG_NOSIGNAL) != (ssize_t) line.size()) {
+        using namespace nix;
+        debug("unable to reply to NSH broker client: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* Whether a client that never sends anything after its request went away,
+ * which makes its connection readable. */
+static bool isClosed(int sock)
+{
+    struct pollfd pfd = {sock, POLLIN, 0};
+    return poll(&pfd, 1, 0) == 1;
+}
+
+static void sendWithFds(int sock, const std::string & data, const std::vector<int> & fds)
+{
+    struct iovec iov = {const_cast<char *>(data.data()), data.size()};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    std::vector<char> control;
+    if (!fds.empty()) {
+        control.resize(CMSG_SPACE(sizeof(int) * fds.size()));
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    }
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t) data.size())
+        throw nix::SysError("sending request to the NSH broker");
+}
+
+/* Reads a single request line, collecting any descriptors sent along with
+ * it. Reads byte by byte so that nothing past the line is consumed. */
+static std::string recvLineWithFds(int sock, std::vector<nix::AutoCloseFD> & fds)
+{
+    std::string line;
+    while (true) {
+        char c;
+        struct iovec iov = {&c, 1};
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * BROKER_MAX_FDS)];
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        auto n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            throw nix::SysError("receiving request from NSH broker client");
+        }
+        if (n == 0)
+            throw nix::EndOfFile("NSH broker client closed the connection");
+
+        for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int fd;
+            for (size_t i = 0; i < count; i++) {
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                fds.emplace_back(fd);
+            }
+        }
+
+        if (c == '\n')
+            return line;
+        line += c;
+    }
+}
+
+static bool isSameUser(int fd)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+        return false;
+    return cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) == -1)
+        return false;
+    return uid == getuid();
+#endif
+}
+
+static void setRecvTimeout(int fd, time_t seconds)
+{
+    struct timeval tv = {seconds, 0};
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+        throw nix::SysError("setting receive timeout on NSH broker connection");
+}
+
+/* @return What the requests of a hook name the broker they are meant for
+ * by: the scheduler, followed by '@<cluster>' if the build is routed to a
+ * cluster. */
+static std::string brokerTarget(const std::string & jobScheduler)
+{
+    return currentCluster().empty() ? jobScheduler : jobScheduler + "@" + currentCluster();
+}
+
+/* @return Whether this broker serves the requests for target. Requests for
+ * the cluster of another broker are rejected, as the settings of the cluster
+ * do not apply here. */
+static bool servesTarget(const std::string & target)
+{
+    if (target == brokerTarget(ourSettings.jobScheduler.get()))
+        return true;
+    using namespace nix;
+    printError("NSH Error: rejecting a request for '%s', this broker serves '%s'", target, brokerTarget(ourSettings.jobScheduler.get()));
+    return false;
+}
+
+/* Polls the state of all jobs waited on through the broker with a single
+ * scheduler query per tick, and replies to the waiters of every job that is
+ * no longer live with '<exit code> <state>'. */
+class JobPoller
+{
+    std::unique_ptr<Scheduler> scheduler;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::map<std::string, std::vector<nix::AutoCloseFD>> waiters;
+    std::map<std::string, unsigned int> misses;
+
+    /* Forgets waiters whose hook went away; they never send anything, so
+     * the connection becoming readable means it was closed. */
+    void dropClosedWaiters()
+    {
+        for (auto it = waiters.begin(); it != waiters.end();) {
+            std::erase_if(it->second, [](auto & conn) { return isClosed(conn.get()); });
+            if (it->second.empty()) {
+                misses.erase(it->first);
+                it = waiters.erase(it);
+            } else
+                ++it;
+        }
+    }
+
+    void finish(const std::string & jobId, int exitCode, const std::string & state)
+    {
+        auto it = waiters.find(jobId);
+        if (it == waiters.end())
+            return;
+        for (auto & conn : it->second)
+            sendLine(conn.get(), nix::fmt("%d %s\n", exitCode, state));
+        waiters.erase(it);
+        misses.erase(jobId);
+    }
+
+public:
+    JobPoller(std::unique_ptr<Scheduler> scheduler) : scheduler(std::move(scheduler)) {}
+
+    void add(const std::string & jobId, nix::AutoCloseFD conn)
+    {
+        std::lock_guard lock(mutex);
+        // Only wake up an idle poller, so that new waiters don't cause extra polls
+        if (waiters.empty())
+            wakeup.notify_one();
+        waiters[jobId].push_back(std::move(conn));
+    }
+
+    void stop()
+    {
+        wakeup.notify_one();
+    }
+
+    void run()
+    {
+        std::unique_lock lock(mutex);
+        while (!quit) {
+            dropClosedWaiters();
+            if (waiters.empty()) {
+                wakeup.wait_for(lock, 1s);
+                continue;
+            }
+
+            std::set<std::string> jobIds;
+            for (auto & [jobId, conns] : waiters)
+                jobIds.insert(jobId);
+
+            lock.unlock();
+            std::optional<std::map<std::string, Scheduler::JobStatus>> statuses;
+            try {
+                statuses = scheduler->queryJobs(jobIds);
+            } catch (std::exception & e) {
+                using namespace nix;
+                printError("NSH Error: error while polling %d jobs: %s", jobIds.size(), e.what());
+            }
+            lock.lock();
+
+            if (statuses) {
+                for (auto & jobId : jobIds) {
+                    auto status = statuses->find(jobId);
+                    if (status == statuses->end()) {
+                        if (++misses[jobId] >= BROKER_MAX_MISSES)
+                            finish(jobId, -1, "UNKNOWN");
+                    } else if (!status->second.live)
+                        finish(jobId, status->second.exitCode, status->second.state);
+                    else
+                        misses.erase(jobId);
+                }
+            }
+
+            wakeup.wait_for(lock, std::chrono::milliseconds(ourSettings.brokerPollInterval.get()));
+        }
+    }
+};
+
+/* Gathers the submissions with the same job parameters that arrive within
+ * submit-coalesce-window milliseconds of the first one, and submits them as
+ * a single job array. Every submitter is answered with the id of its array
+ * task, or with 'error <message>'. */
+class SubmissionCoalescer
+{
+    struct Group
+    {
+        std::chrono::steady_clock::time_point deadline;
+        std::vector<std::pair<nix::AutoCloseFD, std::string>> submitters;
+    };
+
+    std::unique_ptr<Scheduler> scheduler;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::map<std::string, Group> groups;
+
+    void submit(Group & group)
+    {
+        std::erase_if(group.submitters, [](auto & submitter) { return isClosed(submitter.first.get()); });
+        if (group.submitters.empty())
+            return;
+
+        std::vector<std::string> tasks;
+        for (auto & [conn, task] : group.submitters)
+            tasks.push_back(task);
+
+        std::vector<std::string> jobIds;
+        try {
+            jobIds = scheduler->submitArray(tasks);
+        } catch (std::exception & e) {
+            std::string msg = e.what();
+            std::replace(msg.begin(), msg.end(), '\n', ' ');
+            for (auto & [conn, task] : group.submitters)
+                sendLine(conn.get(), "error " + msg + "\n");
+            return;
+        }
+
+        for (size_t i = 0; i < jobIds.size(); i++) {
+            if (sendLine(group.submitters[i].first.get(), jobIds[i] + "\n"))
+                continue;
+            /* Nobody is going to look after this task. */
+            try {
+                scheduler->cancelJob(jobIds[i]);
+            } catch (std::exception & e) {
+                using namespace nix;
+                printError("NSH Error: unable to cancel orphaned job %s: %s", jobIds[i], e.what());
+            }
+        }
+    }
+
+public:
+    SubmissionCoalescer(std::unique_ptr<Scheduler> scheduler) : scheduler(std::move(scheduler)) {}
+
+    void add(const std::string & key, const std::string & task, nix::AutoCloseFD conn)
+    {
+        std::lock_guard lock(mutex);
+        auto & group = groups[key];
+        if (group.submitters.empty())
+            group.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ourSettings.submitCoalesceWindow.get());
+        group.submitters.emplace_back(std::move(conn), task);
+        if (group.submitters.size() >= BROKER_MAX_ARRAY_SIZE)
+            group.deadline = std::chrono::steady_clock::now();
+        wakeup.notify_one();
+    }
+
+    void stop()
+    {
+        wakeup.notify_one();
+    }
+
+    void run()
+    {
+        std::unique_lock lock(mutex);
+        while (!quit) {
+            if (groups.empty()) {
+                wakeup.wait_for(lock, 1s);
+                continue;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            auto next = std::chrono::steady_clock::time_point::max();
+            std::vector<Group> due;
+            for (auto it = groups.begin(); it != groups.end();) {
+                if (it->second.deadline <= now) {
+                    due.push_back(std::move(it->second));
+                    it = groups.erase(it);
+                } else {
+                    next = std::min(next, it->second.deadline);
+                    ++it;
+                }
+            }
+
+            if (due.empty()) {
+                wakeup.wait_until(lock, next);
+                continue;
+            }
+
+            lock.unlock();
+            for (auto & group : due)
+                submit(group);
+            lock.lock();
+        }
+    }
+};
+
+/* Keeps up to pilot-pool-size pilot jobs running, and leases their slots to
+ * hooks, which start their builds in them directly. A client asking for a
+ * lease is answered with '<pilot job> <host> <dir>' and holds the slot until
+ * it closes its connection, or with 'none' if no slot is free, in which case
+ * the pool is topped up for later builds. */
+class PilotPool
+{
+    struct Pilot
+    {
+        std::unique_ptr<Scheduler> scheduler;
+        std::string dir;
+        std::vector<nix::AutoCloseFD> leases;
+        std::chrono::steady_clock::time_point idleSince;
+    };
+
+    std::unique_ptr<Scheduler> monitor;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::list<Pilot> pilots;
+    std::set<Scheduler *> starting;
+    /* Number of pilots counted by requestPilots that startPilots has not
+     * started yet. */
+    unsigned int requested = 0;
+    std::vector<std::thread> starters;
+    /* Starters that are done and can be joined. */
+    std::set<std::thread::id> finished;
+    std::chrono::steady_clock::time_point lastCheck;
+
+    /* Counts the pilots missing from the pool as requested.
+     * @return Their number, to be passed to startPilots. */
+    unsigned int requestPilots()
+    {
+        unsigned int n = 0;
+        while (pilots.size() + starting.size() + requested < ourSettings.pilotPoolSize.get()) {
+            requested++;
+            n++;
+        }
+        return n;
+    }
+
+    /* Submits n new pilot jobs, each in a thread of its own, as it usually
+     * has to wait in the queue. Must be called without holding the mutex. */
+    void startPilots(unsigned int n)
+    {
+        for (unsigned int i = 0; i < n; i++) {
+            std::unique_ptr<Scheduler> scheduler;
+            try {
+                scheduler = makeScheduler();
+            } catch (std::exception & e) {
+                using namespace nix;
+                printError("NSH Error: unable to start pilot job: %s", e.what());
+            }
+            {
+                std::lock_guard lock(mutex);
+                requested--;
+                /* Pilots registered after stop() would not be interrupted. */
+                if (!scheduler || quit)
+                    continue;
+                starting.insert(scheduler.get());
+            }
+            std::thread starter([this, scheduler{std::move(scheduler)}]() mutable {
+                sigset_t set;
+                sigemptyset(&set);
+                sigaddset(&set, SIGTERM);
+                sigaddset(&set, SIGINT);
+                pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+                Pilot pilot;
+                try {
+                    pilot.dir = scheduler->submitPilot("#!/bin/sh\nwhile :; do sleep 3600; done\n");
+                    using namespace nix;
+                    printInfo("pilot job %s started on '%s'", scheduler->getJobId(), scheduler->getHostname());
+                } catch (Scheduler::Interrupted &) {
+                } catch (std::exception & e) {
+                    using namespace nix;
+                    printError("NSH Error: unable to start pilot job: %s", e.what());
+                }
+
+                std::unique_lock lock(mutex);
+                starting.erase(scheduler.get());
+                if (!pilot.dir.empty()) {
+                    pilot.scheduler = std::move(scheduler);
+                    pilot.idleSince = std::chrono::steady_clock::now();
+                    pilots.push_back(std::move(pilot));
+                }
+                lock.unlock();
+                /* Cancels the pilot job if it was submitted but is not part
+                 * of the pool. */
+                scheduler.reset();
+                lock.lock();
+                finished.insert(std::this_thread::get_id());
+            });
+            std::lock_guard lock(mutex);
+            starters.push_back(std::move(starter));
+        }
+    }
+
+    /* @return Starters that are done, removed from starters. */
+    std::vector<std::thread> takeFinishedStarters()
+    {
+        std::vector<std::thread> done;
+        for (auto it = starters.begin(); it != starters.end();) {
+            if (finished.erase(it->get_id())) {
+                done.push_back(std::move(*it));
+                it = starters.erase(it);
+            } else
+                ++it;
+        }
+        return done;
+    }
+
+    /* Frees the slots of clients that went away; they never send anything,
+     * so the connection becoming readable means it was closed. */
+    void dropClosedLeases()
+    {
+        auto now = std::chrono::steady_clock::now();
+        for (auto & pilot : pilots) {
+            if (pilot.leases.empty())
+                continue;
+            std::erase_if(pilot.leases, [](auto & conn) { return isClosed(conn.get()); });
+            if (pilot.leases.empty())
+                pilot.idleSince = now;
+        }
+    }
+
+    /* @return Pilots that have been idle for longer than pilot-idle-timeout,
+     * or that are no longer running, removed from the pool. */
+    std::vector<Pilot> takeRetired()
+    {
+        std::vector<Pilot> retired;
+        auto now = std::chrono::steady_clock::now();
+        std::set<std::string> dead;
+        if (now - lastCheck >= 10s && !pilots.empty()) {
+            lastCheck = now;
+            std::set<std::string> jobIds;
+            for (auto & pilot : pilots)
+                jobIds.insert(pilot.scheduler->getJobId());
+            try {
+                auto statuses = monitor->queryJobs(jobIds);
+                for (auto & jobId : jobIds) {
+                    auto status = statuses.find(jobId);
+                    if (status == statuses.end() || !status->second.live)
+                        dead.insert(jobId);
+                }
+            } catch (std::exception & e) {
+                using namespace nix;
+                printError("NSH Error: error while polling %d pilot jobs: %s", jobIds.size(), e.what());
+            }
+        }
+        for (auto it = pilots.begin(); it != pilots.end();) {
+            bool idle = it->leases.empty() && now - it->idleSince >= std::chrono::seconds(ourSettings.pilotIdleTimeout.get());
+            if (idle || dead.contains(it->scheduler->getJobId())) {
+                retired.push_back(std::move(*it));
+                it = pilots.erase(it);
+            } else
+                ++it;
+        }
+        return retired;
+    }
+
+public:
+    PilotPool(std::unique_ptr<Scheduler> monitor) : monitor(std::move(monitor))
+    {
+        unsigned int n;
+        {
+            std::lock_guard lock(mutex);
+            n = requestPilots();
+        }
+        startPilots(n);
+    }
+
+    void lease(nix::AutoCloseFD conn)
+    {
+        unsigned int n;
+        {
+            std::lock_guard lock(mutex);
+            for (auto & pilot : pilots) {
+                if (pilot.leases.size() >= ourSettings.pilotSlots.get())
+                    continue;
+                if (sendLine(conn.get(), nix::fmt("%s %s %s\n", pilot.scheduler->getJobId(), pilot.scheduler->getHostname(), pilot.dir)))
+                    pilot.leases.push_back(std::move(conn));
+                return;
+            }
+            sendLine(conn.get(), "none\n");
+            n = requestPilots();
+        }
+        startPilots(n);
+    }
+
+    void stop()
+    {
+        std::lock_guard lock(mutex);
+        for (auto scheduler : starting)
+            scheduler->interrupt();
+        wakeup.notify_one();
+    }
+
+    void run()
+    {
+        std::unique_lock lock(mutex);
+        while (!quit) {
+            dropClosedLeases();
+            auto retired = takeRetired();
+            auto done = takeFinishedStarters();
+            lock.unlock();
+            for (auto & starter : done)
+                starter.join();
+            for (auto & pilot : retired) {
+                using namespace nix;
+                printInfo("cancelling pilot job %s", pilot.scheduler->getJobId());
+            }
+            /* Destroying their schedulers cancels the pilot jobs. */
+            retired.clear();
+            lock.lock();
+            wakeup.wait_for(lock, 1s);
+        }
+
+        lock.unlock();
+        for (auto & starter : starters)
+            starter.join();
+        pilots.clear();
+    }
+};
+
+/* Carries out the cleanup tasks queued by finished builds, when told about
+ * new ones and every minute, to retry the ones that failed. */
+class Cleaner
+{
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool pending = true;
+
+public:
+    void notify()
+    {
+        std::lock_guard lock(mutex);
+        pending = true;
+        wakeup.notify_one();
+    }
+
+    void stop()
+    {
+        notify();
+    }
+
+    void run()
+    {
+        std::unique_lock lock(mutex);
+        while (!quit) {
+            pending = false;
+            lock.unlock();
+            try {
+                CleanupQueue::run();
+            } catch (std::exception & e) {
+                using namespace nix;
+                printError("NSH Error: error while cleaning up after jobs: %s", e.what());
+            }
+            lock.lock();
+            if (!pending)
+                wakeup.wait_for(lock, 60s);
+        }
+    }
+};
+
+/* Forks a session for a forwarded hook invocation. The request has the form
+ * 'hook <verbosity> <fd>...', listing the descriptor numbers the received
+ * descriptors have to be installed at. */
+static pid_t startSession(
+    nix::AutoCloseFD & conn,
+    int zygoteFd,
+    const std::vector<std::string> & request,
+    std::vector<nix::AutoCloseFD> & fds,
+    const struct sigaction & hookAct,
+    std::function<int()> & runHook)
+{
+    if (request.size() < 2 || request.size() - 2 != fds.size())
+        throw BrokerError(nix::fmt("malformed hook request with %d descriptors", fds.size()));
+
+    pid_t pid = fork();
+    if (pid == -1)
+        throw nix::SysError("forking NSH broker session");
+    if (pid)
+        return pid;
+
+    int rc = 1;
+    try {
+        close(zygoteFd);
+        sigaction(SIGTERM, &hookAct, nullptr);
+        signal(SIGINT, SIG_DFL);
+        setRecvTimeout(conn.get(), 0);
+
+        /* Move the received descriptors out of the way first, so that
+         * installing one cannot clobber another. */
+        std::vector<int> moved;
+        for (auto & fd : fds)
+            moved.push_back(fcntl(fd.get(), F_DUPFD, 64));
+        fds.clear();
+        for (size_t i = 0; i < moved.size(); i++) {
+            if (moved[i] == -1 || dup2(moved[i], std::stoi(request[i + 2])) == -1)
+                throw nix::SysError("installing descriptors of NSH broker session");
+            close(moved[i]);
+        }
+
+        nix::verbosity = (nix::Verbosity) std::stoll(request[1]);
+        nix::logger = nix::makeJSONLogger(nix::getStandardError());
+
+        /* Only count the queries made for the build of this session. */
+        pollMetrics.queries = 0;
+        pollMetrics.detections = 0;
+        pollMetrics.detectionLatencyMs = 0;
+
+        /* The client closing the connection means Nix terminated the hook,
+         * so terminate the session the same way to clean up the job. */
+        int connFd = conn.get();
+        std::thread([connFd]() {
+            sigset_t set;
+            sigemptyset(&set);
+            sigaddset(&set, SIGTERM);
+            pthread_sigmask(SIG_BLOCK, &set, nullptr);
+            char c;
+            while (recv(connFd, &c, 1, 0) == -1 && errno == EINTR)
+                ;
+            kill(getpid(), SIGTERM);
+        }).detach();
+
+        rc = runHook();
+    } catch (std::exception & e) {
+        using namespace nix;
+        printError("NSH Error: %s", e.what());
+    }
+
+    auto reply = nix::fmt("%d\n", rc);
+    send(conn.get(), reply.data(), reply.size(), MSG_NOSIGNAL);
+    _exit(rc);
+}
+
+static void reapSessions(std::set<pid_t> & sessions)
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        sessions.erase(pid);
+}
+
+/* Forks the sessions of the broker. Sessions use libslurm, libcurl and the
+ * Nix store and logger, whose locks any thread of the broker may hold at the
+ * time of a fork, so they are forked off this process instead, which is
+ * started before the broker starts any thread and never runs one itself.
+ * Every request arrives on sock as the request line of the client, with the
+ * connection of the client followed by its descriptors. The sessions are
+ * terminated once the broker closes sock. */
+static void runZygote(int sock, const struct sigaction & hookAct, std::function<int()> & runHook)
+{
+    std::set<pid_t> sessions;
+    while (!quit) {
+        reapSessions(sessions);
+
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (!(pfd.revents & (POLLIN | POLLHUP)))
+            continue;
+
+        std::vector<nix::AutoCloseFD> fds;
+        std::vector<std::string> request;
+        try {
+            request = nix::tokenizeString<std::vector<std::string>>(recvLineWithFds(sock, fds), " ");
+        } catch (nix::EndOfFile &) {
+            break;
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: error while receiving NSH broker session: %s", e.what());
+            continue;
+        }
+        if (fds.empty())
+            continue;
+        auto conn = std::move(fds.front());
+        fds.erase(fds.begin());
+
+        try {
+            sessions.insert(startSession(conn, sock, request, fds, hookAct, runHook));
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: error while starting NSH broker session: %s", e.what());
+        }
+    }
+
+    for (auto pid : sessions)
+        kill(pid, SIGTERM);
+    for (auto pid : sessions)
+        waitpid(pid, nullptr, 0);
+}
+
+int runBroker(std::function<int()> runHook)
+{
+    auto socketPath = ourSettings.brokerSocket.get();
+    if (socketPath == "")
+        throw BrokerError("broker-socket setting not configured");
+
+    nix::logger = nix::makeSimpleLogger();
+
+    nix::createDirs(nix::dirOf(socketPath));
+    {
+        auto probe = nix::createUnixDomainSocket();
+        bool listening = true;
+        try {
+            nix::connect(probe.get(), socketPath);
+        } catch (nix::SysError &) {
+            listening = false;
+        }
+        if (listening)
+            throw BrokerError(nix::fmt("another NSH broker is already listening on '%s'", socketPath));
+    }
+    unlink(socketPath.c_str());
+    auto listenFd = nix::createUnixDomainSocket(socketPath, 0600);
+
+    /* Let the SSH connections of all sessions share persistent masters, so
+     * that only the first build on a node pays for the SSH handshake. */
+    if (auto persist = ourSettings.brokerSshPersist.get()) {
+        auto sshOpts = nix::getEnv("NIX_SSHOPTS").value_or("");
+        auto controlPath = nix::dirOf(socketPath) + "/ssh-%C";
+        setenv("NIX_SSHOPTS", nix::fmt("%s -oControlMaster=auto -oControlPath=%s -oControlPersist=%d",
+            sshOpts, controlPath, persist).c_str(), 1);
+    }
+
+    struct sigaction act, hookAct;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    act.sa_handler = handleQuit;
+    if (sigaction(SIGTERM, &act, &hookAct) || sigaction(SIGINT, &act, nullptr))
+        throw nix::SysError("assigning handler for SIGTERM");
+
+    int zygoteFds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, zygoteFds) == -1)
+        throw nix::SysError("creating socket of NSH broker sessions");
+    nix::AutoCloseFD zygoteSock(zygoteFds[0]);
+    pid_t zygote = fork();
+    if (zygote == -1)
+        throw nix::SysError("forking NSH broker sessions process");
+    if (zygote == 0) {
+        zygoteSock.close();
+        listenFd.close();
+        runZygote(zygoteFds[1], hookAct, runHook);
+        _exit(0);
+    }
+    close(zygoteFds[1]);
+
+    std::unique_ptr<JobPoller> poller;
+    std::thread pollerThread;
+    try {
+        poller = std::make_unique<JobPoller>(makeScheduler());
+        pollerThread = std::thread([&]() {
+            sigset_t set;
+            sigemptyset(&set);
+            sigaddset(&set, SIGTERM);
+            sigaddset(&set, SIGINT);
+            pthread_sigmask(SIG_BLOCK, &set, nullptr);
+            poller->run();
+        });
+    } catch (std::exception & e) {
+        using namespace nix;
+        printError("NSH Error: job state polling through the broker disabled: %s", e.what());
+        poller.reset();
+    }
+
+    std::unique_ptr<SubmissionCoalescer> coalescer;
+    std::thread coalescerThread;
+    if (ourSettings.submitCoalesceWindow.get()) {
+        try {
+            coalescer = std::make_unique<SubmissionCoalescer>(makeScheduler());
+            coalescerThread = std::thread([&]() {
+                sigset_t set;
+                sigemptyset(&set);
+                sigaddset(&set, SIGTERM);
+                sigaddset(&set, SIGINT);
+                pthread_sigmask(SIG_BLOCK, &set, nullptr);
+                coalescer->run();
+            });
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: coalescing of job submissions disabled: %s", e.what());
+            coalescer.reset();
+        }
+    }
+
+    std::unique_ptr<PilotPool> pilotPool;
+    std::thread pilotPoolThread;
+    if (ourSettings.pilotPoolSize.get()) {
+        try {
+            pilotPool = std::make_unique<PilotPool>(makeScheduler());
+            pilotPoolThread = std::thread([&]() {
+                sigset_t set;
+                sigemptyset(&set);
+                sigaddset(&set, SIGTERM);
+                sigaddset(&set, SIGINT);
+                pthread_sigmask(SIG_BLOCK, &set, nullptr);
+                pilotPool->run();
+            });
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: pilot job pool disabled: %s", e.what());
+            pilotPool.reset();
+        }
+    }
+
+    Cleaner cleaner;
+    std::thread cleanerThread([&]() {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGTERM);
+        sigaddset(&set, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+        cleaner.run();
+    });
+
+    {
+        using namespace nix;
+        printInfo("NSH broker listening on '%s'", socketPath);
+    }
+
+    while (!quit) {
+        struct pollfd pfd = {listenFd.get(), POLLIN, 0};
+        if (poll(&pfd, 1, 1000) == -1) {
+            if (errno == EINTR)
+                continue;
+            throw nix::SysError("waiting for NSH broker connections");
+        }
+        if (!(pfd.revents & POLLIN))
+            continue;
+
+        nix::AutoCloseFD conn(accept4(listenFd.get(), nullptr, nullptr, SOCK_CLOEXEC));
+        if (!conn) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            throw nix::SysError("accepting NSH broker connection");
+        }
+
+        try {
+            if (!isSameUser(conn.get())) {
+                using namespace nix;
+                printError("NSH Error: rejecting broker connection from another user");
+                continue;
+            }
+            setRecvTimeout(conn.get(), 5);
+
+            std::vector<nix::AutoCloseFD> fds;
+            auto request = nix::tokenizeString<std::vector<std::string>>(recvLineWithFds(conn.get(), fds), " ");
+            if (!request.empty() && request[0] == "hook") {
+                std::vector<int> passed = {conn.get()};
+                for (auto & fd : fds)
+                    passed.push_back(fd.get());
+                sendWithFds(zygoteSock.get(), nix::concatStringsSep(" ", request) + "\n", passed);
+            } else if (request.size() == 3 && request[0] == "wait") {
+                if (poller && servesTarget(request[1]))
+                    poller->add(request[2], std::move(conn));
+                else
+                    sendLine(conn.get(), "unsupported\n");
+            } else if (request.size() == 3 && request[0] == "submit") {
+                /* The request line is followed by '<key>\n<task>', with the
+                 * length given as the last field. */
+                std::string payload(std::stoul(request[2]), 0);
+                nix::readFull(conn.get(), payload.data(), payload.size());
+                auto newline = payload.find('\n');
+                if (newline == std::string::npos)
+                    throw BrokerError("malformed submit request");
+                if (coalescer && servesTarget(request[1]))
+                    coalescer->add(payload.substr(0, newline), payload.substr(newline + 1), std::move(conn));
+                else
+                    sendLine(conn.get(), "unsupported\n");
+            } else if (request.size() == 2 && request[0] == "lease") {
+                if (pilotPool && servesTarget(request[1]))
+                    pilotPool->lease(std::move(conn));
+                else
+                    sendLine(conn.get(), "unsupported\n");
+            } else if (request.size() <= 2 && request[0] == "cleanup") {
+                /* The tasks of a cluster are carried out by its broker. */
+                if ((request.size() == 2 ? request[1] : "") == currentCluster()) {
+                    cleaner.notify();
+                    sendLine(conn.get(), "ok\n");
+                } else
+                    sendLine(conn.get(), "unsupported\n");
+            } else {
+                using namespace nix;
+                printError("NSH Error: unknown broker request '%s'", request.empty() ? "" : request[0]);
+            }
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: error while handling broker connection: %s", e.what());
+        }
+    }
+
+    /* The sessions process terminates the sessions once its socket is
+     * closed. */
+    zygoteSock.close();
+    while (waitpid(zygote, nullptr, 0) == -1 && errno == EINTR)
+        ;
+    unlink(socketPath.c_str());
+
+    if (poller) {
+        poller->stop();
+        pollerThread.join();
+    }
+
+    if (coalescer) {
+        coalescer->stop();
+        coalescerThread.join();
+    }
+
+    if (pilotPool) {
+        pilotPool->stop();
+        pilotPoolThread.join();
+    }
+
+    cleaner.stop();
+    cleanerThread.join();
+
+    return 0;
+}
+
+std::optional<int> forwardToBroker(const std::string & socketPath)
+{
+    auto sock = nix::createUnixDomainSocket();
+    try {
+        nix::connect(sock.get(), socketPath);
+    } catch (nix::SysError & e) {
+        using namespace nix;
+        debug("NSH broker not available, handling the build locally: %s", e.what());
+        return std::nullopt;
+    }
+
+    std::vector<int> fds;
+    auto request = nix::fmt("hook %d", (int) nix::verbosity);
+    for (int fd : {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, 4, 5}) {
+        if (fcntl(fd, F_GETFD) == -1)
+            continue;
+        fds.push_back(fd);
+        request += nix::fmt(" %d", fd);
+    }
+    sendWithFds(sock.get(), request + "\n", fds);
+
+    try {
+        return std::stoi(nix::readLine(sock.get()));
+    } catch (nix::EndOfFile &) {
+        using namespace nix;
+        printError("NSH Error: NSH broker session terminated unexpectedly");
+        return 1;
+    }
+}
+
+std::optional<std::pair<int, std::string>> waitForJobViaBroker(
+    const std::string & socketPath,
+    const std::string & jobScheduler,
+    const std::string & jobId)
+{
+    auto sock = nix::createUnixDomainSocket();
+    try {
+        nix::connect(sock.get(), socketPath);
+    } catch (nix::SysError & e) {
+        using namespace nix;
+        debug("NSH broker not available, polling job %s directly: %s", jobId, e.what());
+        return std::nullopt;
+    }
+
+    sendLine(sock.get(), nix::fmt("wait %s %s\n", brokerTarget(jobScheduler), jobId));
+
+    std::vector<std::string> reply;
+    try {
+        reply = nix::tokenizeString<std::vector<std::string>>(nix::readLine(sock.get()), " ");
+    } catch (nix::EndOfFile &) {
+        using namespace nix;
+        printError("NSH Error: lost connection to the NSH broker while waiting for job %s, polling directly", jobId);
+        return std::nullopt;
+    }
+    if (reply.size() != 2)
+        return std::nullopt;
+    return std::make_pair(std::stoi(reply[0]), reply[1]);
+}
+
+std::optional<std::string> submitJobViaBroker(
+    const std::string & socketPath,
+    const std::string & jobScheduler,
+    const std::string & key,
+    const std::string & task)
+{
+    auto sock = nix::createUnixDomainSocket();
+    try {
+        nix::connect(sock.get(), socketPath);
+    } catch (nix::SysError & e) {
+        using namespace nix;
+        debug("NSH broker not available, submitting the job directly: %s", e.what());
+        return std::nullopt;
+    }
+
+    auto payload = key + "\n" + task;
+    if (!sendLine(sock.get(), nix::fmt("submit %s %d\n%s", brokerTarget(jobScheduler), payload.size(), payload)))
+        throw BrokerError("unable to send the job to the NSH broker");
+
+    std::string reply;
+    try {
+        reply = nix::readLine(sock.get());
+    } catch (nix::EndOfFile &) {
+        throw BrokerError("lost connection to the NSH broker while submitting the job");
+    }
+    if (reply == "unsupported")
+        return std::nullopt;
+    if (reply.starts_with("error "))
+        throw BrokerError(reply.substr(6));
+    return reply;
+}
+
+std::optional<PilotLease> leasePilotViaBroker(
+    const std::string & socketPath,
+    const std::string & jobScheduler)
+{
+    PilotLease lease;
+    lease.conn = nix::createUnixDomainSocket();
+    try {
+        nix::connect(lease.conn.get(), socketPath);
+    } catch (nix::SysError & e) {
+        using namespace nix;
+        debug("NSH broker not available, submitting a job for the build: %s", e.what());
+        return std::nullopt;
+    }
+
+    if (!sendLine(lease.conn.get(), nix::fmt("lease %s\n", brokerTarget(jobScheduler))))
+        return std::nullopt;
+
+    std::vector<std::string> reply;
+    try {
+        reply = nix::tokenizeString<std::vector<std::string>>(nix::readLine(lease.conn.get()), " ");
+    } catch (nix::EndOfFile &) {
+        return std::nullopt;
+    }
+    if (reply.size() != 3)
+        return std::nullopt;
+    lease.jobId = reply[0];
+    lease.host = reply[1];
+    lease.dir = reply[2];
+    return lease;
+}
+
+bool notifyCleanupViaBroker(const std::string & socketPath)
+{
+    auto sock = nix::createUnixDomainSocket();
+    try {
+        nix::connect(sock.get(), socketPath);
+    } catch (nix::SysError &) {
+        return false;
+    }
+    if (!sendLine(sock.get(), currentCluster().empty() ? "cleanup\n" : "cleanup " + currentCluster() + "\n"))
+        return false;
+    try {
+        return nix::readLine(sock.get()) == "ok";
+    } catch (nix::EndOfFile &) {
+        return false;
+    }
+}
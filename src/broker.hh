@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <optional>
+#include <utility>
+#include <functional>
+#include <stdexcept>
+
+#include <nix/util/file-descriptor.hh>
+
+struct BrokerError : public std::runtime_error
+{
+    explicit BrokerError(const std::string &s) : std::runtime_error(s) {}
+};
+
+/* Runs the long-lived broker daemon ('nsh daemon'). Every hook invocation
+ * forwarded to the broker is handled by a session, which calls runHook with
+ * the hook's file descriptors in place. Sessions are forked off a
+ * single-threaded process started before the threads of the daemon. Every
+ * session opens a scheduler connection of its own, only the job state
+ * queries and coalesced submissions go through those of the broker.
+ * @return Exit code of the daemon. */
+int runBroker(std::function<int()> runHook);
+
+/* Hands the current hook invocation over to the broker listening on
+ * socketPath and waits for its session to finish.
+ * @return Exit code of the session, or std::nullopt if no broker is
+ * listening and the hook should be processed locally. */
+std::optional<int> forwardToBroker(const std::string & socketPath);
+
+/* Waits for a job to finish through the shared job state poller of the
+ * broker listening on socketPath.
+ * @return Exit code and final state of the job, or std::nullopt if no broker
+ * is available for the given scheduler. */
+std::optional<std::pair<int, std::string>> waitForJobViaBroker(
+    const std::string & socketPath,
+    const std::string & jobScheduler,
+    const std::string & jobId);
+
+/* Submits a job through the submission coalescer of the broker listening on
+ * socketPath, which submits it as part of a job array together with the
+ * jobs of other hooks that have the same key.
+ * @return Id of the array task running the job, or std::nullopt if no broker
+ * coalesces submissions for the given scheduler. */
+std::optional<std::string> submitJobViaBroker(
+    const std::string & socketPath,
+    const std::string & jobScheduler,
+    const std::string & key,
+    const std::string & task);
+
+/* A slot of a pilot job leased from the broker, held until conn is closed. */
+struct PilotLease
+{
+    std::string jobId;
+    std::string host;
+    /* Directory on the node for the files of the build. */
+    std::string dir;
+    nix::AutoCloseFD conn;
+};
+
+/* Leases a free slot of the pilot jobs kept by the broker listening on
+ * socketPath.
+ * @return The lease, or std::nullopt if no broker keeps pilot jobs for the
+ * given scheduler or none of them has a free slot. */
+std::optional<PilotLease> leasePilotViaBroker(
+    const std::string & socketPath,
+    const std::string & jobScheduler);
+
+/* Tells the broker listening on socketPath that cleanup tasks were queued.
+ * @return Whether the broker will carry them out. */
+bool notifyCleanupViaBroker(const std::string & socketPath);
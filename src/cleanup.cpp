@@ -0,0 +1,263 @@
+#include "cleanup.hh"
+#include "broker.hh"
+#include "placement.hh"
+#include "retention.hh"
+#include "settings.hh"
+#include "upload-registry.hh"
+#include "state.hh"
+#include "validity-cache.hh"
+
+#include <filesystem>
+#include <map>
+#include <random>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <nix/store/pathlocks.hh>
+#include <nix/store/ssh-store.hh>
+#include <nix/store/ssh.hh>
+#include <nix/store/store-open.hh>
+#include <nix/util/current-process.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/fmt.hh>
+#include <nix/util/logging.hh>
+#include <nix/util/strings.hh>
+
+/* Number of attempts at the tasks of a host before leaving them to a later
+ * cleaner, waiting 1, 2, 4... seconds in between. */
+#define CLEANUP_MAX_ATTEMPTS 5
+
+std::string CleanupQueue::directory;
+
+/* Writes task as '<key> <value>' lines, atomically so that a cleaner never
+ * sees half of it. */
+static void writeTask(const CleanupQueue::Task & task)
+{
+    std::random_device rd;
+    auto name = nix::fmt("%s/%d-%d-%08x", CleanupQueue::directory, time(nullptr), getpid(), std::uniform_int_distribution<uint32_t>()(rd));
+    std::string contents = nix::fmt("host %s\ngc %d\n", task.host, task.collectGarbage ? 1 : 0);
+    for (auto & file : task.files)
+        contents += "rm " + file + "\n";
+    if (!task.cluster.empty())
+        contents += "cluster " + task.cluster + "\n";
+    nix::writeFile(name + ".tmp", contents, 0600);
+    if (rename((name + ".tmp").c_str(), (name + ".task").c_str()) == -1)
+        throw nix::SysError("renaming '%s' to '%s'", name + ".tmp", name + ".task");
+}
+
+static CleanupQueue::Task readTask(const std::string & path)
+{
+    CleanupQueue::Task task;
+    for (auto & line : nix::tokenizeString<std::vector<std::string>>(nix::readFile(path), "\n")) {
+        auto space = line.find(' ');
+        if (space == std::string::npos)
+            continue;
+        auto key = line.substr(0, space), value = line.substr(space + 1);
+        if (key == "host")
+            task.host = value;
+        else if (key == "gc")
+            task.collectGarbage = value == "1";
+        else if (key == "rm")
+            task.files.push_back(value);
+        else if (key == "cluster")
+            task.cluster = value;
+    }
+    return task;
+}
+
+/* Starts a detached 'nsh cleanup' process working through the tasks of
+ * cluster in the queue, which is not waited for. Its errors go to
+ * cleaner.log in the queue directory. */
+static void spawnCleaner(const std::string & cluster)
+{
+    auto self = nix::getSelfExe().value_or("nsh");
+    auto logPath = CleanupQueue::directory + "/cleaner.log";
+    long maxFd = sysconf(_SC_OPEN_MAX);
+    pid_t pid = fork();
+    if (pid == -1)
+        throw nix::SysError("forking cleaner");
+    if (pid == 0) {
+        /* Fork again so that the cleaner is not our child, and is neither
+         * left as a zombie nor killed along with our process group. */
+        if (setsid() == -1 || fork() != 0)
+            _exit(0);
+        int null = open("/dev/null", O_RDWR);
+        int log = open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+        if (null == -1 || log == -1)
+            _exit(1);
+        dup2(null, 0);
+        dup2(null, 1);
+        dup2(log, 2);
+        /* Holding on to the build log or the other descriptors of the hook
+         * would keep Nix waiting for us. */
+        for (long fd = 3; fd < maxFd; fd++)
+            close(fd);
+        if (cluster.empty())
+            execlp(self.c_str(), "nsh", "cleanup", nullptr);
+        else
+            execlp(self.c_str(), "nsh", "cleanup", cluster.c_str(), nullptr);
+        _exit(1);
+    }
+    waitpid(pid, nullptr, 0);
+}
+
+/* Carries out tasks, all for host, with a single SSH command. The retained
+ * paths of garbage collection are written to the command's stdin. Garbage
+ * is not collected while builds are using the node, but the files are
+ * removed regardless.
+ * @return Whether garbage collection was left undone for that reason. */
+static bool runTasks(const std::string & host, const std::vector<CleanupQueue::Task> & tasks)
+{
+    bool collectGarbage = false;
+    nix::Strings files;
+    for (auto & task : tasks) {
+        collectGarbage = collectGarbage || task.collectGarbage;
+        for (auto & file : task.files)
+            files.push_back(nix::shellEscape(file));
+    }
+
+    /* Builds using the node keep it from being collected. */
+    nix::AutoCloseFD nodeLock;
+    bool deferred = false;
+    if (collectGarbage && !currentLoadDir().empty()) {
+        nodeLock = nix::openLockFile(nodeStateFile(host, ".use"), true);
+        if (!nix::lockFile(nodeLock.get(), nix::ltWrite, false)) {
+            collectGarbage = false;
+            deferred = true;
+        }
+    }
+
+    auto binDir = ourSettings.remoteNixBinDir.get();
+    auto script = nix::fmt("ns=%s st=%s; export ns st; rm -rf %s; rc=$?",
+        nix::shellEscape((binDir != "" ? binDir + "/" : "") + "nix-store"),
+        nix::shellEscape(ourSettings.remoteStore.get()),
+        nix::concatStringsSep(" ", files));
+    std::vector<std::string> retained;
+    if (collectGarbage) {
+        if (StoreRetention::enabled())
+            retained = StoreRetention(host).retain(ourSettings.remoteStoreBudget.get());
+        /* Derivations are not needed by later builds on the node. */
+        std::erase_if(retained, [](auto & path) { return nix::hasSuffix(path, ".drv"); });
+        /* Protect the retained paths, read from stdin, with GC roots of
+         * their own for the duration of the GC. Paths that are no longer
+         * valid are skipped, so that --realise, which is what registers the
+         * roots, neither builds nor substitutes anything. Failing to root
+         * them does not keep the GC from running. */
+        if (!retained.empty())
+            script += "; d=\"$HOME/.cache/nsh/retained-$(hostname)\"; "
+                "rm -rf \"$d\" && mkdir -p \"$d\" && "
+                "xargs -r sh -c '"
+                "\"$ns\" --store \"$st\" --check-validity --print-invalid \"$@\" >\"$0/invalid-$$\" && "
+                "for p; do grep -qxF \"$p\" \"$0/invalid-$$\" || echo \"$p\"; done | "
+                "xargs -r \"$ns\" --store \"$st\" --add-root \"$0/r-$$\" --realise >/dev/null' \"$d\"";
+        script += "; \"$ns\" --gc --store \"$st\" >/dev/null || rc=$?";
+    }
+    script += "; exit $rc";
+
+    auto baseStoreConfig = nix::resolveStoreConfig(nix::StoreReference::parse("ssh-ng://" + host));
+    auto sshStoreConfig = std::dynamic_pointer_cast<nix::SSHStoreConfig>(baseStoreConfig.get_ptr());
+    auto sshMaster = sshStoreConfig->createSSHMaster(false);
+    nix::Strings cmd = {"sh", "-c", nix::shellEscape(script)};
+    auto conn = sshMaster.startCommand(std::move(cmd));
+    if (!retained.empty())
+        nix::writeFull(conn->in.get(), nix::concatStringsSep("\n", retained) + "\n");
+    conn->in.close();
+    int rc = conn->sshPid.wait();
+    UploadRegistry::prune(host);
+    if (collectGarbage) {
+        ValidityCache(host).invalidate();
+        ResidentPaths(host).reset(retained);
+    }
+    if (rc)
+        throw std::runtime_error(nix::fmt("cleanup command exited with %d", rc));
+    return deferred;
+}
+
+nix::AutoCloseFD CleanupQueue::useNode(const std::string & host)
+{
+    if (currentLoadDir().empty())
+        return {};
+    auto lock = nix::openLockFile(nodeStateFile(host, ".use"), true);
+    nix::lockFile(lock.get(), nix::ltRead, true);
+    return lock;
+}
+
+void CleanupQueue::enqueue(const Task & task)
+{
+    if (directory.empty()) {
+        runTasks(task.host, {task});
+        return;
+    }
+    /* Builds starting on the node before the cleaner gets to it must not
+     * trust paths that are about to be collected. */
+    if (task.collectGarbage) {
+        ValidityCache(task.host).invalidate();
+        ResidentPaths(task.host).clear();
+    }
+    writeTask(task);
+    auto socketPath = ourSettings.brokerSocket.get();
+    if (socketPath == "" || !notifyCleanupViaBroker(socketPath))
+        spawnCleaner(task.cluster);
+}
+
+bool CleanupQueue::run()
+{
+    if (directory.empty())
+        return true;
+
+    /* Tasks locked by another cleaner are in progress; the ones already
+     * removed by it are done. */
+    struct Locked
+    {
+        std::string path;
+        nix::AutoCloseFD lock;
+    };
+    std::map<std::string, std::pair<std::vector<Task>, std::vector<Locked>>> byHost;
+    for (auto & entry : std::filesystem::directory_iterator(directory)) {
+        if (entry.path().extension() != ".task")
+            continue;
+        auto path = entry.path().string();
+        auto lock = nix::openLockFile(path, false);
+        if (!lock || !nix::lockFile(lock.get(), nix::ltWrite, false))
+            continue;
+        struct stat st;
+        if (fstat(lock.get(), &st) == -1 || st.st_nlink == 0)
+            continue;
+        auto task = readTask(path);
+        if (task.cluster != currentCluster())
+            continue;
+        auto & host = byHost[task.host];
+        host.first.push_back(std::move(task));
+        host.second.push_back({path, std::move(lock)});
+    }
+
+    bool ok = true;
+    for (auto & [host, queued] : byHost) {
+        for (unsigned attempt = 1; ; attempt++) {
+            try {
+                /* The garbage left to collect is queued again, as a single
+                 * task for a later cleaner. */
+                if (runTasks(host, queued.first)) {
+                    using namespace nix;
+                    debug("builds are using '%s', leaving its garbage collection for later", host);
+                    writeTask({host, {}, true, currentCluster()});
+                }
+                for (auto & locked : queued.second)
+                    unlink(locked.path.c_str());
+                break;
+            } catch (std::exception & e) {
+                using namespace nix;
+                if (attempt >= CLEANUP_MAX_ATTEMPTS) {
+                    printError("NSH Error: cleanup on '%s' failed, leaving it for a later attempt: %s", host, e.what());
+                    ok = false;
+                    break;
+                }
+                debug("cleanup on '%s' failed, retrying: %s", host, e.what());
+                sleep(1 << (attempt - 1));
+            }
+        }
+    }
+    return ok;
+}
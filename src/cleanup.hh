@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <nix/util/file-descriptor.hh>
+
+/* Queue of the teardown work left on the build nodes by finished jobs:
+ * removing the files of the job and collecting garbage. Tasks are kept as
+ * files in the current-load directory and carried out in the background, by
+ * the broker if one is running and otherwise by a detached 'nsh cleanup'
+ * process, so that the hook exits as soon as the outputs are registered.
+ * A task stays queued until it succeeds, and every cleaner also retries the
+ * tasks that earlier ones failed to carry out. */
+class CleanupQueue
+{
+public:
+    /* Directory holding the queued tasks. Tasks are carried out right away
+     * while empty. */
+    static std::string directory;
+
+    struct Task
+    {
+        std::string host;
+        std::vector<std::string> files;
+        bool collectGarbage = false;
+        /* Cluster of the node, see currentCluster(). */
+        std::string cluster;
+    };
+
+    /* Queues task and makes sure that a cleaner picks it up. */
+    static void enqueue(const Task & task);
+
+    /* Takes a shared lock on the remote store of host, held by a build
+     * while it uploads to and builds on the node. Cleaners do not collect
+     * garbage on the node while it is held, and a build starting during a
+     * collection waits for it to finish.
+     * @return The lock, released when closed. */
+    static nix::AutoCloseFD useNode(const std::string & host);
+
+    /* Carries out the queued tasks of the current cluster that no other
+     * cleaner is working on, with a single SSH command per host.
+     * @return Whether all of them succeeded. */
+    static bool run();
+};
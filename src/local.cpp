@@ -0,0 +1,306 @@
+#include "local.hh"
+#include "settings.hh"
+#include "sched_util.hh"
+
+#include <thread>
+#include <optional>
+#include <filesystem>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+using namespace std::chrono_literals;
+
+#include <nix/store/pathlocks.hh>
+#include <nix/util/current-process.hh>
+#include <nix/util/file-system.hh>
+
+Local::Local()
+{
+    stateDir = ourSettings.localStateDir.get();
+    if (stateDir == "")
+        throw LocalConfigError("local-state-dir must be set to use the local scheduler");
+    nix::createDirs(stateDir);
+}
+
+/* Reads the exit code of the job whose files start with jobFiles.
+ * @return Status of the job, or std::nullopt if it has not ended. */
+static std::optional<Scheduler::JobStatus> readExitCode(const std::string & jobFiles)
+{
+    if (!nix::pathExists(jobFiles + ".exit"))
+        return std::nullopt;
+    int rc = std::stoi(nix::readFile(jobFiles + ".exit"));
+    return Scheduler::JobStatus{false, rc, rc == -1 ? "SIGNALED" : rc == 0 ? "COMPLETED" : "FAILED"};
+}
+
+/* @return Status of the job whose files start with jobFiles, or std::nullopt
+ * if there is no such job. */
+static std::optional<Scheduler::JobStatus> queryJob(const std::string & jobFiles)
+{
+    if (auto status = readExitCode(jobFiles))
+        return status;
+    auto lock = nix::openLockFile(jobFiles + ".pid", false);
+    if (!lock)
+        return std::nullopt;
+    if (nix::lockFile(lock.get(), nix::ltRead, false)) {
+        /* The runner is gone, but may have written the exit code after we
+         * looked for it. */
+        if (auto status = readExitCode(jobFiles))
+            return status;
+        return Scheduler::JobStatus{false, -1, "LOST"};
+    }
+    return Scheduler::JobStatus{true, 0, nix::pathExists(jobFiles + ".start") ? "RUNNING" : "PENDING"};
+}
+
+void Local::startJob(const std::string & id, const std::string & script)
+{
+    auto jobFiles = stateDir + "/" + id;
+    jobStderr = jobFiles + ".stderr";
+    nix::writeFile(jobFiles + ".sh", script, 0700);
+
+    /* The lock on the pid file is taken here and handed down to the runner,
+     * so that the job never looks dead before the runner has started. */
+    auto lock = nix::openLockFile(jobFiles + ".pid", true);
+    nix::lockFile(lock.get(), nix::ltWrite, true);
+    nix::AutoCloseFD null = open("/dev/null", O_RDWR | O_CLOEXEC);
+    nix::AutoCloseFD err = open(jobStderr.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (!null || !err)
+        throw nix::SysError("opening the standard error of job %s", id);
+    auto jobFilesArg = jobFiles.c_str();
+    auto self = nix::getSelfExe().value_or("nsh");
+    long maxFd = sysconf(_SC_OPEN_MAX);
+
+    {
+        SignalsBlocked blocked;
+        pid_t pid = fork();
+        if (pid == -1)
+            throw nix::SysError("forking runner of job %s", id);
+        if (pid == 0) {
+            /* Fork again so that the runner is not our child, and is
+             * neither left as a zombie nor killed along with our process
+             * group. The session we start is the process group of the
+             * runner and the job, which keeps the id of the intermediate
+             * child. */
+            if (setsid() == -1 || fork() != 0)
+                _exit(0);
+            dup2(null.get(), 0);
+            dup2(null.get(), 1);
+            dup2(err.get(), 2);
+            dup2(lock.get(), 3);
+            fcntl(3, F_SETFD, 0);
+            for (long fd = 4; fd < maxFd; fd++)
+                close(fd);
+            execlp(self.c_str(), "nsh", "local-job", jobFilesArg, nullptr);
+            _exit(1);
+        }
+        waitpid(pid, nullptr, 0);
+        jobId = id;
+        nix::writeFull(lock.get(), std::to_string(pid));
+    }
+
+    waitForJobRunning();
+}
+
+void Local::waitForJobRunning()
+{
+    auto jobFiles = stateDir + "/" + jobId;
+    auto expected = JobPoll::Clock::now() + std::chrono::milliseconds(ourSettings.localQueueDelay.get());
+    JobPoll poll(1s);
+    while (true) {
+        auto status = queryJob(jobFiles);
+        poll.queried();
+        if (!status || status->state != "PENDING") {
+            std::optional<JobPoll::Clock::time_point> startTime;
+            if (nix::pathExists(jobFiles + ".start"))
+                startTime = JobPoll::Clock::time_point(std::chrono::milliseconds(std::stoll(nix::readFile(jobFiles + ".start"))));
+            poll.detected(startTime);
+            break;
+        }
+        pollSleep(poll, expected);
+    }
+    hostname = ourSettings.localHost.get();
+}
+
+void Local::submit(nix::StorePath drvPath)
+{
+    /* The files of every job have names of their own, so that a later job
+     * building the same derivation does not lose them to the cleanup of an
+     * earlier one. */
+    auto id = "job-" + std::string(drvPath.hashPart()) + "-" + readyToken;
+    rootPath = stateDir + "/" + id + ".root";
+    startJob(id, genScript(drvPath, rootPath, readyToken, stagedPaths));
+}
+
+int Local::waitForJobFinish()
+{
+    if (auto rc = waitForPilotBuild())
+        return *rc;
+    if (auto rc = waitForJobFinishViaBroker())
+        return *rc;
+
+    /* The runner holds the lock on its pid file until the job has ended,
+     * so there is no need to poll. */
+    auto jobFiles = stateDir + "/" + jobId;
+    if (auto lock = nix::openLockFile(jobFiles + ".pid", false))
+        nix::lockFile(lock.get(), nix::ltRead, true);
+    auto status = queryJob(jobFiles);
+    if (!status)
+        throw std::runtime_error(nix::fmt("the files of job %s have disappeared", jobId));
+    if (status->exitCode == -1) {
+        using namespace nix;
+        printError("NSH Error: unexpected job state %s", status->state);
+    }
+    return status->exitCode;
+}
+
+std::map<std::string, Scheduler::JobStatus> Local::queryJobs(const std::set<std::string> & jobIds)
+{
+    std::map<std::string, JobStatus> statuses;
+    for (auto & id : jobIds)
+        if (auto status = queryJob(stateDir + "/" + id))
+            statuses[id] = *status;
+    return statuses;
+}
+
+std::string Local::submitPilot(const std::string & script)
+{
+    startJob("pilot-" + readyToken, script);
+    return stateDir;
+}
+
+std::string Local::pilotLauncher(const std::string & pilotJob)
+{
+    /* Builds in a pilot job run next to it, the pilot job only holds on to
+     * its slot. */
+    return "";
+}
+
+/* @return Number of jobs that run at a time. */
+static unsigned int slotCount()
+{
+    unsigned int slots = ourSettings.localSlots.get();
+    if (slots == 0)
+        slots = std::max(std::thread::hardware_concurrency(), 1u);
+    return slots;
+}
+
+Scheduler::QueueEstimate Local::estimateQueue()
+{
+    QueueEstimate estimate;
+    unsigned int running = 0;
+    for (auto & entry : std::filesystem::directory_iterator(stateDir)) {
+        auto name = entry.path().string();
+        if (!name.ends_with(".pid"))
+            continue;
+        auto status = queryJob(name.substr(0, name.size() - 4));
+        if (status && status->live && status->state == "PENDING")
+            estimate.pendingJobs++;
+        else if (status && status->live)
+            running++;
+    }
+    /* A job only starts right away if it does not have to wait for a slot. */
+    if (estimate.pendingJobs == 0 && running < slotCount())
+        estimate.startDelay = std::chrono::seconds(0);
+    return estimate;
+}
+
+/* Takes one of local-slots slots, held as a lock on its file. Runners waiting
+ * for a slot queue on the lock of 'queue.lock', so that only the first of
+ * them looks at the slots. It takes a free slot if there is one, and
+ * otherwise waits for the slot after the one the runner before it took, so
+ * that the waits go around the slots instead of polling them. */
+static nix::AutoCloseFD acquireSlot(const std::string & stateDir)
+{
+    auto slots = slotCount();
+    auto queue = nix::openLockFile(stateDir + "/queue.lock", true);
+    nix::lockFile(queue.get(), nix::ltWrite, true);
+    for (unsigned int i = 0; i < slots; i++) {
+        auto slot = nix::openLockFile(nix::fmt("%s/slot-%d.lock", stateDir, i), true);
+        if (nix::lockFile(slot.get(), nix::ltWrite, false))
+            return slot;
+    }
+    auto next = stateDir + "/queue.next";
+    unsigned int i = 0;
+    if (auto contents = nix::pathExists(next) ? nix::readFile(next) : ""; !contents.empty())
+        i = std::stoul(contents) % slots;
+    nix::writeFile(next, std::to_string((i + 1) % slots));
+    auto slot = nix::openLockFile(nix::fmt("%s/slot-%d.lock", stateDir, i), true);
+    nix::lockFile(slot.get(), nix::ltWrite, true);
+    return slot;
+}
+
+int Local::runJob(const std::string & jobFiles)
+{
+    try {
+        /* The job is cancelled by killing our process group, which we leave
+         * to the default action of SIGTERM. */
+        signal(SIGTERM, SIG_DFL);
+        unblockSignals();
+        fcntl(3, F_SETFD, FD_CLOEXEC);
+        auto stateDir = std::string(nix::dirOf(jobFiles));
+        if (chdir(stateDir.c_str()) == -1)
+            throw nix::SysError("changing to '%s'", stateDir);
+        static char pathVar[] = PATH_VAR;
+        putenv(pathVar);
+        /* The job builds with the Nix of this machine, which must not hand
+         * the build back to us. */
+        auto nixConfig = getenv("NIX_CONFIG");
+        setenv("NIX_CONFIG", nix::fmt("%s\nbuild-hook =\n", nixConfig ? nixConfig : "").c_str(), 1);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(ourSettings.localQueueDelay.get()));
+        auto slot = acquireSlot(stateDir);
+        auto now = std::chrono::duration_cast<std::chrono::milliseconds>(JobPoll::Clock::now().time_since_epoch());
+        nix::writeFile(jobFiles + ".start", std::to_string(now.count()));
+
+        auto scriptPath = jobFiles + ".sh";
+        pid_t pid = fork();
+        if (pid == -1)
+            throw nix::SysError("forking job");
+        if (pid == 0) {
+            execl("/bin/sh", "sh", scriptPath.c_str(), nullptr);
+            _exit(127);
+        }
+        int status;
+        while (waitpid(pid, &status, 0) == -1)
+            if (errno != EINTR)
+                throw nix::SysError("waiting for job");
+
+        /* Written atomically, so that the exit code is never read half
+         * written. */
+        int rc = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        nix::writeFile(jobFiles + ".exit.tmp", std::to_string(rc));
+        if (rename((jobFiles + ".exit.tmp").c_str(), (jobFiles + ".exit").c_str()) == -1)
+            throw nix::SysError("renaming '%s'", jobFiles + ".exit.tmp");
+        return 0;
+    } catch (std::exception & e) {
+        using namespace nix;
+        printError("NSH Error: local job runner failed: %s", e.what());
+        return 1;
+    }
+}
+
+Local::~Local()
+{
+    if (jobId.empty())
+        return;
+    auto jobFiles = stateDir + "/" + jobId;
+    try {
+        auto status = queryJob(jobFiles);
+        if (status && status->live) {
+            pid_t pgid = std::stoi(nix::readFile(jobFiles + ".pid"));
+            if (kill(-pgid, SIGTERM) == -1 && errno != ESRCH) {
+                using namespace nix;
+                printError("error killing job %s: %s", jobId, strerror(errno));
+            }
+        }
+        for (auto suffix : {".sh", ".pid", ".start", ".exit"})
+            unlink((jobFiles + suffix).c_str());
+        /* Without an SSH connection, nothing queues the removal of the
+         * standard error of the job, as for pilot jobs. */
+        if (!sshMaster)
+            unlink(jobStderr.c_str());
+    } catch (std::exception & e) {
+        using namespace nix;
+        printError("NSH Error: error during teardown of job %s: %s", jobId, e.what());
+    }
+}
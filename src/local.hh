@@ -0,0 +1,49 @@
+#include "scheduler.hh"
+
+#include <string>
+#include <exception>
+
+#include <nix/store/path.hh>
+
+struct LocalConfigError : public std::runtime_error
+{
+    explicit LocalConfigError(const std::string &s) : std::runtime_error(s) {}
+};
+
+/* Runs the jobs on this machine, as detached 'nsh local-job' processes that
+ * take one of local-slots slots and then run the job script, and builds
+ * through an ssh-ng store on local-host. Every job has the id of its files in
+ * local-state-dir:
+ *
+ * - '<id>.sh': the job script;
+ * - '<id>.pid': the process id of the runner, which holds a lock on the file
+ *   while it is alive;
+ * - '<id>.start': the start time of the job, once it has a slot;
+ * - '<id>.exit': the exit code of the job, -1 if it was killed by a signal;
+ * - '<id>.stderr': the standard error of the runner and the job. */
+class Local : public Scheduler
+{
+public:
+    Local();
+    ~Local();
+    void submit(nix::StorePath drvPath);
+    int waitForJobFinish();
+    std::map<std::string, JobStatus> queryJobs(const std::set<std::string> & jobIds);
+    QueueEstimate estimateQueue();
+    std::string submitPilot(const std::string & script);
+    std::string pilotLauncher(const std::string & pilotJob);
+
+    /* Body of the runner of the job whose files start with jobFiles, run as
+     * 'nsh local-job <jobFiles>' with the lock on '<jobFiles>.pid' on
+     * descriptor 3.
+     * @return Exit code of the runner. */
+    static int runJob(const std::string & jobFiles);
+
+protected:
+    /* Starts the runner of a job running script, and waits until it has a
+     * slot. */
+    void startJob(const std::string & id, const std::string & script);
+    void waitForJobRunning();
+
+    std::string stateDir;
+};
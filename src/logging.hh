@@ -1,5 +1,10 @@
 #include <memory>
 #include <string>
+#include <vector>
+#include <cstring>
+#include <string_view>
+#include <poll.h>
+#include <unistd.h>
 
 #include <nix/util/serialise.hh>
 #include <nix/store/globals.hh>
@@ -7,34 +12,130 @@
 
 #define NSH_BUILD_LOG_TERMINATOR "@nsh done"
 
-bool handleOutput(std::ostream & logOs, std::string_view data)
+/* Size of the buffer the build log is read into from the job. */
+#define NSH_LOG_BUFFER_SIZE 65536
+
+/* Splits the build log streamed from a job into lines, applying carriage
+ * returns to the current line the way a terminal would, and stops at the log
+ * terminator. Control characters are located with memchr() over whole chunks,
+ * and runs of complete lines without carriage returns are written out in a
+ * single call. */
+class BuildLogSplitter
 {
-    using namespace nix;
-    static unsigned long logSize = 0;
-    static size_t currentLogLinePos = 0;
-    static std::string currentLogLine;
-    logSize += data.size();
-    if (settings.maxLogSize && logSize > settings.maxLogSize) {
-        throw BuildError(
-            BuildResult::LogLimitExceeded,
-            "wrote more than %d bytes of log output",
-            settings.maxLogSize);
+    unsigned long logSize = 0;
+    size_t currentLogLinePos = 0;
+    std::string currentLogLine;
+
+    /* Writes text without control characters into the current line at the
+     * position the last carriage return left it at. */
+    void append(const char * begin, const char * end)
+    {
+        size_t len = end - begin;
+        if (currentLogLinePos + len > currentLogLine.size())
+            currentLogLine.resize(currentLogLinePos + len);
+        memcpy(currentLogLine.data() + currentLogLinePos, begin, len);
+        currentLogLinePos += len;
+    }
+
+    /* @return Whether the finished line is the log terminator. */
+    bool endLine(std::ostream & logOs)
+    {
+        if (currentLogLine == NSH_BUILD_LOG_TERMINATOR)
+            return true;
+        currentLogLine += '\n';
+        logOs.write(currentLogLine.data(), currentLogLine.size());
+        currentLogLine.clear();
+        currentLogLinePos = 0;
+        return false;
     }
 
-    for (auto c : data)
-        if (c == '\r')
-            currentLogLinePos = 0;
-        else if (c == '\n') {
-            if (currentLogLine != NSH_BUILD_LOG_TERMINATOR) {
-                logOs << currentLogLine << '\n';
-                currentLogLine.clear();
+public:
+    /* @return Whether the log terminator was reached. */
+    bool handleOutput(std::ostream & logOs, std::string_view data)
+    {
+        using namespace nix;
+        logSize += data.size();
+        if (settings.maxLogSize && logSize > settings.maxLogSize) {
+            throw BuildError(
+                BuildResult::LogLimitExceeded,
+                "wrote more than %d bytes of log output",
+                settings.maxLogSize);
+        }
+
+        constexpr std::string_view terminatorLine = NSH_BUILD_LOG_TERMINATOR "\n";
+        constexpr std::string_view terminator = "\n" NSH_BUILD_LOG_TERMINATOR "\n";
+
+        const char * p = data.data();
+        const char * end = p + data.size();
+        while (p < end) {
+            auto nl = static_cast<const char *>(memchr(p, '\n', end - p));
+            auto lineEnd = nl ? nl : end;
+            auto cr = static_cast<const char *>(memchr(p, '\r', lineEnd - p));
+
+            if (nl && !cr && currentLogLine.empty()) {
+                // Pass on all complete lines up to the next carriage return as they are
+                auto nextCr = static_cast<const char *>(memchr(nl, '\r', end - nl));
+                auto spanEnd = static_cast<const char *>(memrchr(nl, '\n', (nextCr ? nextCr : end) - nl)) + 1;
+                std::string_view span(p, spanEnd - p);
+                size_t logged = std::string_view::npos;
+                if (span.starts_with(terminatorLine))
+                    logged = 0;
+                else if (auto pos = span.find(terminator); pos != std::string_view::npos)
+                    logged = pos + 1;
+                if (logged != std::string_view::npos) {
+                    logOs.write(p, logged);
+                    return true;
+                }
+                logOs.write(p, span.size());
+                p = spanEnd;
+            } else if (cr) {
+                append(p, cr);
                 currentLogLinePos = 0;
-            } else return true;
-        } else {
-            if (currentLogLinePos >= currentLogLine.size())
-                currentLogLine.resize(currentLogLinePos + 1);
-            currentLogLine[currentLogLinePos++] = c;
+                p = cr + 1;
+            } else {
+                append(p, lineEnd);
+                if (!nl)
+                    break;
+                if (endLine(logOs))
+                    return true;
+                p = nl + 1;
+            }
         }
 
-    return false;
-}
\ No newline at end of file
+        return false;
+    }
+};
+
+/* Forwards the build log read from the non-blocking descriptor fd to logOs,
+ * until the log terminator or the end of the stream is reached. Once stopFd
+ * becomes readable, only the data already pending on fd is forwarded. Writes
+ * to logOs block, so a slow reader throttles reading from the job instead of
+ * making the log pile up in memory. */
+void forwardLog(int fd, int stopFd, std::ostream & logOs)
+{
+    std::vector<char> buf(NSH_LOG_BUFFER_SIZE);
+    BuildLogSplitter splitter;
+    bool stopping = false;
+    while (true) {
+        struct pollfd fds[2] = {{fd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+        if (poll(fds, stopping ? 1 : 2, stopping ? 0 : -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            throw nix::SysError("waiting for the build log");
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            auto n = read(fd, buf.data(), buf.size());
+            if (n == -1) {
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+                throw nix::SysError("reading the build log");
+            }
+            if (n == 0 || splitter.handleOutput(logOs, std::string_view(buf.data(), n)))
+                return;
+        } else if (stopping)
+            return;
+        else if (fds[1].revents & POLLIN)
+            stopping = true;
+    }
+}
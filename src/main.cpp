@@ -4,6 +4,7 @@
 using namespace std::chrono_literals;
 #include <memory>
 #include <ext/stdio_filebuf.h>
+#include <sys/wait.h>
 
 #include <nix/main/shared.hh>
 #include <nix/main/plugin.hh>
@@ -28,23 +29,29 @@ using namespace std::chrono_literals;
 #include <nix/util/processes.hh>
 #include <nix/util/environment-variables.hh>
 #include <nix/util/config-global.hh>
+#include <nix/util/finally.hh>
 
 #include "settings.hh"
-#include "slurm.hh"
-#include "pbs.hh"
-#include "slurm-native.hh"
+#include "scheduler.hh"
+#include "local.hh"
 #include "logging.hh"
-
-static void handleAlarm(int sig) {}
+#include "broker.hh"
+#include "staging.hh"
+#include "state.hh"
+#include "validity-cache.hh"
+#include "cleanup.hh"
+#include "transfer.hh"
+#include "upload-registry.hh"
+#include "retention.hh"
+#include "placement.hh"
+#include "sizing.hh"
+#include "routing.hh"
+#include "admission.hh"
+#include "metrics.hh"
+#include "trace.hh"
 
 static std::string currentLoad;
 
-static std::string escapeUri(std::string uri)
-{
-    std::replace(uri.begin(), uri.end(), '/', '_');
-    return uri;
-}
-
 struct SigHandlerExit : public std::exception
 {
     explicit SigHandlerExit() : std::exception() {}
@@ -147,49 +154,30 @@ struct FallbackHookInstance
     nix::FdSink sink;
 };
 
-int main(int argc, char **argv)
+static void initNix()
 {
-try {
-    /* Ensure destructors are called if terminated by Nix */
-    struct sigaction act;
-    sigemptyset(&act.sa_mask);
-    act.sa_flags = 0;
-    act.sa_handler = sigHandler;
-    if (sigaction(SIGTERM, &act, 0))
-        throw nix::SysError("assigning handler for SIGTERM");
-
-    nix::logger = nix::makeJSONLogger(nix::getStandardError());
-
-    /* Ensure we don't get any SSH passphrase or host key popups. */
-    unsetenv("DISPLAY");
-    unsetenv("SSH_ASKPASS");
-
-    if (argc != 2)
-        throw nix::UsageError("called without required arguments");
-
-    nix::verbosity = (nix::Verbosity) std::stoll(argv[1]);
-
-    nix::FdSource source(STDIN_FILENO);
-
-    /* Read the parent's settings. */
-    while (nix::readInt(source)) {
-        auto name = nix::readString(source);
-        auto value = nix::readString(source);
-        nix::settings.set(name, value);
-    }
-
-    try {
-        auto s = nix::readString(source);
-        if (s != "try")
-            return 0;
-    } catch (nix::EndOfFile &) {
-        return 0;
-    }
-
+    static bool initialised = false;
+    if (initialised)
+        return;
     nix::initLibStore();
     nix::initPlugins();
-    auto store = nix::openStore();
+    initialised = true;
+}
+
+/* Whether the derivation asks for job parameters of its own, which the pilot
+ * jobs submitted with the default parameters may not satisfy. */
+static bool requestsJobResources(const nix::Derivation & drv)
+{
+    for (auto attr : {"extraSlurmParams", "slurmNativeConstraints", "pbsResources"})
+        if (drv.env.count(attr))
+            return true;
+    return false;
+}
 
+/* Sets up the current-load directory, which holds the state NSH keeps across
+ * builds. */
+static void initCurrentLoad(nix::ref<nix::Store> store)
+{
     /* It would be more appropriate to use $XDG_RUNTIME_DIR, since
         that gets cleared on reboot, but it wouldn't work on macOS. */
     auto currentLoadName = "/current-load";
@@ -197,14 +185,42 @@ try {
         currentLoad = std::string{localStore->config.stateDir} + currentLoadName;
     else
         currentLoad = nix::settings.nixStateDir + currentLoadName;
+    mkdir(currentLoad.c_str(), 0777);
+    setCurrentLoadDir(currentLoad);
+    CleanupQueue::directory = currentLoad + "/cleanup";
+    mkdir(CleanupQueue::directory.c_str(), 0700);
+}
 
-    int amWilling = nix::readInt(source);
+/* Handles a try of Nix, whose fields have been read from source.
+ * @return Exit code of the hook, or std::nullopt if the try was answered
+ * with '# decline' or '# postpone', after which Nix keeps the hook and sends
+ * it its next try. */
+static std::optional<int> handleTry(nix::FdSource & source, int amWilling, const std::string & neededSystem,
+    const std::string & drvPathStr, const nix::StringSet & requiredFeatures)
+{
+    initNix();
+    auto store = nix::openStore();
+    initCurrentLoad(store);
 
-    ::loadConfFile(ourSettings);
+    nix::StorePath drvPath = store->parseStorePath(drvPathStr);
 
-    auto neededSystem = nix::readString(source);
-    nix::StorePath drvPath = store->parseStorePath(nix::readString(source));
-    auto requiredFeatures = nix::readStrings<nix::StringSet>(source);
+    /* The settings of the cluster the build is routed to apply from here
+     * on. */
+    std::optional<Route> route;
+    if (!ourSettings.clusters.get().empty()) {
+        try {
+            route = routeBuild(neededSystem, requiredFeatures);
+            if (route) {
+                nix::Activity act(*nix::logger, nix::lvlTalkative, nix::actUnknown,
+                    nix::fmt("routing build to cluster '%s', expected to start it in %d s (%s)", route->cluster, route->expectedWait.count(), route->basis));
+                loadClusterConfFile(ourSettings, route->cluster);
+                setCurrentCluster(route->cluster);
+            }
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: unable to route the build to a cluster: %s", e.what());
+        }
+    }
 
     bool tryFallback = false;
 
@@ -246,35 +262,130 @@ try {
             using namespace nix;
             printError("NSH Error: unable to fallback to normal build hook: %s", e.what());
             std::cerr << "# decline\n";
-            return 0;
+            return std::nullopt;
         }
     }
 
+    /* Written once the scheduler is torn down, which is timed as the last
+     * phase of the build. */
+    BuildMetrics metrics;
+    /* Released after the teardown of the scheduler, so that neither the
+     * place of the job nor the slot is handed out again while the build is
+     * still being cleaned up. */
+    std::optional<AdmissionTicket> admission;
+    std::optional<PilotLease> pilot;
     std::unique_ptr<Scheduler> scheduler;
     try {
-        if (ourSettings.jobScheduler.get() == "slurm") {
-            scheduler = std::make_unique<Slurm>();
-        } else if (ourSettings.jobScheduler.get() == "slurm-native") {
-            scheduler = std::make_unique<SlurmNative>();
-        } else if (ourSettings.jobScheduler.get() == "pbs") {
-            scheduler = std::make_unique<PBS>();
-        } else {
-            using namespace nix;
-            printError("NSH Error: unsupported job scheduler %s", ourSettings.jobScheduler.get());
-            std::cerr << "# decline-permanently\n";
-            return 0;
-        }
+        scheduler = makeScheduler();
     } catch (std::exception & e) {
         using namespace nix;
         printError("NSH Error: %s", e.what());
         std::cerr << "# decline-permanently\n";
         return 0;
     }
+    if (route)
+        metrics.setRoute(*route);
+    nix::Finally startTeardown([&]() { metrics.phase("teardown"); });
+    traceBuild(store->printStorePath(drvPath));
+
+    metrics.phase("submit");
+    if (ourSettings.brokerSocket.get() != "" && ourSettings.pilotPoolSize.get()) {
+        try {
+            if (!requestsJobResources(store->readDerivation(drvPath)))
+                pilot = leasePilotViaBroker(ourSettings.brokerSocket.get(), ourSettings.jobScheduler.get());
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: unable to lease a pilot job slot: %s", e.what());
+        }
+    }
+
+    /* Builds that would add a job to a congested queue are left to Nix,
+     * which builds something else in the meantime and tries again. */
+    if (!pilot && AdmissionTicket::enabled()) {
+        try {
+            std::optional<std::chrono::seconds> expectedWait;
+            if (ourSettings.maxQueueWait.get()) {
+                auto estimate = route ? route : estimateRoute();
+                if (estimate && estimate->basis != "default")
+                    expectedWait = estimate->expectedWait;
+            }
+            admission.emplace(route ? route->cluster : "", expectedWait, std::string(drvPath.to_string()));
+        } catch (AdmissionRefused & e) {
+            nix::Activity act(*nix::logger, nix::lvlInfo, nix::actUnknown, nix::fmt("not submitting the build yet: %s", e.what()));
+            if (ourSettings.admissionFallback.get()) {
+                metrics.setResult("fallback");
+                try {
+                    return FallbackHookInstance(amWilling, neededSystem, store->printStorePath(drvPath), requiredFeatures, source).wait();
+                } catch (std::exception & e) {
+                    using namespace nix;
+                    printError("NSH Error: unable to fallback to normal build hook: %s", e.what());
+                    std::cerr << "# decline\n";
+                    return std::nullopt;
+                }
+            }
+            metrics.setResult("postponed");
+            std::cerr << "# postpone\n";
+            return std::nullopt;
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: unable to check the admission of the build: %s", e.what());
+        }
+    }
+
+    /* Start uploading the inputs to the staging store right away, so that
+     * the upload overlaps with the time the job is waiting in the queue. */
+    nix::StorePathSet stagedPaths;
+    std::optional<StagingUpload> staging;
+    if (ourSettings.stagingStore.get() != "") {
+        try {
+            stagedPaths = getInputPaths(*store, drvPath);
+            scheduler->setStagedPaths(stagedPaths);
+            staging.emplace(*store, stagedPaths);
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: unable to stage build dependencies: %s", e.what());
+        }
+    }
+
+    /* Hold the job for the node that already has most of the closure of
+     * the build. */
+    if (!pilot && ResidentPaths::enabled()) {
+        try {
+            nix::StorePathSet closure;
+            store->computeFSClosure(getInputPaths(*store, drvPath), closure);
+            if (auto preferred = choosePreferredHost(*store, closure)) {
+                nix::Activity act(*nix::logger, nix::lvlTalkative, nix::actUnknown, nix::fmt("preferring node '%s', which holds most of the inputs", *preferred));
+                scheduler->setPreferredHost(*preferred);
+            }
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: unable to choose a node for the build: %s", e.what());
+        }
+    }
+
+    /* Request the resources that earlier builds of the package used. */
+    if (!pilot && UsageHistory::enabled()) {
+        try {
+            if (auto sizing = UsageHistory(*store, drvPath).recommend()) {
+                nix::Activity act(*nix::logger, nix::lvlTalkative, nix::actUnknown, nix::fmt("sizing the job to %s", showJobSizing(*sizing)));
+                scheduler->setSizing(sizing);
+            }
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: unable to size the job: %s", e.what());
+        }
+    }
 
     std::string host;
     try {
-        nix::Activity act(*nix::logger, nix::lvlTalkative, nix::actUnknown, "submitting build to scheduler");
-        host = scheduler->startBuild(drvPath);
+        TraceSpan span("build", pilot ? "startPilotBuild" : "startBuild");
+        if (pilot) {
+            nix::Activity act(*nix::logger, nix::lvlTalkative, nix::actUnknown, nix::fmt("starting build in pilot job %s", pilot->jobId));
+            host = scheduler->startPilotBuild(drvPath, pilot->jobId, pilot->host, pilot->dir);
+        } else {
+            nix::Activity act(*nix::logger, nix::lvlTalkative, nix::actUnknown, "submitting build to scheduler");
+            host = scheduler->startBuild(drvPath);
+        }
     } catch (std::exception & e) {
         using namespace nix;
         printError("NSH Error: error when attempting to build derivation on %s: %s", ourSettings.jobScheduler.get(), e.what());
@@ -282,154 +393,256 @@ try {
         return 0;
     }
     nix::Activity startedJobAct(*nix::logger, nix::lvlInfo, nix::actUnknown, nix::fmt("started job %s on %s", scheduler->getJobId(), host));
+    traceJob(scheduler->getJobId());
+    metrics.setHost(host);
+    metrics.phase("connect");
 
     const std::string storeUri = "ssh-ng://" + host;
     std::shared_ptr<nix::Store> sshStore;
+    nix::StoreReference::Params sshStoreParams = {{"remote-store", ourSettings.remoteStore.get()}};
+    if (ourSettings.remoteNixBinDir.get() != "")
+        sshStoreParams["remote-program"] = ourSettings.remoteNixBinDir.get() + "/nix-daemon";
     {
         nix::Activity act(*nix::logger, nix::lvlTalkative, nix::actUnknown, nix::fmt("connecting to '%s'", storeUri));
         try {
-            nix::StoreReference::Params params = {{"remote-store", ourSettings.remoteStore.get()}};
-            if (ourSettings.remoteNixBinDir.get() != "")
-                params["remote-program"] = ourSettings.remoteNixBinDir.get() + "/nix-daemon";
-            sshStore = nix::openStore(storeUri, params);
+            sshStore = nix::openStore(storeUri, sshStoreParams);
             sshStore->connect();
         } catch (std::exception & e) {
             auto msg = nix::chomp(nix::drainFD(5, false));
             using namespace nix;
             printError("NSH Error: cannot build on '%s': %s%s", storeUri, e.what(), msg.empty() ? "" : ": " + msg);
             std::cerr << "# decline\n";
-            return 0;
+            return std::nullopt;
         }
     }
 
     std::cerr << "# accept\n" << storeUri << "\n";
+    metrics.setResult("error");
 
     auto inputs = nix::readStrings<nix::PathSet>(source);
     auto wantedOutputs = nix::readStrings<nix::StringSet>(source);
 
-    mkdir(currentLoad.c_str(), 0777);
+    auto inputPaths = store->parseStorePathSet(inputs);
 
-    nix::AutoCloseFD uploadLock;
-    {
-        auto setUpdateLock = [&](auto && fileName) {
-            uploadLock = nix::openLockFile(currentLoad + "/" + escapeUri(fileName) + ".upload-lock", true);
-        };
+    bool staged = false;
+    if (staging) {
+        metrics.phase("stage");
+        nix::Activity act(*nix::logger, nix::lvlTalkative, nix::actUnknown, nix::fmt("waiting for dependencies to be staged to '%s'", ourSettings.stagingStore.get()));
         try {
-            setUpdateLock(storeUri);
-        } catch (nix::SysError & e) {
-            if (e.errNo != ENAMETOOLONG) {
+            staging->wait();
+            staged = true;
+            std::erase_if(inputPaths, [&](auto & path) { return stagedPaths.contains(path); });
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: error when attempting to stage build dependencies, copying them to '%s' instead: %s", storeUri, e.what());
+        }
+    }
+
+    /* Independent connections to the build node, used to copy store paths
+     * over several SSH streams at once. */
+    std::vector<nix::ref<nix::Store>> transferStores{nix::ref<nix::Store>(sshStore)};
+    auto openTransferStores = [&]() {
+        while (transferStores.size() < ourSettings.transferJobs.get()) {
+            try {
+                auto transferStore = nix::openStore(storeUri, sshStoreParams);
+                transferStore->connect();
+                transferStores.push_back(transferStore);
+            } catch (std::exception & e) {
                 using namespace nix;
-                printError(e.what());
-                throw;
+                printError("NSH Error: cannot open another connection to '%s', continuing with %d: %s", storeUri, transferStores.size(), e.what());
+                break;
             }
-            // Try again hashing the store URL so we have a shorter path
-            auto h = nix::hashString(nix::HashAlgorithm::MD5, storeUri);
-            setUpdateLock(h.to_string(nix::HashFormat::Base64, false));
         }
+    };
+
+    bool compressTransfers = ourSettings.transferCompression.get() == "zstd";
+    if (!compressTransfers && ourSettings.transferCompression.get() != "none") {
+        using namespace nix;
+        printError("NSH Error: unsupported transfer compression '%s', sending store paths uncompressed", ourSettings.transferCompression.get());
     }
 
-    {
-        nix::Activity act(*nix::logger, nix::lvlTalkative, nix::actUnknown, nix::fmt("waiting for the upload lock to '%s'", storeUri));
+    auto substitute = nix::settings.buildersUseSubstitutes ? nix::Substitute : nix::NoSubstitute;
 
-        auto old = signal(SIGALRM, handleAlarm);
-        alarm(15 * 60);
-        if (!nix::lockFile(uploadLock.get(), nix::LockType::ltWrite, true)) {
-            using namespace nix;
-            printError("NSH Error: somebody is hogging the upload lock for '%s', continuing...");
+    /* Plan the upload as a single set: the inputs and, unless they were
+     * staged, the closure of the derivation, minus the paths that the remote
+     * store already has. Paths recorded in the validity cache are not
+     * queried again. */
+    metrics.phase("query");
+    ValidityCache validityCache(host);
+    nix::StorePathSet missingInputs, presentInputs;
+    try {
+        nix::StorePathSet uploadPaths = inputPaths;
+        if (!staged)
+            store->computeFSClosure(drvPath, uploadPaths);
+        for (auto & path : validityCache.queryValid(uploadPaths)) {
+            uploadPaths.erase(path);
+            presentInputs.insert(path);
         }
-        alarm(0);
-        signal(SIGALRM, old);
+        auto validPaths = sshStore->queryValidPaths(uploadPaths, substitute);
+        validityCache.addValid(validPaths);
+        for (auto & path : uploadPaths)
+            if (!validPaths.contains(path))
+                missingInputs.insert(path);
+            else
+                presentInputs.insert(path);
+    } catch (std::exception & e) {
+        using namespace nix;
+        printError("NSH Error: error when attempting to query valid paths on '%s': %s", storeUri, e.what());
+        std::cerr << "# decline-permanently\n";
+        return 0;
     }
 
-    auto substitute = nix::settings.buildersUseSubstitutes ? nix::Substitute : nix::NoSubstitute;
-
-    {
-        nix::Activity act(*nix::logger, nix::lvlTalkative, nix::actUnknown, nix::fmt("copying dependencies to '%s'", storeUri));
+    if (!missingInputs.empty()) {
+        /* Paths that other hooks are uploading to the same node are waited
+         * for, the time counts as upload_wait. */
+        metrics.phase("upload_wait");
+        nix::Activity act(*nix::logger, nix::lvlTalkative, nix::actUnknown, nix::fmt("copying %d dependencies to '%s'", missingInputs.size(), storeUri));
+        TraceSpan span("transfer", "copy inputs", {{"paths", missingInputs.size()}});
         try {
-            nix::copyPaths(*store, *sshStore, store->parseStorePathSet(inputs), nix::NoRepair, nix::NoCheckSigs, substitute);
+            UploadRegistry registry(host, validityCache);
+            registry.upload(*store, missingInputs, [&](const nix::StorePathSet & paths) {
+                metrics.phase("upload");
+                TransferStats stats;
+                if (compressTransfers) {
+                    stats = uploadCompressed(store, scheduler->getSSHMaster(), scheduler->getTransferDir(), paths);
+                } else {
+                    openTransferStores();
+                    stats = copyPathsParallel({store}, transferStores, paths);
+                }
+                metrics.addTransfer("upload", stats);
+                using namespace nix;
+                printInfo("copied dependencies to '%s': %s", storeUri, showTransferStats(stats));
+                metrics.phase("upload_wait");
+            }, [&](const nix::StorePathSet & paths) {
+                return sshStore->queryValidPaths(paths, substitute);
+            });
         } catch (std::exception & e) {
             using namespace nix;
             printError("NSH Error: error when attempting to copy build dependencies: %s", e.what());
             std::cerr << "# decline-permanently\n";
             return 0;
         }
-        nix::PathSet rootDrv;
-        rootDrv.insert(store->printStorePath(drvPath));
+    }
+
+    StoreRetention retention(host);
+    if (StoreRetention::enabled()) {
         try {
-            nix::copyClosure(*store, *sshStore, store->parseStorePathSet(rootDrv), nix::NoRepair, nix::NoCheckSigs, substitute);
+            retention.recordInputs(*store, presentInputs, missingInputs);
+            using namespace nix;
+            printInfo("inputs on '%s': %s", storeUri, showRetentionStats(retention.getStats()));
         } catch (std::exception & e) {
             using namespace nix;
-            printError("NSH Error: error when attempting to copy root derivation closure: %s", e.what());
-            std::cerr << "# decline-permanently\n";
-            return 0;
+            printError("NSH Error: unable to record the use of the inputs: %s", e.what());
+        }
+    }
+
+    if (ResidentPaths::enabled()) {
+        try {
+            auto inputs = presentInputs;
+            inputs.insert(missingInputs.begin(), missingInputs.end());
+            ResidentPaths(host).add(inputs);
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: unable to record the inputs present on '%s': %s", host, e.what());
         }
     }
 
-    uploadLock = -1;
+    metrics.phase("job");
+    try {
+        scheduler->signalInputsReady(staged);
+    } catch (std::exception & e) {
+        using namespace nix;
+        printError("NSH Error: error when attempting to start the build of job %s: %s", scheduler->getJobId(), e.what());
+        return 1;
+    }
 
-    std::atomic<bool> cmdAbend = false;
+    nix::Pipe logStop;
+    logStop.create();
 
-    std::thread cmdOutThread([&]() {
-        auto cmdOutIs = scheduler->getStderrStream();
+    std::thread logThread([&]() {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
 
         // The invoking Nix process listens on fd 4 for the build log
         // See https://github.com/NixOS/nix/blob/master/src/libstore/unix/build/hook-instance.cc#L61
         __gnu_cxx::stdio_filebuf<char> logBuf(4, std::ios::out);
         std::ostream logOs(&logBuf);
 
-        bool gotTerminator = false;
-        while (!gotTerminator && !cmdAbend) {
-            std::string data;
-            char c;
-            while (cmdOutIs->get(c)) {
-                data += c;
-            }
-            if (data != "") {
-                gotTerminator = handleOutput(logOs, data);
-            } else {
-                std::this_thread::yield();
-                cmdOutIs->clear();
-            }
+        try {
+            forwardLog(scheduler->getStderrFd(), logStop.readSide.get(), logOs);
+            /* The job script writes the terminator right before exiting. */
+            scheduler->notifyJobEnding();
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: error while forwarding the build log: %s", e.what());
         }
-        if (cmdAbend) {
-            // Drain in the case of abnormal termination
-            std::string data;
-            char c;
-            while (cmdOutIs->get(c)) {
-                data += c;
-            }
-            if (data != "") {
-                handleOutput(logOs, data);
-            }
+    });
+
+    /* Stops the log thread after draining what the job already sent, for
+     * when the job ended without writing the log terminator. */
+    nix::Finally stopLogThread([&]() {
+        if (logThread.joinable()) {
+            nix::writeFull(logStop.writeSide.get(), "x");
+            logThread.join();
         }
     });
 
     int rc;
     try {
+        TraceSpan span("build", "waitForJobFinish");
         rc = scheduler->waitForJobFinish();
     } catch (std::exception & e) {
         using namespace nix;
         printError("NSH Error: error while waiting for job %s termination: %s", scheduler->getJobId(), e.what());
-        cmdAbend = true;
-        cmdOutThread.join();
         return 1;
     }
+    /* A failed job may have run out of the resources it was sized to, so
+     * the records it was sized from are dropped. */
+    if (!pilot && UsageHistory::enabled()) {
+        try {
+            UsageHistory history(*store, drvPath);
+            if (rc == 0) {
+                if (auto usage = scheduler->queryUsage())
+                    history.record(*usage);
+            } else if (scheduler->isAutoSized())
+                history.forget();
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: unable to record the resources used by job %s: %s", scheduler->getJobId(), e.what());
+        }
+    }
+    {
+        using namespace nix;
+        debug("job state polling: %d queries, %d state changes detected after %d ms in total",
+            pollMetrics.queries.load(), pollMetrics.detections.load(), pollMetrics.detectionLatencyMs.load());
+    }
     if (rc == -1) {
         using namespace nix;
         printError("NSH Error: job %s abnormally terminated.", scheduler->getJobId());
-        cmdAbend = true;
-        cmdOutThread.join();
         return 1;
     } else if (rc) {
+        metrics.setResult("failure");
+        /* The build may have failed because of an input that was wrongly
+         * recorded as valid, so stop trusting the cache and the index of
+         * the paths on this node. */
+        try {
+            validityCache.invalidate();
+            ResidentPaths(host).clear();
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: %s", e.what());
+        }
         // Build failed, so no more work to do
         using namespace nix;
         printError("build failed with exit code %d", rc);
-        cmdAbend = true;
-        cmdOutThread.join();
         return rc;
     }
 
-    cmdOutThread.join();
+    metrics.phase("log");
+    logThread.join();
+    metrics.phase("download");
 
     using namespace nix;
     auto drv = store->readDerivation(drvPath);
@@ -461,12 +674,38 @@ try {
         }
     }
 
+    TraceSpan registerSpan("build", "register outputs", {{"paths", missingPaths.size()}});
     if (!missingPaths.empty()) {
         Activity act(*logger, lvlTalkative, actUnknown, fmt("copying outputs from '%s'", storeUri));
         if (auto localStore = store.dynamic_pointer_cast<LocalStore>())
             for (auto & path : missingPaths)
                 localStore->locksHeld.insert(store->printStorePath(path)); /* FIXME: ugly */
-        copyPaths(*sshStore, *store, missingPaths, NoRepair, NoCheckSigs, NoSubstitute);
+        std::optional<TransferStats> stats;
+        auto source = storeUri;
+        if (ourSettings.stagingStore.get() != "" && ourSettings.stagingOutputs.get()) {
+            try {
+                auto stagingStore = openStore(ourSettings.stagingStore.get());
+                std::vector<ref<Store>> stagingStores(std::max(1u, ourSettings.transferJobs.get()), stagingStore);
+                stats = copyPathsParallel(stagingStores, {store}, missingPaths);
+                source = ourSettings.stagingStore.get();
+            } catch (std::exception & e) {
+                printError("NSH Error: error when attempting to copy outputs from '%s', copying them from '%s' instead: %s", ourSettings.stagingStore.get(), storeUri, e.what());
+            }
+        }
+        if (!stats && compressTransfers)
+            stats = downloadCompressed(scheduler->getSSHMaster(), scheduler->getTransferDir(), store, missingPaths);
+        if (!stats) {
+            openTransferStores();
+            stats = copyPathsParallel(transferStores, {store}, missingPaths);
+        }
+        printInfo("copied outputs from '%s': %s", source, showTransferStats(*stats));
+        metrics.addTransfer("download", *stats);
+        try {
+            retention.touch(*store, missingPaths);
+            ResidentPaths(host).add(missingPaths);
+        } catch (std::exception & e) {
+            printError("NSH Error: unable to record the use of the outputs: %s", e.what());
+        }
     }
 
     // XXX: Should be done as part of `copyPaths`
@@ -476,9 +715,136 @@ try {
         experimentalFeatureSettings.require(Xp::CaDerivations);
         store->registerDrvOutput(realisation);
     }
-} catch (SigHandlerExit & e) {
+
+    metrics.setResult("success");
     return 0;
 }
 
+static int runHook()
+{
+    nix::FdSource source(STDIN_FILENO);
+
+    /* Read the parent's settings. */
+    while (nix::readInt(source)) {
+        auto name = nix::readString(source);
+        auto value = nix::readString(source);
+        nix::settings.set(name, value);
+    }
+
+    /* Every try is handled in a child of its own, so that nothing a try
+     * changes, such as the settings of the cluster it was routed to, carries
+     * over to the next one. */
+    while (true) {
+        try {
+            auto s = nix::readString(source);
+            if (s != "try")
+                return 0;
+        } catch (nix::EndOfFile &) {
+            return 0;
+        }
+
+        /* The fields are read here, as the child's reads do not advance
+         * our buffer. */
+        int amWilling = nix::readInt(source);
+        auto neededSystem = nix::readString(source);
+        auto drvPath = nix::readString(source);
+        auto requiredFeatures = nix::readStrings<nix::StringSet>(source);
+
+        /* The child writes to the pipe if it did not take the build, which
+         * its exit code, that of the build, cannot tell. */
+        nix::Pipe answered;
+        answered.create();
+        pid_t child = fork();
+        if (child == -1)
+            throw nix::SysError("forking to handle the build");
+        if (child == 0) {
+            answered.readSide.close();
+            try {
+                auto rc = handleTry(source, amWilling, neededSystem, drvPath, requiredFeatures);
+                if (!rc)
+                    nix::writeFull(answered.writeSide.get(), "n");
+                _exit(rc.value_or(0));
+            } catch (SigHandlerExit & e) {
+                _exit(0);
+            } catch (std::exception & e) {
+                using namespace nix;
+                printError("NSH Error: %s", e.what());
+                _exit(1);
+            }
+        }
+        answered.writeSide.close();
+        /* Terminated along with us, so that its job is cancelled. */
+        nix::Pid pid(child);
+        pid.setKillSignal(SIGTERM);
+        int status = pid.wait();
+        if (nix::drainFD(answered.readSide.get()).empty())
+            return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    }
+}
+
+int main(int argc, char **argv)
+{
+try {
+    /* Ensure destructors are called if terminated by Nix */
+    struct sigaction act;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    act.sa_handler = sigHandler;
+    if (sigaction(SIGTERM, &act, 0))
+        throw nix::SysError("assigning handler for SIGTERM");
+
+    nix::logger = nix::makeJSONLogger(nix::getStandardError());
+
+    /* Ensure we don't get any SSH passphrase or host key popups. */
+    unsetenv("DISPLAY");
+    unsetenv("SSH_ASKPASS");
+
+    bool localJob = argc == 3 && std::string_view(argv[1]) == "local-job";
+    /* 'nsh cleanup <cluster>' and 'nsh daemon <cluster>' run with the
+     * settings of a cluster. */
+    bool forCluster = argc == 3 && (std::string_view(argv[1]) == "cleanup" || std::string_view(argv[1]) == "daemon");
+    if (argc != 2 && !localJob && !forCluster)
+        throw nix::UsageError("called without required arguments");
+
+    ::loadConfFile(ourSettings);
+
+    if (localJob) {
+        nix::logger = nix::makeSimpleLogger();
+        return Local::runJob(argv[2]);
+    }
+
+    if (forCluster) {
+        loadClusterConfFile(ourSettings, argv[2]);
+        setCurrentCluster(argv[2]);
+    }
+
+    if (std::string_view(argv[1]) == "daemon") {
+        initNix();
+        initCurrentLoad(nix::openStore());
+        return runBroker([]() {
+            try {
+                return runHook();
+            } catch (SigHandlerExit & e) {
+                return 0;
+            }
+        });
+    }
+
+    if (std::string_view(argv[1]) == "cleanup") {
+        nix::logger = nix::makeSimpleLogger();
+        initNix();
+        initCurrentLoad(nix::openStore());
+        return CleanupQueue::run() ? 0 : 1;
+    }
+
+    nix::verbosity = (nix::Verbosity) std::stoll(argv[1]);
+
+    if (ourSettings.brokerSocket.get() != "")
+        if (auto rc = forwardToBroker(ourSettings.brokerSocket.get()))
+            return *rc;
+
+    return runHook();
+} catch (SigHandlerExit & e) {
     return 0;
 }
+}
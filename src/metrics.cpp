@@ -0,0 +1,167 @@
+#include "metrics.hh"
+#include "polling.hh"
+#include "settings.hh"
+
+#include <fstream>
+#include <unistd.h>
+
+#include <nix/store/pathlocks.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/fmt.hh>
+#include <nix/util/logging.hh>
+
+struct MetricFamily
+{
+    const char * name;
+    const char * type;
+    const char * help;
+};
+
+static const MetricFamily families[] = {
+    {"nsh_builds_total", "counter", "Builds handled by NSH, by result."},
+    {"nsh_phase_duration_seconds", "histogram", "Time spent by builds in each phase."},
+    {"nsh_transfer_paths_total", "counter", "Store paths copied between NSH and the build nodes."},
+    {"nsh_transfer_bytes_total", "counter", "NAR bytes of the store paths copied between NSH and the build nodes."},
+    {"nsh_transfer_seconds_total", "counter", "Time spent copying store paths between NSH and the build nodes."},
+    {"nsh_job_state_queries_total", "counter", "Queries of the state of jobs made by builds."},
+    {"nsh_job_state_changes_total", "counter", "Job state changes detected by the queries."},
+    {"nsh_job_state_change_latency_seconds_total", "counter", "Time between job state changes and their detection, summed over all changes."},
+    {"nsh_route_decisions_total", "counter", "Builds routed to each cluster, by basis of the choice."},
+    {"nsh_route_expected_wait_seconds_total", "counter", "Wait for the start of the job expected when routing builds, summed over all builds."},
+};
+
+/* Upper bounds of the buckets of nsh_phase_duration_seconds, spanning a fast
+ * SSH connection to a day in the queue. */
+static const char * phaseBuckets[] = {"0.1", "0.5", "1", "5", "15", "60", "300", "900", "3600", "14400", "86400"};
+
+static std::string escapeLabel(const std::string & value)
+{
+    std::string escaped;
+    for (char c : value) {
+        if (c == '\\' || c == '"')
+            escaped += '\\';
+        if (c == '\n')
+            escaped += "\\n";
+        else
+            escaped += c;
+    }
+    return escaped;
+}
+
+BuildMetrics::~BuildMetrics()
+{
+    if (ourSettings.metricsTextfile.get() == "")
+        return;
+    try {
+        endPhase();
+        write();
+    } catch (std::exception & e) {
+        using namespace nix;
+        printError("NSH Error: unable to write metrics to '%s': %s", ourSettings.metricsTextfile.get(), e.what());
+    }
+}
+
+void BuildMetrics::endPhase()
+{
+    if (currentPhase)
+        phaseSeconds[*currentPhase] += std::chrono::duration<double>(Clock::now() - phaseStart).count();
+    currentPhase.reset();
+}
+
+void BuildMetrics::phase(const std::string & name)
+{
+    endPhase();
+    currentPhase = name;
+    phaseStart = Clock::now();
+}
+
+void BuildMetrics::setHost(const std::string & host)
+{
+    this->host = host;
+}
+
+void BuildMetrics::setResult(const std::string & result)
+{
+    this->result = result;
+}
+
+void BuildMetrics::setRoute(const Route & route)
+{
+    this->route = route;
+}
+
+void BuildMetrics::addTransfer(const std::string & direction, const TransferStats & stats)
+{
+    auto & total = transfers[direction];
+    total.paths += stats.paths;
+    total.narBytes += stats.narBytes;
+    total.elapsed += stats.elapsed;
+}
+
+void BuildMetrics::write()
+{
+    auto path = ourSettings.metricsTextfile.get();
+    auto lock = nix::openLockFile(path + ".lock", true);
+    nix::lockFile(lock.get(), nix::ltWrite, true);
+
+    /* The textfile itself holds the aggregates, as '<name>{<labels>} <value>'
+     * lines, all of which are sums. */
+    std::map<std::string, double> series;
+    {
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line)) {
+            auto space = line.rfind(' ');
+            if (line.empty() || line[0] == '#' || space == std::string::npos)
+                continue;
+            try {
+                series[line.substr(0, space)] = std::stod(line.substr(space + 1));
+            } catch (std::exception &) {
+            }
+        }
+    }
+
+    auto labels = nix::fmt("job_scheduler=\"%s\",host=\"%s\"",
+        escapeLabel(ourSettings.jobScheduler.get()), escapeLabel(host));
+
+    series[nix::fmt("nsh_builds_total{%s,result=\"%s\"}", labels, escapeLabel(result))] += 1;
+    for (auto & [name, seconds] : phaseSeconds) {
+        auto phaseLabels = nix::fmt("%s,phase=\"%s\"", labels, escapeLabel(name));
+        for (auto le : phaseBuckets)
+            series[nix::fmt("nsh_phase_duration_seconds_bucket{%s,le=\"%s\"}", phaseLabels, le)] += seconds <= std::stod(le) ? 1 : 0;
+        series[nix::fmt("nsh_phase_duration_seconds_bucket{%s,le=\"+Inf\"}", phaseLabels)] += 1;
+        series[nix::fmt("nsh_phase_duration_seconds_sum{%s}", phaseLabels)] += seconds;
+        series[nix::fmt("nsh_phase_duration_seconds_count{%s}", phaseLabels)] += 1;
+    }
+    for (auto & [direction, stats] : transfers) {
+        auto transferLabels = nix::fmt("%s,direction=\"%s\"", labels, direction);
+        series[nix::fmt("nsh_transfer_paths_total{%s}", transferLabels)] += stats.paths;
+        series[nix::fmt("nsh_transfer_bytes_total{%s}", transferLabels)] += stats.narBytes;
+        series[nix::fmt("nsh_transfer_seconds_total{%s}", transferLabels)] += stats.elapsed.count();
+    }
+    series[nix::fmt("nsh_job_state_queries_total{%s}", labels)] += pollMetrics.queries.load();
+    series[nix::fmt("nsh_job_state_changes_total{%s}", labels)] += pollMetrics.detections.load();
+    series[nix::fmt("nsh_job_state_change_latency_seconds_total{%s}", labels)] += pollMetrics.detectionLatencyMs.load() / 1000.0;
+    if (route) {
+        auto routeLabels = nix::fmt("%s,cluster=\"%s\",basis=\"%s\"", labels, escapeLabel(route->cluster), route->basis);
+        series[nix::fmt("nsh_route_decisions_total{%s}", routeLabels)] += 1;
+        series[nix::fmt("nsh_route_expected_wait_seconds_total{%s}", routeLabels)] += route->expectedWait.count();
+    }
+
+    std::string contents;
+    for (auto & family : families) {
+        std::string name = family.name;
+        contents += nix::fmt("# HELP %s %s\n# TYPE %s %s\n", name, family.help, name, family.type);
+        for (auto & [key, value] : series) {
+            auto seriesName = key.substr(0, key.find('{'));
+            if (seriesName == name || (std::string(family.type) == "histogram"
+                    && (seriesName == name + "_bucket" || seriesName == name + "_sum" || seriesName == name + "_count")))
+                contents += nix::fmt("%s %.15g\n", key, value);
+        }
+    }
+
+    auto tmpPath = nix::fmt("%s.tmp-%d", path, getpid());
+    nix::writeFile(tmpPath, contents, 0644);
+    if (rename(tmpPath.c_str(), path.c_str()) == -1)
+        throw nix::SysError("renaming '%s' to '%s'", tmpPath, path);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <optional>
+#include <string>
+
+#include "transfer.hh"
+#include "routing.hh"
+
+/* Timings and counters of a single build, added to the aggregates in the
+ * metrics-textfile when the build is done. The file is rewritten atomically
+ * in the Prometheus text format, for the textfile collector of the node
+ * exporter, with every series labelled by job scheduler and host:
+ *
+ * - nsh_builds_total, by result;
+ * - nsh_phase_duration_seconds, a histogram by phase;
+ * - nsh_transfer_{paths,bytes,seconds}_total, by direction;
+ * - nsh_job_state_queries_total and nsh_job_state_changes_total, with the
+ *   detection latency of the changes in nsh_job_state_change_latency_seconds_total;
+ * - nsh_route_decisions_total and nsh_route_expected_wait_seconds_total, by
+ *   cluster and basis of the choice, for builds routed between clusters. */
+class BuildMetrics
+{
+public:
+    /* Adds the metrics to the textfile, ending the current phase. */
+    ~BuildMetrics();
+
+    /* Ends the current phase and starts timing the next one. */
+    void phase(const std::string & name);
+
+    void setHost(const std::string & host);
+
+    /* Sets the result of the build reported by nsh_builds_total, which is
+     * 'declined' until set. */
+    void setResult(const std::string & result);
+
+    /* Records the routing of the build to a cluster. */
+    void setRoute(const Route & route);
+
+    /* Records a transfer in direction, 'upload' or 'download'. */
+    void addTransfer(const std::string & direction, const TransferStats & stats);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    std::string host;
+    std::string result = "declined";
+    std::optional<std::string> currentPhase;
+    Clock::time_point phaseStart;
+    std::map<std::string, double> phaseSeconds;
+    std::map<std::string, TransferStats> transfers;
+    std::optional<Route> route;
+
+    void endPhase();
+    void write();
+};
@@ -15,6 +15,7 @@ using namespace nlohmann;
 #include <nix/store/store-open.hh>
 #include <nix/store/store-api.hh>
 #include <nix/store/derivations.hh>
+#include <nix/util/strings.hh>
 
 #include <pbs_error.h>
 
@@ -29,18 +30,63 @@ static std::string getJobState(int conn, std::string jobId)
     return value;
 }
 
-static void waitForJobRunning(int conn, std::string jobId)
+/* State of a job and the times the server reports for it. */
+struct JobTimes
 {
-    auto sleepTime = 50ms;
-    while (true) {
-        auto state = getJobState(conn, jobId);
-        if (state == "R")
-            return;
-        else if (state == "F")
-            throw PBSDeletedError(jobId);
-        std::this_thread::sleep_for(sleepTime);
-        if (sleepTime < 1s) sleepTime *= 2;
+    std::string state;
+    /* Start time estimated by the server while the job is queued. */
+    std::optional<JobPoll::Clock::time_point> estimatedStart;
+    std::optional<JobPoll::Clock::time_point> start;
+    std::optional<std::chrono::seconds> walltime;
+};
+
+/* @return Duration given as '[[HH:]MM:]SS'. */
+static std::chrono::seconds parseDuration(const std::string & value)
+{
+    int64_t seconds = 0;
+    for (auto & field : nix::tokenizeString<std::vector<std::string>>(value, ":"))
+        seconds = seconds * 60 + std::stoll(field);
+    return std::chrono::seconds(seconds);
+}
+
+static JobTimes getJobTimes(int conn, std::string jobId)
+{
+    char startTime[] = "start_time";
+    char walltime[] = "walltime";
+    attrl walltimeAttr = {nullptr, ATTR_l, walltime, nullptr, SET};
+    attrl startAttr = {&walltimeAttr, ATTR_stime, nullptr, nullptr, SET};
+    attrl estimatedAttr = {&startAttr, ATTR_estimated, startTime, nullptr, SET};
+    attrl stateAttr = {&estimatedAttr, ATTR_state, nullptr, nullptr, SET};
+    batch_status *status = pbs_statjob(conn, jobId.data(), &stateAttr, "x");
+    if (status == nullptr)
+        throw PBSQueryError(nix::fmt("Error querying %s for job %s: %d", ATTR_state, jobId, pbs_errno));
+    JobTimes times;
+    for (auto attr = status->attribs; attr != nullptr; attr = attr->next) {
+        if (strcmp(attr->name, ATTR_state) == 0)
+            times.state = attr->value;
+        else if (strcmp(attr->name, ATTR_estimated) == 0 && attr->resource && strcmp(attr->resource, startTime) == 0)
+            times.estimatedStart = fromEpoch(std::atoll(attr->value));
+        else if (strcmp(attr->name, ATTR_stime) == 0)
+            times.start = fromEpoch(std::atoll(attr->value));
+        else if (strcmp(attr->name, ATTR_l) == 0 && attr->resource && strcmp(attr->resource, walltime) == 0)
+            times.walltime = parseDuration(attr->value);
     }
+    pbs_statfree(status);
+    if (times.state.empty())
+        throw PBSQueryError(nix::fmt("Error querying %s for job %s: %d", ATTR_state, jobId, pbs_errno));
+    return times;
+}
+
+/* @return Bytes of a size given as '<N>[b|kb|mb|gb|tb]'. */
+static uint64_t parseSize(const std::string & value)
+{
+    size_t end;
+    uint64_t size = std::stoull(value, &end);
+    std::string units = "kmgt";
+    if (end < value.size())
+        if (auto shift = units.find(value[end]); shift != std::string::npos)
+            size <<= 10 * (shift + 1);
+    return size;
 }
 
 static struct attropl *new_attropl()
@@ -61,6 +107,83 @@ static void free_attropl_list(struct attropl *at_list)
     }
 }
 
+/* Converts resources, a JSON dictionary of string values, to a list of job
+ * resource attributes, freed by submitScript().
+ * Attribute chain: v -> k -> N -> (l1/aResBase -> l2 -> l3 -> ...) */
+static attropl *makeResources(const json & resources)
+{
+    attropl *aResBase = nullptr;
+    attropl *prev = nullptr;
+    for (auto & [key, value] : resources.items()) {
+        auto attr = new_attropl();
+        attr->name = ATTR_l;
+        attr->resource = new char[key.size() + 1];
+        strncpy(attr->resource, key.data(), key.size());
+        attr->resource[key.size()] = '\0';
+        std::string strValue(value);
+        attr->value = new char[strValue.size() + 1];
+        strncpy(attr->value, strValue.data(), strValue.size());
+        attr->value[strValue.size()] = '\0';
+        if (!aResBase)
+            aResBase = attr;
+        else if (prev != nullptr)
+            prev->next = attr;
+        prev = attr;
+    }
+    return aResBase;
+}
+
+Scheduler::QueueEstimate PBS::estimateQueue()
+{
+    /* The server only estimates the start of jobs that have been
+     * submitted, so the start of a new job is not predicted. */
+    attrl countAttr = {nullptr, ATTR_count, nullptr, nullptr, SET};
+    batch_status *status = pbs_statserver(connHandle, &countAttr, nullptr);
+    if (status == nullptr)
+        throw PBSQueryError(nix::fmt("Error querying %s of the server: %d", ATTR_count, pbs_errno));
+    QueueEstimate estimate;
+    /* The count is given as 'Transit:0 Queued:12 Held:0 ...'. */
+    for (auto attr = status->attribs; attr != nullptr; attr = attr->next)
+        if (strcmp(attr->name, ATTR_count) == 0)
+            for (auto & count : nix::tokenizeString<std::vector<std::string>>(attr->value, " "))
+                if (count.starts_with("Queued:"))
+                    estimate.pendingJobs = std::stoull(count.substr(7));
+    pbs_statfree(status);
+    return estimate;
+}
+
+std::optional<JobUsage> PBS::queryUsage()
+{
+    char cput[] = "cput";
+    char walltime[] = "walltime";
+    char mem[] = "mem";
+    char ncpus[] = "ncpus";
+    attrl ncpusAttr = {nullptr, ATTR_used, ncpus, nullptr, SET};
+    attrl memAttr = {&ncpusAttr, ATTR_used, mem, nullptr, SET};
+    attrl walltimeAttr = {&memAttr, ATTR_used, walltime, nullptr, SET};
+    attrl cputAttr = {&walltimeAttr, ATTR_used, cput, nullptr, SET};
+    batch_status *status = pbs_statjob(connHandle, jobId.data(), &cputAttr, "x");
+    if (status == nullptr)
+        throw PBSQueryError(nix::fmt("Error querying %s for job %s: %d", ATTR_used, jobId, pbs_errno));
+    JobUsage usage;
+    for (auto attr = status->attribs; attr != nullptr; attr = attr->next) {
+        if (strcmp(attr->name, ATTR_used) != 0 || !attr->resource)
+            continue;
+        if (strcmp(attr->resource, cput) == 0)
+            usage.cpuSeconds = parseDuration(attr->value).count();
+        else if (strcmp(attr->resource, walltime) == 0)
+            usage.elapsedSeconds = parseDuration(attr->value).count();
+        else if (strcmp(attr->resource, mem) == 0)
+            usage.maxRss = parseSize(attr->value);
+        else if (strcmp(attr->resource, ncpus) == 0)
+            usage.allocatedCpus = std::stoul(attr->value);
+    }
+    pbs_statfree(status);
+    if (usage.elapsedSeconds == 0)
+        return std::nullopt;
+    return usage;
+}
+
 PBS::PBS()
 {
     if (ourSettings.pbsHost.get().empty())
@@ -78,56 +201,77 @@ void PBS::submit(nix::StorePath drvPath)
     // We don't know the jobdir until after the job is running, so use a
     // relative path for the script generation and update it to an absolute
     // path after submission.
-    rootPath = nix::fmt("%s.root", jobNameStr.data());
+    rootPath = nix::fmt("%s-%s.root", jobNameStr, readyToken);
+
+    auto store = nix::openStore();
+    auto drv = store->readDerivation(drvPath);
+    json resources = json::object();
+    if (drv.env.count("pbsResources") == 1)
+        resources = json::parse(drv.env["pbsResources"]);
+
+    /* So do the resources of the derivation over the auto-sizing. CPUs and
+     * memory requested per chunk are left alone. */
+    if (sizing) {
+        if (!resources.contains("ncpus") && !resources.contains("select")) {
+            resources["ncpus"] = std::to_string(sizing->cpus);
+            autoSized = true;
+        }
+        if (!resources.contains("mem") && !resources.contains("select")) {
+            resources["mem"] = nix::fmt("%dmb", sizing->memoryMB);
+            autoSized = true;
+        }
+        if (!resources.contains("walltime")) {
+            resources["walltime"] = nix::fmt("%02d:%02d:00", sizing->timeLimitMinutes / 60, sizing->timeLimitMinutes % 60);
+            autoSized = true;
+        }
+    }
+
+    /* Hosts or chunks requested by the derivation take precedence over the
+     * preferred host. */
+    jobName = jobNameStr;
+    jobScript = genScript(drvPath, rootPath, readyToken, stagedPaths);
+    jobResources = resources;
+    bool held = preferredHost != "" && !resources.contains("host") && !resources.contains("select");
+    if (held)
+        resources["host"] = preferredHost;
+
+    {
+        SignalsBlocked blocked;
+        submitScript(jobNameStr, jobScript, makeResources(resources));
+    }
+    if (held)
+        heldForPreferredHost();
+
+    auto jobDir = waitForPlacement();
 
+    auto jobIdNum = nix::tokenizeString<nix::Strings>(jobId, ".").front();
+    jobStderr = nix::fmt("%s/%s.e%s", jobDir, jobNameStr, jobIdNum);
+    rootPath = nix::fmt("%s/%s-%s.root", jobDir, jobNameStr, readyToken);
+}
+
+void PBS::submitScript(std::string jobName, const std::string & script, attropl *resources)
+{
     char tmp_template[] = "pbsscrptXXXXXX";
     snprintf(scriptName, sizeof(scriptName), "%s/%s", std::filesystem::temp_directory_path().c_str(), tmp_template);
     int fd = mkstemp(scriptName);
-    if (fd == -1)
+    if (fd == -1) {
+        free_attropl_list(resources);
         throw PBSSubmitError(nix::fmt("Error creating temporary file for PBS script %s", scriptName));
+    }
     createdScript = true;
     __gnu_cxx::stdio_filebuf<char> scriptOutBuf(fd, std::ios::out);
     std::ostream scriptOut(&scriptOutBuf);
-    scriptOut << genScript(drvPath, rootPath);
+    scriptOut << script;
     scriptOut.flush();
 
-    // Attribute chain:
-    // v -> k -> N -> (l1/aResBase -> l2 -> l3 -> ...)
-
-    auto store = nix::openStore();
-    auto drv = store->readDerivation(drvPath);
-    std::string res = "";
-    attropl *aResBase = nullptr;
-    if (drv.env.count("pbsResources") == 1) {
-        json pbsResources = json::parse(drv.env["pbsResources"]);
-        attropl *prev = nullptr;
-        for (auto & [key, value] : pbsResources.items()) {
-            auto attr = new_attropl();
-            attr->name = ATTR_l;
-            attr->resource = new char[key.size() + 1];
-            strncpy(attr->resource, key.data(), key.size());
-            attr->resource[key.size()] = '\0';
-            std::string strValue(value);
-            attr->value = new char[strValue.size() + 1];
-            strncpy(attr->value, strValue.data(), strValue.size());
-            attr->value[strValue.size()] = '\0';
-            if (!aResBase)
-                aResBase = attr;
-            else if (prev != nullptr)
-                prev->next = attr;
-            prev = attr;
-        }
-    }
-
-    attropl aName = {aResBase != nullptr ? aResBase : nullptr, ATTR_N, nullptr, jobNameStr.data(), SET};
+    attropl aName = {resources, ATTR_N, nullptr, jobName.data(), SET};
     char kfVal[] = "oe";  // Hush write-strings warning
     attropl aKeepFiles = {&aName, ATTR_k, nullptr, kfVal, SET};
     char pathVar[] = PATH_VAR;
     attropl aVariableList = {&aKeepFiles, ATTR_v, nullptr, pathVar, SET};
 
-    blockSignals();
     char *id = pbs_submit(connHandle, &aVariableList, scriptName, nullptr, nullptr);
-    free_attropl_list(aResBase);
+    free_attropl_list(resources);
     aName.next = nullptr;
     if (id == nullptr) {
         if (auto err_list = pbs_get_attributes_in_error(connHandle)) {
@@ -137,32 +281,60 @@ void PBS::submit(nix::StorePath drvPath)
         throw PBSSubmitError(nix::fmt("Error submitting PBS job: %s", pbs_geterrmsg(connHandle)));
     }
     jobId = id;
-    unblockSignals();
+}
+
+void PBS::waitForJobRunning()
+{
+    JobPoll poll(1s);
+    while (true) {
+        auto times = getJobTimes(connHandle, jobId);
+        poll.queried();
+        if (times.state == "R") {
+            poll.detected(times.start);
+            if (times.start && times.walltime)
+                expectedEnd = *times.start + *times.walltime;
+            return;
+        } else if (times.state == "F")
+            throw PBSDeletedError(jobId);
+        checkAffinity();
+        pollSleep(poll, times.estimatedStart);
+    }
+}
 
-    waitForJobRunning(connHandle, jobId);
+void PBS::releasePreferredHost()
+{
+    /* The host cannot be taken out of the chunks of a queued job, so the
+     * job is submitted again without it. */
+    if (pbs_deljob(connHandle, jobId.data(), nullptr)) {
+        using namespace nix;
+        printError("NSH Error: unable to let job %s run on any node: %s", jobId, pbs_geterrmsg(connHandle));
+        return;
+    }
+    unlink(scriptName);
+    SignalsBlocked blocked;
+    submitScript(jobName, jobScript, makeResources(jobResources));
+}
+
+std::string PBS::waitForPlacement()
+{
+    waitForJobRunning();
 
     attrl jobdirAttr = {nullptr, ATTR_jobdir, nullptr, nullptr, SET};
     batch_status *jobdirStatus;
-    auto sleepTime = 50ms;
+    JobPoll poll(1s);
     while (true) {
         jobdirStatus = pbs_statjob(connHandle, jobId.data(), &jobdirAttr, nullptr);
         if (jobdirStatus == nullptr) {
             throw PBSQueryError(nix::fmt("Error querying %s for job %s: %d", ATTR_jobdir, jobId, pbs_errno));
         } else if (jobdirStatus->attribs == nullptr) {
             pbs_statfree(jobdirStatus);
-            std::this_thread::sleep_for(sleepTime);
-            if (sleepTime < 1s) sleepTime *= 2;
+            pollSleep(poll);
         } else break;
     }
     std::string jobDir = jobdirStatus->attribs->value;
     pbs_statfree(jobdirStatus);
 
-    auto jobIdNum = nix::tokenizeString<nix::Strings>(jobId, ".").front();
-    jobStderr = nix::fmt("%s/%s.e%s", jobDir, jobNameStr, jobIdNum);
-    rootPath = nix::fmt("%s/%s.root", jobDir, jobNameStr);
-
     attrl serverAttr = {nullptr, ATTR_server, nullptr, nullptr, SET};
-    sleepTime = 50ms;
     batch_status *serverStatus;
     while (true) {
         serverStatus = pbs_statjob(connHandle, jobId.data(), &serverAttr, nullptr);
@@ -170,20 +342,39 @@ void PBS::submit(nix::StorePath drvPath)
             throw PBSQueryError(nix::fmt("Error querying %s for job %s: %d", ATTR_server, jobId, pbs_errno));
         } else if (serverStatus->attribs == nullptr) {
             pbs_statfree(serverStatus);
-            std::this_thread::sleep_for(sleepTime);
-            if (sleepTime < 1s) sleepTime *= 2;
+            pollSleep(poll);
         } else break;
     }
     hostname = serverStatus->attribs->value;
     pbs_statfree(serverStatus);
+
+    return jobDir;
+}
+
+std::string PBS::submitPilot(const std::string & script)
+{
+    submitScript("Nix_Build_Pilot", script, nullptr);
+    return waitForPlacement();
+}
+
+std::string PBS::pilotLauncher(const std::string & pilotJob)
+{
+    return nix::fmt("pbs_attach -j %s", pilotJob);
 }
 
 int PBS::waitForJobFinish()
 {
-    auto sleepTime = 50ms;
+    if (auto rc = waitForPilotBuild())
+        return *rc;
+    if (auto rc = waitForJobFinishViaBroker())
+        return *rc;
+
+    JobPoll poll(1s);
     while (true) {
         auto state = getJobState(connHandle, jobId);
+        poll.queried();
         if (state == "F") {
+            poll.detected();
             attrl exitAttr = {nullptr, ATTR_exit_status, nullptr, nullptr, SET};
             batch_status *exitStatus = pbs_statjob(connHandle, jobId.data(), &exitAttr, "x");
             if (exitStatus == nullptr || exitStatus->attribs == nullptr)
@@ -192,9 +383,53 @@ int PBS::waitForJobFinish()
             pbs_statfree(exitStatus);
             return value;
         }
-        std::this_thread::sleep_for(sleepTime);
-        if (sleepTime < 1s) sleepTime *= 2;
+        pollSleep(poll, std::nullopt, expectedEnd);
+    }
+}
+
+static void collectJobStatuses(batch_status *status, std::map<std::string, Scheduler::JobStatus> & statuses)
+{
+    for (auto job = status; job != nullptr; job = job->next) {
+        std::string state;
+        int exitCode = -1;
+        for (auto attr = job->attribs; attr != nullptr; attr = attr->next) {
+            if (strcmp(attr->name, ATTR_state) == 0)
+                state = attr->value;
+            else if (strcmp(attr->name, ATTR_exit_status) == 0)
+                exitCode = std::atoi(attr->value);
+        }
+        if (state == "F")
+            statuses[job->name] = {false, exitCode, state};
+        else
+            statuses[job->name] = {true, 0, state};
+    }
+}
+
+std::map<std::string, Scheduler::JobStatus> PBS::queryJobs(const std::set<std::string> & jobIds)
+{
+    std::map<std::string, JobStatus> statuses;
+    attrl exitAttr = {nullptr, ATTR_exit_status, nullptr, nullptr, SET};
+    attrl stateAttr = {&exitAttr, ATTR_state, nullptr, nullptr, SET};
+    auto idList = nix::concatStringsSep(",", jobIds);
+    batch_status *status = pbs_statjob(connHandle, idList.data(), &stateAttr, "x");
+    if (status != nullptr) {
+        collectJobStatuses(status, statuses);
+        pbs_statfree(status);
+        return statuses;
+    }
+
+    // The whole batch fails if a single job is unknown, so fall back to
+    // querying the jobs one by one.
+    if (jobIds.size() == 1)
+        throw PBSQueryError(nix::fmt("Error querying %s for job %s: %d", ATTR_state, idList, pbs_errno));
+    for (auto jobId : jobIds) {
+        status = pbs_statjob(connHandle, jobId.data(), &stateAttr, "x");
+        if (status != nullptr) {
+            collectJobStatuses(status, statuses);
+            pbs_statfree(status);
+        }
     }
+    return statuses;
 }
 
 PBS::~PBS()
@@ -8,6 +8,8 @@
 
 #include <pbs_ifl.h>
 
+#include <nlohmann/json.hpp>
+
 struct PBSConnectionError : public std::runtime_error
 {
     explicit PBSConnectionError(const std::string &s) : std::runtime_error(s) {}
@@ -35,7 +37,27 @@ public:
     ~PBS();
     void submit(nix::StorePath drvPath);
     int waitForJobFinish();
+    std::map<std::string, JobStatus> queryJobs(const std::set<std::string> & jobIds);
+    QueueEstimate estimateQueue();
+    std::string submitPilot(const std::string & script);
+    std::string pilotLauncher(const std::string & pilotJob);
+    std::optional<JobUsage> queryUsage();
 protected:
+    /* Submits script as a job named jobName, taking ownership of the
+     * resources attribute list. */
+    void submitScript(std::string jobName, const std::string & script, attropl *resources);
+    void waitForJobRunning();
+    void releasePreferredHost();
+    /* Waits until the job runs and sets the hostname.
+     * @return Job directory of the job. */
+    std::string waitForPlacement();
+
+    /* Name, script and resources of the job, to submit it again without
+     * the preferred host. */
+    std::string jobName;
+    std::string jobScript;
+    nlohmann::json jobResources;
+
     int connHandle;
     char scriptName[MAXPATHLEN + 1];
     bool createdScript = false;
@@ -0,0 +1,126 @@
+#include "placement.hh"
+#include "state.hh"
+#include "settings.hh"
+
+#include <algorithm>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <nix/store/pathlocks.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/fmt.hh>
+
+static std::string residentDir()
+{
+    return clusterStateFile("resident");
+}
+
+ResidentPaths::ResidentPaths(const std::string & host)
+{
+    auto name = host;
+    std::replace(name.begin(), name.end(), '/', '_');
+    path = residentDir() + "/" + name;
+}
+
+bool ResidentPaths::enabled()
+{
+    return !currentLoadDir().empty() && ourSettings.affinityWait.get() > 0;
+}
+
+/* Reads a file of the index, one '<time recorded> <store path name>' line
+ * per path.
+ * @return The paths recorded less than affinity-ttl seconds ago, mapped to
+ * the time they were recorded. */
+static std::map<std::string, time_t> readNames(const std::string & path)
+{
+    std::map<std::string, time_t> names;
+    std::ifstream file(path);
+    auto oldest = std::time(nullptr) - (time_t) ourSettings.affinityTtl.get();
+    time_t recorded;
+    std::string name;
+    while (file >> recorded >> name)
+        if (recorded > oldest)
+            names[name] = recorded;
+    return names;
+}
+
+template<typename F>
+void ResidentPaths::update(F && f)
+{
+    if (!enabled())
+        return;
+    mkdir(residentDir().c_str(), 0700);
+    auto lock = nix::openLockFile(path + ".lock", true);
+    nix::lockFile(lock.get(), nix::ltWrite, true);
+    auto names = readNames(path);
+    f(names);
+    std::string contents;
+    for (auto & [name, recorded] : names)
+        contents += nix::fmt("%d %s\n", recorded, name);
+    auto tmpPath = nix::fmt("%s.tmp-%d", path, getpid());
+    nix::writeFile(tmpPath, contents, 0600);
+    if (rename(tmpPath.c_str(), path.c_str()) == -1)
+        throw nix::SysError("renaming '%s' to '%s'", tmpPath, path);
+}
+
+void ResidentPaths::add(const nix::StorePathSet & paths)
+{
+    auto now = std::time(nullptr);
+    update([&](std::map<std::string, time_t> & names) {
+        for (auto & p : paths)
+            names[std::string(p.to_string())] = now;
+    });
+}
+
+void ResidentPaths::reset(const std::vector<std::string> & retained)
+{
+    auto now = std::time(nullptr);
+    update([&](std::map<std::string, time_t> & names) {
+        names.clear();
+        for (auto & p : retained)
+            names[std::string(nix::baseNameOf(p))] = now;
+    });
+}
+
+void ResidentPaths::clear()
+{
+    update([&](std::map<std::string, time_t> & names) {
+        names.clear();
+    });
+}
+
+std::optional<std::string> choosePreferredHost(nix::Store & store, const nix::StorePathSet & paths)
+{
+    if (!ResidentPaths::enabled() || !std::filesystem::is_directory(residentDir()))
+        return std::nullopt;
+
+    std::map<std::string, uint64_t> sizes;
+    uint64_t total = 0;
+    for (auto & p : paths) {
+        auto size = store.queryPathInfo(p)->narSize;
+        sizes.emplace(std::string(p.to_string()), size);
+        total += size;
+    }
+
+    /* Files are read without the lock, as they are replaced atomically. */
+    std::optional<std::string> best;
+    uint64_t bestMissing = total;
+    for (auto & entry : std::filesystem::directory_iterator(residentDir())) {
+        auto name = entry.path().filename().string();
+        if (name.ends_with(".lock") || name.find(".tmp-") != std::string::npos)
+            continue;
+        uint64_t missing = total;
+        for (auto & [resident, recorded] : readNames(entry.path().string()))
+            if (auto size = sizes.find(resident); size != sizes.end())
+                missing -= size->second;
+        if (missing < bestMissing) {
+            best = name;
+            bestMissing = missing;
+        }
+    }
+    return best;
+}
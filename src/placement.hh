@@ -0,0 +1,48 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <nix/store/path.hh>
+#include <nix/store/store-api.hh>
+
+/* Index of the store paths held by the remote store of every build node, for
+ * cache-affinity placement when affinity-wait is set. The paths of a node
+ * are the inputs and outputs of the builds NSH ran on it, until NSH collects
+ * garbage there, after which only the retained paths are left. Paths are
+ * forgotten after affinity-ttl seconds unless recorded again, and all paths
+ * of a node once a build on it failed. Kept as a file per node in the
+ * 'resident' directory of the current-load directory, so that the nodes are
+ * known by name. */
+class ResidentPaths
+{
+public:
+    explicit ResidentPaths(const std::string & host);
+
+    /* Whether affinity-wait is set. */
+    static bool enabled();
+
+    /* Records paths as present on the node. */
+    void add(const nix::StorePathSet & paths);
+
+    /* Replaces the paths of the node by retained, the paths kept by garbage
+     * collection, given as absolute store paths. */
+    void reset(const std::vector<std::string> & retained);
+
+    /* Forgets all paths of the node. */
+    void clear();
+
+private:
+    std::string path;
+
+    /* Updates the record under the lock. */
+    template<typename F>
+    void update(F && f);
+};
+
+/* Picks the node to prefer for a build needing paths, the one whose remote
+ * store misses the fewest bytes of them, with sizes taken from store.
+ * @return Hostname of the node, or std::nullopt if no node holds any of
+ * paths. */
+std::optional<std::string> choosePreferredHost(nix::Store & store, const nix::StorePathSet & paths);
@@ -0,0 +1,72 @@
+#include "polling.hh"
+#include "settings.hh"
+#include "trace.hh"
+
+#include <algorithm>
+using namespace std::chrono_literals;
+
+PollMetrics pollMetrics;
+
+JobPoll::JobPoll(std::chrono::milliseconds maxInterval)
+    : backoff(50ms), maxInterval(maxInterval)
+{
+}
+
+void JobPoll::queried()
+{
+    previousQuery = lastQuery;
+    lastQuery = Clock::now();
+    pollMetrics.queries++;
+    /* One span per iteration, from the previous query to this one. */
+    if (previousQuery)
+        traceSpan("poll", "job state poll", *previousQuery, *lastQuery, {{"interval_ms",
+            std::chrono::duration_cast<std::chrono::milliseconds>(*lastQuery - *previousQuery).count()}});
+}
+
+std::chrono::milliseconds JobPoll::nextInterval(
+    std::optional<Clock::time_point> expected,
+    std::optional<Clock::time_point> deadline)
+{
+    std::chrono::milliseconds limit = std::chrono::seconds(ourSettings.pollMaxInterval.get());
+    auto now = Clock::now();
+    if (expected && *expected > now && !ignoreEstimate) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(*expected - now);
+        /* Poll quickly again once the estimate has passed. */
+        backoff = 50ms;
+        return std::clamp<std::chrono::milliseconds>(left / 2, 50ms, std::max(limit, 50ms));
+    }
+    auto interval = std::min(backoff, std::max(limit, 50ms));
+    if (backoff < maxInterval)
+        backoff = std::min(backoff * 2, maxInterval);
+    /* Query right when the deadline passes rather than up to an interval
+     * later. */
+    if (deadline && *deadline > now && !ignoreEstimate)
+        interval = std::clamp<std::chrono::milliseconds>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(*deadline - now), 50ms, interval);
+    return interval;
+}
+
+void JobPoll::expectSoon()
+{
+    ignoreEstimate = true;
+    backoff = 50ms;
+}
+
+void JobPoll::detected(std::optional<Clock::time_point> changed)
+{
+    auto now = Clock::now();
+    std::chrono::milliseconds latency = 0ms;
+    if (changed)
+        latency = std::chrono::duration_cast<std::chrono::milliseconds>(now - *changed);
+    else if (previousQuery)
+        latency = std::chrono::duration_cast<std::chrono::milliseconds>(now - *previousQuery);
+    pollMetrics.detections++;
+    pollMetrics.detectionLatencyMs += std::max<int64_t>(latency.count(), 0);
+}
+
+std::optional<JobPoll::Clock::time_point> fromEpoch(int64_t seconds)
+{
+    if (seconds <= 0)
+        return std::nullopt;
+    return JobPoll::Clock::from_time_t(seconds);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+/* Counters of the job state queries made by this process while waiting for
+ * jobs to start or finish. */
+struct PollMetrics
+{
+    /* Number of scheduler queries. */
+    std::atomic<uint64_t> queries = 0;
+    /* Number of job state changes detected. */
+    std::atomic<uint64_t> detections = 0;
+    /* Sum over all detected changes of the time between the change and its
+     * detection. When the scheduler does not report when the change happened,
+     * the time since the previous query is used, which is an upper bound. */
+    std::atomic<uint64_t> detectionLatencyMs = 0;
+};
+
+extern PollMetrics pollMetrics;
+
+/* Paces the queries made while waiting for a job to reach some state. When
+ * the scheduler estimates when that happens (the start time of a pending
+ * job), the interval is half of the time left, so that polling is sparse
+ * while the event is far off and tightens as it approaches. Without an
+ * estimate, or once it has passed, the interval doubles from 50 ms up to
+ * maxInterval, as before. A deadline (the end of the time limit of a running
+ * job) does not stretch the interval, as the job may end at any time before,
+ * but the next query is made when it passes if that is sooner. No interval
+ * exceeds poll-max-interval. */
+class JobPoll
+{
+public:
+    using Clock = std::chrono::system_clock;
+
+    explicit JobPoll(std::chrono::milliseconds maxInterval);
+
+    /* Records a query of the job state. */
+    void queried();
+
+    /* @return Time to wait before the next query.
+     * @param expected Time at which the scheduler expects the state change.
+     * @param deadline Time by which the state change happens at the latest. */
+    std::chrono::milliseconds nextInterval(
+        std::optional<Clock::time_point> expected,
+        std::optional<Clock::time_point> deadline = std::nullopt);
+
+    /* Ignores estimates from now on and polls with intervals starting from
+     * the minimum again, for when the state change is known to be imminent. */
+    void expectSoon();
+
+    /* Records that the awaited state change was detected.
+     * @param changed Time of the change as reported by the scheduler. */
+    void detected(std::optional<Clock::time_point> changed = std::nullopt);
+
+private:
+    std::chrono::milliseconds backoff;
+    std::chrono::milliseconds maxInterval;
+    bool ignoreEstimate = false;
+    std::optional<Clock::time_point> lastQuery;
+    std::optional<Clock::time_point> previousQuery;
+};
+
+/* @return Time given as seconds since the epoch, or std::nullopt if it is
+ * unset (0). */
+std::optional<JobPoll::Clock::time_point> fromEpoch(int64_t seconds);
@@ -0,0 +1,151 @@
+#include "retention.hh"
+#include "state.hh"
+#include "settings.hh"
+
+#include <algorithm>
+#include <fstream>
+#include <unistd.h>
+
+#include <nix/store/pathlocks.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/fmt.hh>
+
+StoreRetention::StoreRetention(const std::string & host)
+    : path(nodeStateFile(host, ".retention"))
+{
+}
+
+bool StoreRetention::enabled()
+{
+    return !currentLoadDir().empty() && ourSettings.remoteStoreBudget.get() > 0;
+}
+
+void StoreRetention::read(Stats & stats, std::map<std::string, Entry> & entries)
+{
+    /* The first line holds the counters, followed by one '<last used>
+     * <size> <name>' line per path. */
+    std::ifstream file(path);
+    std::string tag;
+    if (!(file >> tag >> stats.hits >> stats.misses >> stats.hitBytes >> stats.missBytes >> stats.evictions >> stats.evictedBytes) || tag != "stats") {
+        stats = {};
+        return;
+    }
+    Entry entry;
+    std::string name;
+    while (file >> entry.used >> entry.size >> name)
+        entries[name] = entry;
+}
+
+void StoreRetention::write(const Stats & stats, const std::map<std::string, Entry> & entries)
+{
+    std::string contents = nix::fmt("stats %d %d %d %d %d %d\n",
+        stats.hits, stats.misses, stats.hitBytes, stats.missBytes, stats.evictions, stats.evictedBytes);
+    for (auto & [name, entry] : entries)
+        contents += nix::fmt("%d %d %s\n", entry.used, entry.size, name);
+    auto tmpPath = nix::fmt("%s.tmp-%d", path, getpid());
+    nix::writeFile(tmpPath, contents, 0600);
+    if (rename(tmpPath.c_str(), path.c_str()) == -1)
+        throw nix::SysError("renaming '%s' to '%s'", tmpPath, path);
+}
+
+template<typename F>
+void StoreRetention::update(F && f)
+{
+    auto lock = nix::openLockFile(path + ".lock", true);
+    nix::lockFile(lock.get(), nix::ltWrite, true);
+    Stats stats;
+    std::map<std::string, Entry> entries;
+    read(stats, entries);
+    f(stats, entries);
+    write(stats, entries);
+}
+
+/* Marks paths as used now, taking the size of the paths not seen before from
+ * store.
+ * @return Total size of paths. */
+static uint64_t markUsed(nix::Store & store, const nix::StorePathSet & paths, std::map<std::string, StoreRetention::Entry> & entries)
+{
+    uint64_t bytes = 0;
+    auto now = std::time(nullptr);
+    for (auto & p : paths) {
+        std::string name(p.to_string());
+        auto it = entries.find(name);
+        if (it == entries.end())
+            it = entries.emplace(name, StoreRetention::Entry{now, store.queryPathInfo(p)->narSize}).first;
+        it->second.used = now;
+        bytes += it->second.size;
+    }
+    return bytes;
+}
+
+void StoreRetention::recordInputs(nix::Store & store, const nix::StorePathSet & hits, const nix::StorePathSet & misses)
+{
+    if (!enabled())
+        return;
+    update([&](Stats & stats, std::map<std::string, Entry> & entries) {
+        stats.hits += hits.size();
+        stats.misses += misses.size();
+        stats.hitBytes += markUsed(store, hits, entries);
+        stats.missBytes += markUsed(store, misses, entries);
+    });
+}
+
+void StoreRetention::touch(nix::Store & store, const nix::StorePathSet & paths)
+{
+    if (!enabled() || paths.empty())
+        return;
+    update([&](Stats & stats, std::map<std::string, Entry> & entries) {
+        markUsed(store, paths, entries);
+    });
+}
+
+std::vector<std::string> StoreRetention::retain(uint64_t budget)
+{
+    std::vector<std::string> retained;
+    if (!enabled())
+        return retained;
+    update([&](Stats & stats, std::map<std::string, Entry> & entries) {
+        std::vector<std::pair<std::string, Entry>> byUse(entries.begin(), entries.end());
+        std::sort(byUse.begin(), byUse.end(), [](auto & a, auto & b) { return a.second.used > b.second.used; });
+        uint64_t total = 0;
+        bool full = false;
+        for (auto & [name, entry] : byUse) {
+            full = full || total + entry.size > budget;
+            if (!full) {
+                total += entry.size;
+                retained.push_back(ourSettings.storeDir.get() + "/" + name);
+            } else {
+                stats.evictions++;
+                stats.evictedBytes += entry.size;
+                entries.erase(name);
+            }
+        }
+    });
+    return retained;
+}
+
+StoreRetention::Stats StoreRetention::getStats()
+{
+    Stats stats;
+    if (!enabled())
+        return stats;
+    auto lock = nix::openLockFile(path + ".lock", true);
+    nix::lockFile(lock.get(), nix::ltRead, true);
+    std::map<std::string, Entry> entries;
+    read(stats, entries);
+    return stats;
+}
+
+static double percent(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+std::string showRetentionStats(const StoreRetention::Stats & stats)
+{
+    return nix::fmt("%.1f%% of paths and %.1f%% of bytes found present, %d paths (%.1f MiB) evicted",
+        percent(stats.hits, stats.hits + stats.misses),
+        percent(stats.hitBytes, stats.hitBytes + stats.missBytes),
+        stats.evictions,
+        stats.evictedBytes / 1048576.0);
+}
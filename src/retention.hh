@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <nix/store/path.hh>
+#include <nix/store/store-api.hh>
+
+/* Record of when the store paths in the remote store of a build node were
+ * last used by a build, kept in the current-load directory next to the
+ * ValidityCache. With remote-store-budget set, garbage collection after a
+ * job keeps the most recently used paths that fit in the budget, instead of
+ * deleting everything. Also counts how many of the inputs of builds were
+ * already present in the remote store, to tune the budget. */
+class StoreRetention
+{
+public:
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t hitBytes = 0;
+        uint64_t missBytes = 0;
+        uint64_t evictions = 0;
+        uint64_t evictedBytes = 0;
+    };
+
+    explicit StoreRetention(const std::string & host);
+
+    /* Whether remote-store-budget is set. */
+    static bool enabled();
+
+    /* Records the inputs of a build, the ones found in the remote store as
+     * hits and the uploaded ones as misses, and marks all of them as used.
+     * Sizes are taken from store. */
+    void recordInputs(nix::Store & store, const nix::StorePathSet & hits, const nix::StorePathSet & misses);
+
+    /* Marks paths as used, e.g. the outputs of a build. */
+    void touch(nix::Store & store, const nix::StorePathSet & paths);
+
+    /* Picks the most recently used paths whose total size fits in budget
+     * bytes, and forgets the others, which are about to be deleted.
+     * @return Store paths to keep. */
+    std::vector<std::string> retain(uint64_t budget);
+
+    Stats getStats();
+
+    struct Entry
+    {
+        time_t used;
+        uint64_t size;
+    };
+
+private:
+    std::string path;
+
+    /* Updates the record under the lock. */
+    template<typename F>
+    void update(F && f);
+
+    void read(Stats & stats, std::map<std::string, Entry> & entries);
+    void write(const Stats & stats, const std::map<std::string, Entry> & entries);
+};
+
+/* @return Hit rates in stats, for display. */
+std::string showRetentionStats(const StoreRetention::Stats & stats);
@@ -0,0 +1,196 @@
+#include "routing.hh"
+#include "scheduler.hh"
+#include "settings.hh"
+#include "state.hh"
+
+#include <fstream>
+#include <map>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+using namespace std::chrono_literals;
+
+#include <nix/store/pathlocks.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/fmt.hh>
+#include <nix/util/logging.hh>
+
+/* Time after which a cluster that has not answered is left out. */
+#define PROBE_TIMEOUT 10s
+
+/* The estimate of the settings of 'nsh.conf' alone, without clusters, is
+ * kept under a name no cluster can have. */
+static std::string estimatePath(const std::string & cluster)
+{
+    return currentLoadDir() + "/routing/" + (cluster.empty() ? ".default" : cluster);
+}
+
+static std::string describe(const std::string & cluster)
+{
+    return cluster.empty() ? "the job scheduler" : nix::fmt("cluster '%s'", cluster);
+}
+
+/* @return Whether the settings of a cluster accept the build, as the checks
+ * of the hook do. */
+static bool accepts(const Settings & settings, const std::string & neededSystem, const nix::StringSet & requiredFeatures)
+{
+    if (neededSystem != settings.system.get())
+        return false;
+    for (auto & feature : requiredFeatures)
+        if (!settings.systemFeatures.get().contains(feature))
+            return false;
+    for (auto & feature : settings.mandatorySystemFeatures.get())
+        if (!requiredFeatures.contains(feature))
+            return false;
+    return true;
+}
+
+/* Reads the estimate of a cluster, as '<time> <pending jobs> <start delay,
+ * or -1 if not predicted>'.
+ * @param maxAge Age in seconds beyond which the estimate is ignored.
+ * @return Estimate, or std::nullopt if there is none. */
+static std::optional<Scheduler::QueueEstimate> readEstimate(const std::string & cluster, time_t maxAge)
+{
+    std::ifstream file(estimatePath(cluster));
+    time_t time;
+    Scheduler::QueueEstimate estimate;
+    int64_t startDelay;
+    if (!(file >> time >> estimate.pendingJobs >> startDelay) || time + maxAge < ::time(nullptr))
+        return std::nullopt;
+    if (startDelay >= 0)
+        estimate.startDelay = std::chrono::seconds(startDelay);
+    return estimate;
+}
+
+static void writeEstimate(const std::string & cluster, const Scheduler::QueueEstimate & estimate)
+{
+    auto path = estimatePath(cluster);
+    auto tmpPath = nix::fmt("%s.tmp-%d", path, getpid());
+    nix::writeFile(tmpPath, nix::fmt("%d %d %d\n", time(nullptr), estimate.pendingJobs,
+        estimate.startDelay ? estimate.startDelay->count() : -1), 0600);
+    if (rename(tmpPath.c_str(), path.c_str()) == -1)
+        throw nix::SysError("renaming '%s' to '%s'", tmpPath, path);
+}
+
+/* Queries the queue of a cluster with its settings, which only apply to a
+ * child process so that our own settings are left alone. A cluster that
+ * cannot be queried loses its estimate.
+ * @param lock Lock on the estimate, held while the child runs.
+ * @return Pid of the child. */
+static pid_t probeCluster(const std::string & cluster, nix::AutoCloseFD & lock)
+{
+    pid_t pid = fork();
+    if (pid == -1)
+        throw nix::SysError("forking to query %s", describe(cluster));
+    if (pid == 0) {
+        /* The lock stays with the parent, which gives up on us after
+         * PROBE_TIMEOUT. We give up by then too, in case the parent is
+         * gone. */
+        lock.close();
+        signal(SIGALRM, SIG_DFL);
+        alarm(std::chrono::seconds(PROBE_TIMEOUT).count());
+        try {
+            if (!cluster.empty())
+                loadClusterConfFile(ourSettings, cluster);
+            writeEstimate(cluster, makeScheduler()->estimateQueue());
+            _exit(0);
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: unable to query the queue of %s: %s", describe(cluster), e.what());
+            unlink(estimatePath(cluster).c_str());
+            _exit(1);
+        }
+    }
+    return pid;
+}
+
+/* Makes sure the estimates of clusters are fresh, querying the clusters
+ * whose estimate has expired at the same time. A cluster already being
+ * queried by another build is waited for instead. */
+static void refreshEstimates(const std::vector<std::string> & clusters)
+{
+    mkdir((currentLoadDir() + "/routing").c_str(), 0700);
+    std::map<std::string, std::pair<nix::AutoCloseFD, pid_t>> probes;
+    std::vector<std::string> busy;
+    for (auto & cluster : clusters) {
+        if (readEstimate(cluster, ourSettings.clusterEstimateTtl.get()))
+            continue;
+        auto lock = nix::openLockFile(estimatePath(cluster) + ".lock", true);
+        if (nix::lockFile(lock.get(), nix::ltWrite, false)) {
+            if (readEstimate(cluster, ourSettings.clusterEstimateTtl.get()))
+                continue;
+            auto pid = probeCluster(cluster, lock);
+            probes.emplace(cluster, std::make_pair(std::move(lock), pid));
+        } else
+            busy.push_back(cluster);
+    }
+    auto deadline = std::chrono::steady_clock::now() + PROBE_TIMEOUT;
+    for (auto & [cluster, probe] : probes) {
+        auto pid = probe.second;
+        while (waitpid(pid, nullptr, WNOHANG) == 0) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                using namespace nix;
+                printError("NSH Error: %s did not answer in time", describe(cluster));
+                kill(pid, SIGKILL);
+                waitpid(pid, nullptr, 0);
+                unlink(estimatePath(cluster).c_str());
+                break;
+            }
+            std::this_thread::sleep_for(20ms);
+        }
+    }
+    probes.clear();
+    for (auto & cluster : busy) {
+        auto lock = nix::openLockFile(estimatePath(cluster) + ".lock", true);
+        nix::lockFile(lock.get(), nix::ltWrite, true);
+    }
+}
+
+/* @return Route to a cluster after its refreshed estimate, or std::nullopt
+ * if it could not be queried. */
+static std::optional<Route> readRoute(const std::string & cluster)
+{
+    /* Estimates refreshed above are at most as old as the probes. */
+    auto estimate = readEstimate(cluster, ourSettings.clusterEstimateTtl.get() + std::chrono::seconds(PROBE_TIMEOUT).count());
+    if (!estimate)
+        return std::nullopt;
+    if (estimate->startDelay)
+        return Route{cluster, "start_time", *estimate->startDelay};
+    return Route{cluster, "queue_depth", std::chrono::seconds(estimate->pendingJobs * ourSettings.pendingJobSeconds.get())};
+}
+
+std::optional<Route> routeBuild(const std::string & neededSystem, const nix::StringSet & requiredFeatures)
+{
+    std::vector<std::string> candidates;
+    for (auto & cluster : ourSettings.clusters.get()) {
+        Settings settings;
+        loadConfFile(settings);
+        loadClusterConfFile(settings, cluster);
+        if (accepts(settings, neededSystem, requiredFeatures))
+            candidates.push_back(cluster);
+    }
+    if (candidates.empty())
+        return std::nullopt;
+
+    refreshEstimates(candidates);
+
+    /* Clusters are compared by the predicted start of the job, or by their
+     * pending jobs where the scheduler does not predict it. Ties go to the
+     * cluster listed first. */
+    std::optional<Route> best;
+    for (auto & cluster : candidates)
+        if (auto route = readRoute(cluster); route && (!best || route->expectedWait < best->expectedWait))
+            best = route;
+    if (!best)
+        best = Route{candidates.front(), "default", 0s};
+    return best;
+}
+
+std::optional<Route> estimateRoute()
+{
+    refreshEstimates({""});
+    return readRoute("");
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <string>
+
+#include <nix/util/types.hh>
+
+/* Cluster a build is routed to, see the clusters setting. */
+struct Route
+{
+    std::string cluster;
+    /* What the choice was based on: 'start_time' if the scheduler of the
+     * cluster predicted when the job would start, 'queue_depth' if the wait
+     * was derived from the number of pending jobs, or 'default' if no
+     * cluster could be queried. */
+    std::string basis;
+    std::chrono::seconds expectedWait;
+};
+
+/* Picks the cluster to submit a build to, among the clusters whose settings
+ * accept its system and features: the one expected to start the job first.
+ * The estimates of every cluster are shared through the 'routing' directory
+ * of the current-load directory, and a cluster is only queried again once
+ * its estimate is older than cluster-estimate-ttl seconds.
+ * @return Route to the cluster, or std::nullopt if no cluster accepts the
+ * build. */
+std::optional<Route> routeBuild(const std::string & neededSystem, const nix::StringSet & requiredFeatures);
+
+/* Estimates the wait for a job submitted with the settings of 'nsh.conf',
+ * when clusters is not set, from an estimate shared as for routeBuild().
+ * @return Route with an empty cluster name, or std::nullopt if the
+ * scheduler could not be queried. */
+std::optional<Route> estimateRoute();
@@ -10,24 +10,76 @@
 
 #define PATH_VAR "PATH=/run/current-system/sw/bin/:/usr/local/bin:/usr/bin:/bin:/nix/var/nix/profiles/default/bin"
 
-static std::string genScript(nix::StorePath drvPath, std::string rootPath)
+/* @return Command starting a build in the allocation of the Slurm pilot job
+ * pilotJob, as a job step of its own limited to pilot-slot-cpus and
+ * pilot-slot-memory. */
+static std::string srunPilotLauncher(const std::string & pilotJob)
+{
+    auto launcher = nix::fmt("srun --jobid=%s --overlap --nodes=1 --ntasks=1 --quiet", pilotJob);
+    if (auto cpus = ourSettings.pilotSlotCpus.get())
+        launcher += nix::fmt(" --exact --cpus-per-task=%d", cpus);
+    if (auto memory = ourSettings.pilotSlotMemory.get())
+        launcher += nix::fmt(" --mem=%dM", memory);
+    return launcher;
+}
+
+/* Generates the job script. The job first waits until NSH signals that the
+ * inputs have been uploaded (see Scheduler::signalInputsReady), by writing
+ * readyToken to '<rootPath>.ready' and waking up the job through the FIFO
+ * '<rootPath>.fifo'. The FIFO is opened read-write so that neither side
+ * blocks when opening it, and the token guards against stale files left
+ * behind by earlier builds of the same derivation. If the inputs were
+ * uploaded to the staging store, the token is followed by 'staged' and the
+ * job copies stagedPaths from there before building. With staging-outputs,
+ * the job copies the outputs back to the staging store once built. */
+static std::string genScript(nix::StorePath drvPath, std::string rootPath, std::string readyToken, const nix::StorePathSet & stagedPaths)
 {
     auto nixCmdPrefix = ourSettings.remoteNixBinDir.get() != "" ? ourSettings.remoteNixBinDir.get() + "/" : "";
+    auto stagingStore = ourSettings.remoteStagingStore.get() != "" ? ourSettings.remoteStagingStore.get() : ourSettings.stagingStore.get();
+    std::string copyStaged;
+    if (!stagedPaths.empty()) {
+        std::vector<std::string> paths;
+        for (auto & path : stagedPaths)
+            paths.push_back(nix::fmt("'%s/%s'", ourSettings.storeDir.get(), std::string(path.to_string())));
+        copyStaged = nix::fmt(
+            "{ [ \"$mode\" != staged ] || %snix copy --extra-experimental-features nix-command --no-check-sigs --from '%s' --to '%s' %s; } && ",
+            nixCmdPrefix,
+            stagingStore,
+            ourSettings.remoteStore.get(),
+            boost::algorithm::join(paths, " "));
+    }
+    /* A failure to stage the outputs is not fatal, NSH then copies them
+     * from the node directly. */
+    std::string copyOutputs;
+    if (stagingStore != "" && ourSettings.stagingOutputs.get())
+        copyOutputs = nix::fmt(
+            "[ $rc != 0 ] || %snix copy --extra-experimental-features nix-command --from '%s' --to '%s' $outputs;",
+            nixCmdPrefix,
+            ourSettings.remoteStore.get(),
+            stagingStore);
     return nix::fmt(
         "#!/bin/sh\n"
-        "while ! %snix-store --store '%s' --query --hash %s/%s >/dev/null 2>&1; do sleep 0.1; done;"
-        "%snix-store --store '%s' --realise %s/%s --quiet --option system-features '%s' --add-root %s;"
+        "ready='%s.ready';"
+        "fifo='%s.fifo';"
+        "[ -p \"$fifo\" ] || { rm -f \"$fifo\"; mkfifo \"$fifo\"; };"
+        "exec 3<>\"$fifo\";"
+        "until { read -r token mode < \"$ready\"; } 2>/dev/null && [ \"$token\" = %s ]; do read -r _ <&3; done;"
+        "exec 3<&-;"
+        "outputs=$(%s%snix-store --store '%s' --realise %s/%s --quiet --option system-features '%s' --add-root %s);"
         "rc=$?;"
+        "%s"
         "echo '@nsh done' >&2;"
         "exit $rc",
-        nixCmdPrefix,
-        ourSettings.remoteStore.get(),
-        ourSettings.storeDir.get(), std::string(drvPath.to_string()),
+        rootPath,
+        rootPath,
+        readyToken,
+        copyStaged,
         nixCmdPrefix,
         ourSettings.remoteStore.get(),
         ourSettings.storeDir.get(), std::string(drvPath.to_string()),
         boost::algorithm::join(ourSettings.systemFeatures.get(), " "),
-        rootPath
+        rootPath,
+        copyOutputs
     );
 }
 
@@ -48,3 +100,22 @@ static void unblockSignals()
     if (pthread_sigmask(SIG_UNBLOCK, &set, nullptr))
         throw nix::SysError("unblocking SIGTERM");
 }
+
+/* Blocks SIGTERM while in scope, also when leaving it with an exception. */
+struct SignalsBlocked
+{
+    SignalsBlocked()
+    {
+        blockSignals();
+    }
+
+    ~SignalsBlocked()
+    {
+        try {
+            unblockSignals();
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("NSH Error: %s", e.what());
+        }
+    }
+};
@@ -0,0 +1,41 @@
+#include "scheduler.hh"
+#include "slurm.hh"
+#include "pbs.hh"
+#include "slurm-native.hh"
+#include "local.hh"
+#include "sched_util.hh"
+
+#include <nix/util/fmt.hh>
+
+std::unique_ptr<Scheduler> makeScheduler()
+{
+    if (ourSettings.jobScheduler.get() == "slurm")
+        return std::make_unique<Slurm>();
+    else if (ourSettings.jobScheduler.get() == "slurm-native")
+        return std::make_unique<SlurmNative>();
+    else if (ourSettings.jobScheduler.get() == "pbs")
+        return std::make_unique<PBS>();
+    else if (ourSettings.jobScheduler.get() == "local")
+        return std::make_unique<Local>();
+    throw std::runtime_error(nix::fmt("unsupported job scheduler %s", ourSettings.jobScheduler.get()));
+}
+
+std::string Scheduler::startPilotBuild(nix::StorePath drvPath, const std::string & pilotJob, const std::string & host, const std::string & dir)
+{
+    pilotJobId = pilotJob;
+    hostname = host;
+    auto name = "pilot-build-" + std::string(drvPath.hashPart()) + "-" + readyToken;
+    rootPath = dir + "/" + name + ".root";
+    jobStderr = dir + "/" + name + ".stderr";
+    connect();
+    auto script = nix::fmt(
+        "echo $$ > %s && exec %s /bin/sh -c %s 2>%s",
+        nix::shellEscape(rootPath + ".pid"),
+        pilotLauncher(pilotJobId),
+        nix::shellEscape(genScript(drvPath, rootPath, readyToken, stagedPaths)),
+        nix::shellEscape(jobStderr));
+    nix::Strings cmd = {"sh", "-c", nix::shellEscape(script)};
+    pilotConn = sshMaster->startCommand(std::move(cmd));
+    submitCalled = true;
+    return hostname;
+}
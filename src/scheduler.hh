@@ -3,8 +3,20 @@
 #include <string>
 #include <utility>
 #include <iostream>
-#include <ext/stdio_filebuf.h>
+#include <fcntl.h>
 #include <array>
+#include <map>
+#include <set>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <random>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/wait.h>
 
 #include <nix/store/path.hh>
 #include <nix/store/store-open.hh>
@@ -12,36 +24,46 @@
 #include <nix/store/ssh.hh>
 #include <nix/util/types.hh>
 #include <nix/util/logging.hh>
+#include <nix/util/strings.hh>
 
 #include "settings.hh"
+#include "broker.hh"
+#include "state.hh"
+#include "polling.hh"
+#include "cleanup.hh"
+#include "sizing.hh"
 
 class Scheduler
 {
 public:
-    Scheduler() {}
+    Scheduler()
+    {
+        std::random_device rd;
+        std::uniform_int_distribution<uint32_t> dist;
+        readyToken = nix::fmt("%08x%08x", dist(rd), dist(rd));
+    }
+
     virtual ~Scheduler()
     {
         try {
             if (sshMaster) {
-                for (auto & file : std::array<std::string, 2>{rootPath, jobStderr}) {
-                    nix::Strings rmCmd = {"rm", "-f", file};
-                    auto cmd = sshMaster->startCommand(std::move(rmCmd));
-                    cmd->sshPid.wait();
-                }
-                if (ourSettings.collectGarbage.get()) {
-                    auto binDir = ourSettings.remoteNixBinDir.get();
-                    nix::Strings gcCmd = {
-                        (binDir != "" ? binDir + "/" : "") + "nix-store",
-                        "--gc",
-                        "--store",
-                        ourSettings.remoteStore.get()
-                    };
-                    auto cmd = sshMaster->startCommand(std::move(gcCmd));
-                    if (int rc = cmd->sshPid.wait()) {
-                        using namespace nix;
-                        printError("NSH Error: garbage collection failed: %d", rc);
-                    }
+                if (pilotConn) {
+                    /* The build is still running in the pilot job, which
+                     * outlives us. */
+                    auto pidPath = nix::shellEscape(rootPath + ".pid");
+                    nix::Strings killCmd = {"sh", "-c", nix::shellEscape(nix::fmt("kill $(cat %s)", pidPath))};
+                    sshMaster->startCommand(std::move(killCmd))->sshPid.wait();
+                    pilotConn.reset();
                 }
+                /* Removing the files of the job and collecting garbage are
+                 * left to a cleaner, so that the build finishes without
+                 * waiting for them. */
+                nodeUse.close();
+                CleanupQueue::enqueue({
+                    hostname,
+                    {rootPath, jobStderr, rootPath + ".ready", rootPath + ".fifo", rootPath + ".pid", getTransferDir()},
+                    ourSettings.collectGarbage.get(),
+                    currentCluster()});
             }
         } catch (std::exception & e) {
             using namespace nix;
@@ -59,7 +81,60 @@ public:
      * @return Hostname of the node assigned to the job. */
     std::string startBuild(nix::StorePath drvPath)
     {
-        submit(drvPath);
+        try {
+            submit(drvPath);
+        } catch (Interrupted &) {
+            throw;
+        } catch (std::exception & e) {
+            /* The scheduler may reject a job held for a node, e.g. one that
+             * has been drained, in which case any node will do. */
+            if (preferredHost.empty() || !jobId.empty())
+                throw;
+            using namespace nix;
+            printError("NSH Error: unable to submit the job for node '%s', submitting it for any node: %s", preferredHost, e.what());
+            preferredHost.clear();
+            affinityDeadline.reset();
+            submit(drvPath);
+        }
+        affinityDeadline.reset();
+        connect();
+        submitCalled = true;
+        return hostname;
+    }
+
+    /* Starts a build in a slot of a pilot job leased from the broker, instead
+     * of submitting a job for it. The build runs as long as the returned
+     * connection is open, and is waited for by waitForJobFinish().
+     * @param dir Directory on the node for the files of the build.
+     * @return Hostname of the node the pilot job runs on. */
+    std::string startPilotBuild(nix::StorePath drvPath, const std::string & pilotJob, const std::string & host, const std::string & dir);
+
+    /* Makes a submission waiting for its job to start give up by throwing
+     * Interrupted, may be called from another thread. */
+    void interrupt()
+    {
+        std::lock_guard lock(pollMutex);
+        interrupted = true;
+        pollWakeup.notify_all();
+    }
+
+    /* Tells waitForJobFinish() that the job script is about to exit, so that
+     * it polls quickly again, may be called from another thread. */
+    void notifyJobEnding()
+    {
+        std::lock_guard lock(pollMutex);
+        jobEnding = true;
+        pollWakeup.notify_all();
+    }
+
+    struct Interrupted : public std::runtime_error
+    {
+        explicit Interrupted() : std::runtime_error("job submission interrupted") {}
+    };
+
+private:
+    void connect()
+    {
         storeUri = "ssh-ng://" + hostname;
         {
             nix::Activity act(*nix::logger, nix::lvlTalkative, nix::actUnknown, nix::fmt("connecting to '%s'", storeUri));
@@ -69,9 +144,70 @@ public:
         // nix::SSHMaster does not permit assignment
         static auto ssh = sshStoreConfig->createSSHMaster(false);
         sshMaster = &ssh;
+        nodeUse = CleanupQueue::useNode(hostname);
+    }
 
-        submitCalled = true;
-        return hostname;
+public:
+
+    /* Sets the paths the job copies from the staging-store before building,
+     * must be called before startBuild(). */
+    void setStagedPaths(nix::StorePathSet paths)
+    {
+        stagedPaths = std::move(paths);
+    }
+
+    /* Makes the job prefer host, whose remote store holds most of its
+     * inputs, for the first affinity-wait seconds that it is pending. Must
+     * be called before startBuild(). */
+    void setPreferredHost(std::string host)
+    {
+        preferredHost = std::move(host);
+    }
+
+    /* Sets the resources to request for the job where the derivation does
+     * not set them, must be called before startBuild(). */
+    void setSizing(std::optional<JobSizing> jobSizing)
+    {
+        sizing = std::move(jobSizing);
+    }
+
+    /* @return Whether the job was submitted with resources from
+     * setSizing(). */
+    bool isAutoSized()
+    {
+        return autoSized;
+    }
+
+    /* Tells the job that all its inputs have been uploaded and that it can
+     * start building.
+     * @param staged Whether the staged paths have to be copied from the
+     * staging-store first. */
+    void signalInputsReady(bool staged)
+    {
+        if (!submitCalled) throw StartBuildNotCalled();
+        auto readyPath = nix::shellEscape(rootPath + ".ready");
+        auto fifoPath = nix::shellEscape(rootPath + ".fifo");
+        auto script = nix::fmt(
+            "echo %s%s > %s && if [ -p %s ]; then exec 3<>%s; echo >&3; fi",
+            readyToken, staged ? " staged" : "", readyPath, fifoPath, fifoPath);
+        nix::Strings cmd = {"sh", "-c", nix::shellEscape(script)};
+        auto conn = sshMaster->startCommand(std::move(cmd));
+        if (int rc = conn->sshPid.wait())
+            throw std::runtime_error(nix::fmt("signalling job %s failed with exit code %d", jobId, rc));
+    }
+
+    /* @return SSH connection to the node the job runs on. */
+    nix::SSHMaster & getSSHMaster()
+    {
+        if (!submitCalled) throw StartBuildNotCalled();
+        return *sshMaster;
+    }
+
+    /* @return Scratch directory on the node for store path transfers, which
+     * is removed when the Scheduler is destroyed. */
+    std::string getTransferDir()
+    {
+        return rootPath + ".transfer";
     }
 
     /* Submits a derivation for building. */
@@ -81,36 +217,213 @@ public:
      * @return Exit code of job, or -1 if abnormal termination (e.g. cancelled). */
     virtual int waitForJobFinish() = 0;
 
+    struct JobStatus
+    {
+        bool live;
+        /* Exit code once the job is no longer live, or -1 if abnormal termination. */
+        int exitCode;
+        std::string state;
+    };
+
+    /* Queries the status of several jobs with as few scheduler calls as
+     * possible. Jobs unknown to the scheduler are left out of the result. */
+    virtual std::map<std::string, JobStatus> queryJobs(const std::set<std::string> & jobIds) = 0;
+
+    /* Load of the queue of the scheduler, for routing builds between
+     * clusters. */
+    struct QueueEstimate
+    {
+        /* Number of jobs waiting in the queue. */
+        uint64_t pendingJobs = 0;
+        /* Time after which a job submitted now with the default job
+         * parameters is expected to start, if the scheduler predicts it. */
+        std::optional<std::chrono::seconds> startDelay;
+    };
+
+    /* Queries the load of the queue, without submitting anything. */
+    virtual QueueEstimate estimateQueue() = 0;
+
+    /* Submits several jobs as a single job array. Every task is a job
+     * description passed to submitViaBroker() by submit() of the same
+     * backend, and all of them were given the same key.
+     * @return Job id of every array task, in the order of tasks. */
+    virtual std::vector<std::string> submitArray(const std::vector<std::string> & tasks)
+    {
+        throw std::runtime_error(nix::fmt("job arrays are not supported by the %s scheduler", ourSettings.jobScheduler.get()));
+    }
+
+    /* Cancels a job submitted by submitArray(). */
+    virtual void cancelJob(const std::string & jobId) {}
+
+    /* Queries the accounting of the scheduler for the resources used by the
+     * finished job.
+     * @return Usage, or std::nullopt if the scheduler does not report it. */
+    virtual std::optional<JobUsage> queryUsage()
+    {
+        return std::nullopt;
+    }
+
+    /* Submits a pilot job running script with the default job parameters,
+     * and waits until it has started. The pilot job is cancelled when the
+     * Scheduler is destroyed.
+     * @return Directory on the node for the files of the builds started in
+     * the pilot job. */
+    virtual std::string submitPilot(const std::string & script) = 0;
+
+    /* @return Command prefix that runs a command within the allocation of the
+     * pilot job pilotJob, as a step of its own. */
+    virtual std::string pilotLauncher(const std::string & pilotJob) = 0;
+
     std::string getJobId()
     {
+        if (jobId.empty() && !pilotJobId.empty())
+            return pilotJobId + " (pilot)";
         return jobId;
     }
 
-    std::shared_ptr<std::istream> getStderrStream()
+    std::string getHostname()
+    {
+        return hostname;
+    }
+
+    /* @return Non-blocking descriptor streaming the stderr of the job. */
+    int getStderrFd()
     {
         if (!submitCalled) throw StartBuildNotCalled();
         if (!cmdOutInit) {
             nix::Strings tailCmd = {"tail", "-f", jobStderr};
             cmdConn = sshMaster->startCommand(std::move(tailCmd));
-            auto cmdOutFd = cmdConn->out.release();
-            int flags = fcntl(cmdOutFd, F_GETFL, 0);
-            fcntl(cmdOutFd, F_SETFL, flags | O_NONBLOCK);
-            cmdOutBuf = std::make_unique<__gnu_cxx::stdio_filebuf<char>>(cmdOutFd, std::ios::in);
+            cmdOut = std::move(cmdConn->out);
+            int flags = fcntl(cmdOut.get(), F_GETFL, 0);
+            fcntl(cmdOut.get(), F_SETFL, flags | O_NONBLOCK);
             cmdOutInit = true;
         }
-        return std::make_shared<std::istream>(cmdOutBuf.get());
+        return cmdOut.get();
     }
 
 protected:
+    /* Sleeps before querying the state of the job again, see JobPoll. Wakes
+     * up early when notifyJobEnding() is called.
+     * @param expected Time at which the scheduler expects the awaited state
+     * change.
+     * @param deadline Time by which the state change happens at the latest.
+     * @throws Interrupted if interrupt() has been called. */
+    void pollSleep(
+        JobPoll & poll,
+        std::optional<JobPoll::Clock::time_point> expected = std::nullopt,
+        std::optional<JobPoll::Clock::time_point> deadline = std::nullopt)
+    {
+        if (affinityDeadline && (!expected || *affinityDeadline < *expected))
+            expected = affinityDeadline;
+        std::unique_lock lock(pollMutex);
+        if (interrupted) throw Interrupted();
+        if (jobEnding) {
+            jobEnding = false;
+            poll.expectSoon();
+        }
+        pollWakeup.wait_for(lock, poll.nextInterval(expected, deadline), [&]() { return interrupted || jobEnding; });
+        if (interrupted) throw Interrupted();
+    }
+
+    /* To be called by submit() once it has submitted the job to
+     * preferredHost only, to start the affinity-wait. */
+    void heldForPreferredHost()
+    {
+        affinityDeadline = JobPoll::Clock::now() + std::chrono::seconds(ourSettings.affinityWait.get());
+    }
+
+    /* To be called while the job is pending, lets it run on any node once
+     * the affinity-wait has passed. */
+    void checkAffinity()
+    {
+        if (affinityDeadline && JobPoll::Clock::now() >= *affinityDeadline) {
+            affinityDeadline.reset();
+            using namespace nix;
+            printInfo("job %s is still pending, letting it run on any node instead of '%s'", jobId, preferredHost);
+            releasePreferredHost();
+        }
+    }
+
+    /* Lets the pending job, submitted to preferredHost only, run on any
+     * node. */
+    virtual void releasePreferredHost() {}
+
+    /* Waits for a build started by startPilotBuild().
+     * @return Exit code as for waitForJobFinish(), or std::nullopt if the
+     * build runs in a job of its own. */
+    std::optional<int> waitForPilotBuild()
+    {
+        if (!pilotConn)
+            return std::nullopt;
+        int status = pilotConn->sshPid.wait();
+        pilotConn.reset();
+        /* 255 is returned by ssh itself when the connection failed. */
+        if (!WIFEXITED(status) || WEXITSTATUS(status) == 255)
+            return -1;
+        return WEXITSTATUS(status);
+    }
+
+    /* Submits the job through the submission coalescer of the broker, if
+     * submit-coalesce-window is set. Jobs with the same key must only differ
+     * in their script, so that they can share a job array.
+     * @return Id of the array task running the job, or std::nullopt if the
+     * job has to be submitted directly. */
+    std::optional<std::string> submitViaBroker(const std::string & key, const std::string & task)
+    {
+        if (ourSettings.brokerSocket.get() == "" || !ourSettings.submitCoalesceWindow.get())
+            return std::nullopt;
+        return submitJobViaBroker(ourSettings.brokerSocket.get(), ourSettings.jobScheduler.get(), key, task);
+    }
+
+    /* Waits for the job to finish through the shared poller of the broker.
+     * @return Exit code as for waitForJobFinish(), or std::nullopt if no
+     * broker is available and the job has to be polled directly. */
+    std::optional<int> waitForJobFinishViaBroker()
+    {
+        if (ourSettings.brokerSocket.get() == "")
+            return std::nullopt;
+        auto result = waitForJobViaBroker(ourSettings.brokerSocket.get(), ourSettings.jobScheduler.get(), jobId);
+        if (!result)
+            return std::nullopt;
+        auto [rc, state] = *result;
+        if (rc == -1) {
+            using namespace nix;
+            printError("NSH Error: unexpected job state %s", state);
+        }
+        return rc;
+    }
+
     std::string jobId;
     std::string hostname;
     std::string storeUri;
     std::string jobStderr;
     std::unique_ptr<nix::SSHMaster::Connection> cmdConn;
-    nix::SSHMaster *sshMaster;
+    nix::SSHMaster *sshMaster = nullptr;
     std::string rootPath;
+    std::string readyToken;
+    nix::StorePathSet stagedPaths;
+    std::string pilotJobId;
+    std::unique_ptr<nix::SSHMaster::Connection> pilotConn;
+    /* Lock keeping cleaners from collecting garbage on the node. */
+    nix::AutoCloseFD nodeUse;
+    std::mutex pollMutex;
+    std::condition_variable pollWakeup;
+    bool interrupted = false;
+    bool jobEnding = false;
+    std::string preferredHost;
+    /* End of the affinity-wait, while the pending job is held for
+     * preferredHost. */
+    std::optional<JobPoll::Clock::time_point> affinityDeadline;
+    std::optional<JobSizing> sizing;
+    /* Whether submit() applied some of sizing. */
+    bool autoSized = false;
+    /* End of the time limit of the running job, if the scheduler has one. */
+    std::optional<JobPoll::Clock::time_point> expectedEnd;
     std::atomic<bool> cmdOutInit = false;
-    std::unique_ptr<__gnu_cxx::stdio_filebuf<char>> cmdOutBuf;
+    nix::AutoCloseFD cmdOut;
 
     std::atomic<bool> submitCalled = false;
 };
+
+/* Creates the scheduler backend selected by the job-scheduler setting. */
+std::unique_ptr<Scheduler> makeScheduler();
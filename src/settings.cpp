@@ -38,6 +38,28 @@ void loadConfFile(nix::AbstractConfig & config)
     }
 }
 
+void loadClusterConfFile(nix::AbstractConfig & config, const std::string & name)
+{
+    auto fileName = "/nsh-" + name + ".conf";
+    auto applyConfigFile = [&](const nix::Path & path) {
+        try {
+            std::string contents =  nix::readFile(path);
+            config.applyConfig(contents, path);
+        } catch (nix::SystemError &) {
+        }
+    };
+
+    /* Every cluster has a broker of its own, if any. */
+    config.set("broker-socket", "");
+
+    applyConfigFile(nix::settings.nixConfDir + fileName);
+
+    auto files = ourSettings.userConfFiles;
+    for (auto file = files.rbegin(); file != files.rend(); file++) {
+        applyConfigFile(nix::dirOf(*file) + fileName);
+    }
+}
+
 std::vector<nix::Path> getUserConfigFiles()
 {
     // Use the paths specified in NSH_USER_CONF_FILES if it has been defined
@@ -16,7 +16,63 @@ struct Settings : public nix::Config
         this,
         "slurm",
         "job-scheduler",
-        "Which job scheduler to use, available choices are 'slurm', 'slurm-native', and 'pbs'."
+        "Which job scheduler to use, available choices are 'slurm', 'slurm-native', 'pbs', and 'local'."
+    };
+
+    nix::Setting<nix::Strings> clusters {
+        this,
+        {},
+        "clusters",
+        "Names of the clusters to route builds to. The settings of a cluster are read from 'nsh-<name>.conf' next to every 'nsh.conf', on top of the other settings, and every build is submitted to the cluster whose queue is expected to start it first. Leave empty to submit all builds with the settings of 'nsh.conf'."
+    };
+
+    nix::Setting<unsigned int> clusterEstimateTtl {
+        this,
+        30,
+        "cluster-estimate-ttl",
+        "Number of seconds for which the queue depth and predicted start time of a cluster are reused by later builds before the cluster is queried again."
+    };
+
+    nix::Setting<unsigned int> pendingJobSeconds {
+        this,
+        60,
+        "pending-job-seconds",
+        "Number of seconds every pending job is assumed to add to the wait of a new job on a cluster whose scheduler does not predict start times."
+    };
+
+    nix::Setting<unsigned int> maxJobsPerUser {
+        this,
+        0,
+        "max-jobs-per-user",
+        "Maximum number of outstanding jobs that builds of the same user submit to a cluster, further builds are postponed. Set to 0 for no limit."
+    };
+
+    nix::Setting<unsigned int> maxJobsPerCluster {
+        this,
+        0,
+        "max-jobs-per-cluster",
+        "Maximum number of outstanding jobs that builds submit to a cluster, further builds are postponed. Set to 0 for no limit."
+    };
+
+    nix::Setting<unsigned int> maxQueueWait {
+        this,
+        0,
+        "max-queue-wait",
+        "Number of seconds beyond which the expected wait for a new job to start makes builds be postponed instead of submitted. Set to 0 to submit builds regardless of the wait."
+    };
+
+    nix::Setting<unsigned int> maxPostponeTime {
+        this,
+        3600,
+        "max-postpone-time",
+        "Number of seconds after which a build that max-queue-wait keeps postponing is submitted anyway. Set to 0 to postpone it for as long as the expected wait stays too long."
+    };
+
+    nix::Setting<bool> admissionFallback {
+        this,
+        false,
+        "admission-fallback",
+        "Whether builds that are not admitted because of max-jobs-per-user, max-jobs-per-cluster or max-queue-wait are handed to the normal build hook, instead of being postponed."
     };
 
     nix::Setting <std::string> system {
@@ -68,6 +124,181 @@ struct Settings : public nix::Config
         "Run nix store gc on the remote-store after each job completes."
     };
 
+    nix::Setting<uint64_t> remoteStoreBudget {
+        this,
+        0,
+        "remote-store-budget",
+        "Size in bytes up to which collect-garbage keeps the store paths most recently used by builds on the node, instead of deleting all of them. Set to 0 to collect all garbage."
+    };
+
+    nix::Setting<unsigned int> affinityWait {
+        this,
+        0,
+        "affinity-wait",
+        "Number of seconds for which a job is held for the node whose remote store misses the fewest bytes of its inputs, before it may run on any node. Set to 0 to let the scheduler pick any node right away."
+    };
+
+    nix::Setting<unsigned int> affinityTtl {
+        this,
+        86400,
+        "affinity-ttl",
+        "Number of seconds after which a store path recorded as present on a node is forgotten, unless a build on the node used it again, so that nodes wiped outside NSH stop attracting builds."
+    };
+
+    nix::Setting<bool> autoSizing {
+        this,
+        false,
+        "auto-sizing",
+        "Whether to request the CPUs, memory and time limit of jobs after the resources used by earlier builds of the same package, as reported by the accounting of the scheduler, unless the derivation sets them."
+    };
+
+    nix::Setting<unsigned int> autoSizingHeadroom {
+        this,
+        50,
+        "auto-sizing-headroom",
+        "Percentage added to the CPUs, peak memory and elapsed time of earlier builds when auto-sizing jobs."
+    };
+
+    nix::Setting<bool> stagingOutputs {
+        this,
+        false,
+        "staging-outputs",
+        "Have the job copy the outputs of the build to the staging-store, and copy them from there instead of from the build node."
+    };
+
+    nix::Setting<unsigned int> transferJobs {
+        this,
+        1,
+        "transfer-jobs",
+        "Number of SSH connections to the build node over which store paths are copied concurrently, in both directions."
+    };
+
+    nix::Setting<std::string> transferCompression {
+        this,
+        "none",
+        "transfer-compression",
+        "Compression applied to the store paths copied between NSH and the build node, either 'none' or 'zstd'."
+    };
+
+    nix::Setting<int> transferCompressionLevel {
+        this,
+        3,
+        "transfer-compression-level",
+        "zstd compression level used when transfer-compression is 'zstd'."
+    };
+
+    nix::Setting<unsigned int> transferCompressionThreads {
+        this,
+        0,
+        "transfer-compression-threads",
+        "Number of store paths compressed or decompressed concurrently by NSH when transfer-compression is 'zstd'. 0 means the number of CPUs."
+    };
+
+    nix::Setting<unsigned int> validityCacheTtl {
+        this,
+        0,
+        "validity-cache-ttl",
+        "Number of seconds for which store paths found or made valid in the remote store of a node are assumed to stay valid, so that they are not queried again by later builds on the same node. Only safe if nothing but NSH removes paths from the remote stores. 0 disables the cache."
+    };
+
+    nix::Setting<std::string> stagingStore {
+        this,
+        "",
+        "staging-store",
+        "URL of a Nix store on the cluster side to which the inputs of a build are uploaded while its job is waiting in the queue. The job then copies them from this store before building. If empty, inputs are uploaded directly to the build node once the job has started."
+    };
+
+    nix::Setting<std::string> remoteStagingStore {
+        this,
+        "",
+        "remote-staging-store",
+        "URL under which the build nodes access the staging-store. Defaults to the value of staging-store."
+    };
+
+    nix::Setting<std::string> brokerSocket {
+        this,
+        "",
+        "broker-socket",
+        "Path to the Unix domain socket of the NSH broker daemon started with 'nsh daemon'. If set and a broker is listening, builds are handed to the broker instead of being processed by a freshly started hook."
+    };
+
+    nix::Setting<unsigned int> brokerSshPersist {
+        this,
+        600,
+        "broker-ssh-persist",
+        "Number of seconds that SSH master connections opened by builds handled by the broker are kept alive after their last use, so that they can be reused by later builds. Set to 0 to disable connection sharing."
+    };
+
+    nix::Setting<unsigned int> brokerPollInterval {
+        this,
+        1000,
+        "broker-poll-interval",
+        "Interval in milliseconds at which the broker queries the state of all outstanding jobs in a single scheduler call."
+    };
+
+    nix::Setting<unsigned int> pollMaxInterval {
+        this,
+        60,
+        "poll-max-interval",
+        "Maximum number of seconds between two queries of the state of a job, used while the scheduler expects the job to start or to reach its time limit much later."
+    };
+
+    nix::Setting<std::string> metricsTextfile {
+        this,
+        "",
+        "metrics-textfile",
+        "Path of a file to which the phase timings, transfers and job state queries of all builds are added, in the Prometheus text format read by the textfile collector of the node exporter. Leave empty to disable metrics."
+    };
+
+    nix::Setting<std::string> traceDir {
+        this,
+        "",
+        "trace-dir",
+        "Directory to which the spans of the phases of every build are appended, in a trace file per day that loads in Perfetto and chrome://tracing. Leave empty to disable tracing."
+    };
+
+    nix::Setting<unsigned int> submitCoalesceWindow {
+        this,
+        0,
+        "submit-coalesce-window",
+        "Time in milliseconds during which the broker gathers job submissions with identical job parameters, to submit them as a single job array. Set to 0 to submit every job on its own."
+    };
+
+    nix::Setting<unsigned int> pilotPoolSize {
+        this,
+        0,
+        "pilot-pool-size",
+        "Number of pilot jobs the broker keeps running, in which builds are started directly instead of waiting in the queue with a job of their own. Set to 0 to disable the pilot pool."
+    };
+
+    nix::Setting<unsigned int> pilotSlots {
+        this,
+        1,
+        "pilot-slots",
+        "Number of builds that run concurrently in one pilot job."
+    };
+
+    nix::Setting<unsigned int> pilotSlotCpus {
+        this,
+        0,
+        "pilot-slot-cpus",
+        "Number of CPUs every build in a Slurm pilot job is limited to. Set to 0 to let the builds share all CPUs of the pilot job."
+    };
+
+    nix::Setting<unsigned int> pilotSlotMemory {
+        this,
+        0,
+        "pilot-slot-memory",
+        "Memory in MiB every build in a Slurm pilot job is limited to. Set to 0 to let the builds share all memory of the pilot job."
+    };
+
+    nix::Setting<unsigned int> pilotIdleTimeout {
+        this,
+        300,
+        "pilot-idle-timeout",
+        "Number of seconds after which a pilot job that has not run any build is cancelled."
+    };
+
     nix::Setting<std::string> slurmConf {
         this,
         "",
@@ -96,6 +327,13 @@ struct Settings : public nix::Config
         "Port to use for the Slurm REST API endpoint."
     };
 
+    nix::Setting<std::string> slurmApiSocket {
+        this,
+        "",
+        "slurm-api-socket",
+        "Path to the Unix domain socket slurmrestd listens on. If set, it is used instead of slurm-api-host and slurm-api-port."
+    };
+
     nix::Setting<std::string> slurmJwtToken {
         this,
         "",
@@ -123,10 +361,42 @@ struct Settings : public nix::Config
         "pbs-port",
         "Port that the PBS server is listening on."
     };
+
+    nix::Setting<std::string> localStateDir {
+        this,
+        "",
+        "local-state-dir",
+        "Where the local scheduler stores the files of its jobs. It must be reachable at the same path through local-host."
+    };
+
+    nix::Setting<unsigned int> localSlots {
+        this,
+        0,
+        "local-slots",
+        "Number of jobs the local scheduler runs at the same time, the others wait for a slot. Set to 0 to use the number of CPUs."
+    };
+
+    nix::Setting<unsigned int> localQueueDelay {
+        this,
+        0,
+        "local-queue-delay",
+        "Time in milliseconds that every job of the local scheduler waits before taking a slot, to imitate the queueing delay of a cluster."
+    };
+
+    nix::Setting<std::string> localHost {
+        this,
+        "localhost",
+        "local-host",
+        "Hostname through which the local scheduler connects to this machine over SSH."
+    };
 };
 
 void loadConfFile(nix::AbstractConfig & config);
 
+/* Applies the settings of the cluster name, from the 'nsh-<name>.conf' files
+ * next to the 'nsh.conf' files, to config. */
+void loadClusterConfFile(nix::AbstractConfig & config, const std::string & name);
+
 std::vector<nix::Path> getUserConfigFiles();
 
 extern Settings ourSettings;
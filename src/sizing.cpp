@@ -0,0 +1,138 @@
+#include "sizing.hh"
+#include "state.hh"
+#include "settings.hh"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
+
+#include <nix/store/derivations.hh>
+#include <nix/store/names.hh>
+#include <nix/store/pathlocks.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/fmt.hh>
+
+/* Number of records kept per group of builds. */
+#define HISTORY_RECORDS 8
+
+/* Lower bounds of the sizing, so that the time spent waiting for the inputs
+ * and a small variation in memory do not kill the job. */
+#define MIN_MEMORY_MB 256
+#define MIN_TIME_LIMIT_MINUTES 10
+
+UsageHistory::UsageHistory(nix::Store & store, const nix::StorePath & drvPath)
+    : path(clusterStateFile("usage-history"))
+    , drvHash(drvPath.hashPart())
+{
+    auto drv = store.readDerivation(drvPath);
+    auto pname = drv.env.find("pname");
+    std::string name(drvPath.name());
+    key = pname != drv.env.end() ? pname->second : nix::DrvName(name.substr(0, name.size() - 4)).name;
+    std::replace_if(key.begin(), key.end(), [](unsigned char c) { return std::isspace(c); }, '_');
+}
+
+bool UsageHistory::enabled()
+{
+    return !currentLoadDir().empty() && ourSettings.autoSizing.get();
+}
+
+/* Reads the records, as '<key> <drv hash> <time> <CPU seconds> <elapsed
+ * seconds> <max RSS> <allocated CPUs>' lines from the oldest to the most
+ * recent. The allocated CPUs are missing from older records. */
+template<typename Record>
+static std::vector<Record> readRecords(const std::string & path)
+{
+    std::vector<Record> records;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        Record record;
+        if (!(fields >> record.key >> record.drvHash >> record.time
+            >> record.usage.cpuSeconds >> record.usage.elapsedSeconds >> record.usage.maxRss))
+            continue;
+        if (!(fields >> record.usage.allocatedCpus))
+            record.usage.allocatedCpus = 0;
+        records.push_back(record);
+    }
+    return records;
+}
+
+template<typename F>
+void UsageHistory::update(F && f)
+{
+    auto lock = nix::openLockFile(path + ".lock", true);
+    nix::lockFile(lock.get(), nix::ltWrite, true);
+    auto records = readRecords<Record>(path);
+    f(records);
+    std::string contents;
+    for (auto & record : records)
+        contents += nix::fmt("%s %s %d %f %f %d %d\n", record.key, record.drvHash, record.time,
+            record.usage.cpuSeconds, record.usage.elapsedSeconds, record.usage.maxRss, record.usage.allocatedCpus);
+    auto tmpPath = nix::fmt("%s.tmp-%d", path, getpid());
+    nix::writeFile(tmpPath, contents, 0600);
+    if (rename(tmpPath.c_str(), path.c_str()) == -1)
+        throw nix::SysError("renaming '%s' to '%s'", tmpPath, path);
+}
+
+std::optional<JobSizing> UsageHistory::recommend()
+{
+    /* The file is replaced atomically, so it is read without the lock. */
+    std::vector<Record> group, same;
+    for (auto & record : readRecords<Record>(path))
+        if (record.key == key) {
+            group.push_back(record);
+            if (record.drvHash == drvHash)
+                same.push_back(record);
+        }
+    auto & records = same.empty() ? group : same;
+    if (records.empty())
+        return std::nullopt;
+
+    double cpus = 0, elapsed = 0;
+    uint64_t maxRss = 0;
+    unsigned int allocatedCpus = 1;
+    for (auto & record : records) {
+        cpus = std::max(cpus, record.usage.cpuSeconds / std::max(record.usage.elapsedSeconds, 1.0));
+        elapsed = std::max(elapsed, record.usage.elapsedSeconds);
+        maxRss = std::max(maxRss, record.usage.maxRss);
+        allocatedCpus = std::max(allocatedCpus, record.usage.allocatedCpus);
+    }
+    /* Never fewer CPUs than the jobs of the records had, as their elapsed
+     * times only bound the time limit with at least as many. */
+    double factor = 1 + ourSettings.autoSizingHeadroom.get() / 100.0;
+    return JobSizing{
+        std::max<unsigned int>(allocatedCpus, std::ceil(cpus * factor)),
+        std::max<uint64_t>(MIN_MEMORY_MB, std::ceil(maxRss * factor / (1024 * 1024))),
+        std::max<unsigned int>(MIN_TIME_LIMIT_MINUTES, std::ceil(elapsed * factor / 60)),
+    };
+}
+
+void UsageHistory::record(const JobUsage & usage)
+{
+    update([&](std::vector<Record> & records) {
+        records.push_back({key, drvHash, time(nullptr), usage});
+        /* Keep the most recent records of the group. */
+        size_t kept = 0;
+        for (auto i = records.rbegin(); i != records.rend(); ++i)
+            if (i->key == key && ++kept > HISTORY_RECORDS)
+                i->key.clear();
+        std::erase_if(records, [](auto & record) { return record.key.empty(); });
+    });
+}
+
+void UsageHistory::forget()
+{
+    update([&](std::vector<Record> & records) {
+        std::erase_if(records, [&](auto & record) { return record.key == key; });
+    });
+}
+
+std::string showJobSizing(const JobSizing & sizing)
+{
+    return nix::fmt("%d CPUs, %d MB of memory and %d minutes", sizing.cpus, sizing.memoryMB, sizing.timeLimitMinutes);
+}
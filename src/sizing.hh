@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include <nix/store/path.hh>
+#include <nix/store/store-api.hh>
+
+/* Resources used by a finished job, as reported by the accounting of the
+ * scheduler. */
+struct JobUsage
+{
+    double cpuSeconds = 0;
+    double elapsedSeconds = 0;
+    /* Peak resident set size, in bytes. */
+    uint64_t maxRss = 0;
+    /* CPUs allocated to the job, 0 if unknown. */
+    unsigned int allocatedCpus = 0;
+};
+
+/* Resources to request for a job. */
+struct JobSizing
+{
+    unsigned int cpus;
+    uint64_t memoryMB;
+    unsigned int timeLimitMinutes;
+};
+
+/* History of the resources used by the jobs of earlier builds, with
+ * auto-sizing set, kept in the current-load directory. Builds are grouped by
+ * the pname of their derivation, or its name without the version, and the
+ * records of the same derivation are preferred over the others. Jobs are
+ * sized after the peaks of the recent records plus auto-sizing-headroom, but
+ * get at least as many CPUs as the jobs of the records, since a build that
+ * had fewer CPUs could not show that it would use more, and took longer. */
+class UsageHistory
+{
+public:
+    UsageHistory(nix::Store & store, const nix::StorePath & drvPath);
+
+    /* Whether auto-sizing is set. */
+    static bool enabled();
+
+    /* @return Resources to request for the derivation, or std::nullopt if
+     * none of its builds has been recorded. */
+    std::optional<JobSizing> recommend();
+
+    /* Records the usage of a successful build of the derivation. */
+    void record(const JobUsage & usage);
+
+    /* Forgets the builds of the derivation, after a job sized from them
+     * failed, which may be because it ran out of memory or time. */
+    void forget();
+
+private:
+    std::string path;
+    std::string key;
+    std::string drvHash;
+
+    struct Record
+    {
+        std::string key;
+        std::string drvHash;
+        time_t time;
+        JobUsage usage;
+    };
+
+    /* Updates the records under the lock. */
+    template<typename F>
+    void update(F && f);
+};
+
+/* @return Sizing for display. */
+std::string showJobSizing(const JobSizing & sizing);
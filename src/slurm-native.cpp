@@ -6,11 +6,13 @@
 using namespace nlohmann;
 
 #include <thread>
+#include <optional>
 using namespace std::chrono_literals;
 
 #include <nix/store/store-open.hh>
 #include <nix/store/store-api.hh>
 #include <nix/store/derivations.hh>
+#include <nix/util/processes.hh>
 
 #include <slurm/slurm.h>
 
@@ -19,11 +21,36 @@ SlurmNative::SlurmNative()
     slurm_init(ourSettings.slurmConf.get() != "" ? ourSettings.slurmConf.get().c_str() : nullptr);
 }
 
-void SlurmNative::submit(nix::StorePath drvPath)
+static void applyConstraints(job_desc_msg_t & job_desc_msg, const json & constraints)
 {
-    rootPath = ourSettings.slurmStateDir.get() + "/job-" + std::string(drvPath.to_string()) + ".root";
-    jobStderr = ourSettings.slurmStateDir.get() + "/job-" + std::string(drvPath.to_string()) + ".stderr";
+    for (auto & [key, value] : constraints.items()) {
+        if (key == "cpus") {
+            if (value > UINT16_MAX)
+                throw SlurmNativeConstraintError(nix::fmt("constraint %s is too large for datatype", key));
+            job_desc_msg.cpus_per_task = static_cast<uint16_t>(value);
+        } else if (key == "memPerNode") {
+            if (value > UINT64_MAX)
+                throw SlurmNativeConstraintError(nix::fmt("constraint %s is too large for datatype", key));
+            job_desc_msg.pn_min_memory = static_cast<uint64_t>(value);
+        } else if (key == "memPerCPU") {
+            if (value > UINT64_MAX)
+                throw SlurmNativeConstraintError(nix::fmt("constraint %s is too large for datatype", key));
+            job_desc_msg.pn_min_memory = static_cast<uint64_t>(value) | MEM_PER_CPU;
+        } else if (key == "timeLimit") {
+            if (value > UINT32_MAX)
+                throw SlurmNativeConstraintError(nix::fmt("constraint %s is too large for datatype", key));
+            job_desc_msg.time_limit = static_cast<uint32_t>(value);
+        } else {
+            throw SlurmNativeConstraintError(nix::fmt("unknown constraint %s", key));
+        }
+    }
+}
 
+/* Submits a batch job running script with the given constraints, on the
+ * nodes in reqNodes if set.
+ * @return Id of the submitted job. */
+static uint32_t submitBatchJob(std::string script, std::string stdErr, const json & constraints, const char * arrayIndices = nullptr, std::string reqNodes = "")
+{
     job_desc_msg_t job_desc_msg;
     slurm_init_job_desc_msg(&job_desc_msg);
 
@@ -32,38 +59,21 @@ void SlurmNative::submit(nix::StorePath drvPath)
     job_desc_msg.environment = vars;
     job_desc_msg.env_size = 1;
 
-    auto script = genScript(drvPath, rootPath);
     job_desc_msg.script = script.data();
 
     job_desc_msg.work_dir = ourSettings.slurmStateDir.get().data();
 
-    job_desc_msg.std_err = jobStderr.data();
+    job_desc_msg.std_err = stdErr.data();
 
-    auto store = nix::openStore();
-    auto drv = store->readDerivation(drvPath);
-    if (drv.env.count("slurmNativeConstraints") == 1) {
-        json extraParams = json::parse(drv.env["slurmNativeConstraints"]);
-        for (auto & [key, value] : extraParams.items()) {
-            if (key == "cpus") {
-                if (value > UINT16_MAX)
-                    throw SlurmNativeConstraintError(nix::fmt("constraint %s is too large for datatype", key));
-                job_desc_msg.cpus_per_task = static_cast<uint16_t>(value);
-            } else if (key == "memPerNode") {
-                if (value > UINT64_MAX)
-                    throw SlurmNativeConstraintError(nix::fmt("constraint %s is too large for datatype", key));
-                job_desc_msg.pn_min_memory = static_cast<uint64_t>(value);
-            } else if (key == "memPerCPU") {
-                if (value > UINT64_MAX)
-                    throw SlurmNativeConstraintError(nix::fmt("constraint %s is too large for datatype", key));
-                job_desc_msg.pn_min_memory = static_cast<uint64_t>(value) | MEM_PER_CPU;
-            } else {
-                throw SlurmNativeConstraintError(nix::fmt("unknown constraint %s", key));
-            }
-        }
-    }
+    if (arrayIndices)
+        job_desc_msg.array_inx = const_cast<char *>(arrayIndices);
+
+    if (reqNodes != "")
+        job_desc_msg.req_nodes = reqNodes.data();
+
+    applyConstraints(job_desc_msg, constraints);
 
     submit_response_msg_t *resp;
-    blockSignals();
     if (slurm_submit_batch_job(&job_desc_msg, &resp)) {
         slurm_free_submit_response_response_msg(resp);
         throw SlurmNativeError("slurm_submit_batch_job");
@@ -72,30 +82,165 @@ void SlurmNative::submit(nix::StorePath drvPath)
         slurm_free_submit_response_response_msg(resp);
         throw SlurmNativeError(slurm_strerror(errorCode));
     }
-    nativeJobId = resp->step_id.job_id;
-    jobId = std::to_string(nativeJobId);
+    uint32_t jobId = resp->step_id.job_id;
     slurm_free_submit_response_response_msg(resp);
-    unblockSignals();
+    return jobId;
+}
 
+void SlurmNative::submit(nix::StorePath drvPath)
+{
+    /* The files of every job have names of their own, so that a later job
+     * building the same derivation does not lose them to the cleanup of an
+     * earlier one. */
+    auto jobFiles = ourSettings.slurmStateDir.get() + "/job-" + std::string(drvPath.to_string()) + "-" + readyToken;
+    rootPath = jobFiles + ".root";
+    jobStderr = jobFiles + ".stderr";
+
+    auto script = genScript(drvPath, rootPath, readyToken, stagedPaths);
+
+    json constraints = json::object();
+    auto store = nix::openStore();
+    auto drv = store->readDerivation(drvPath);
+    if (drv.env.count("slurmNativeConstraints") == 1)
+        constraints = json::parse(drv.env["slurmNativeConstraints"]);
+
+    /* Constraints of the derivation take precedence over the auto-sizing. */
+    if (sizing) {
+        if (!constraints.contains("cpus")) {
+            constraints["cpus"] = sizing->cpus;
+            autoSized = true;
+        }
+        if (!constraints.contains("memPerNode") && !constraints.contains("memPerCPU")) {
+            constraints["memPerNode"] = sizing->memoryMB;
+            autoSized = true;
+        }
+        if (!constraints.contains("timeLimit")) {
+            constraints["timeLimit"] = sizing->timeLimitMinutes;
+            autoSized = true;
+        }
+    }
+
+    /* Jobs with the same constraints can share a job array. */
+    json task = {{"script", script}, {"constraints", constraints}};
+
+    /* Jobs held for a node are submitted on their own. */
+    bool held = preferredHost != "";
+    std::optional<uint32_t> arrayJobId, arrayTaskId;
+    {
+        SignalsBlocked blocked;
+        if (auto id = held ? std::optional<std::string>() : submitViaBroker(constraints.dump(), task.dump())) {
+            jobId = *id;
+            auto sep = jobId.find('_');
+            arrayJobId = std::stoul(jobId.substr(0, sep));
+            arrayTaskId = std::stoul(jobId.substr(sep + 1));
+            jobStderr = ourSettings.slurmStateDir.get() + "/job-array-" + jobId + ".stderr";
+        } else {
+            nativeJobId = submitBatchJob(script, jobStderr, constraints, nullptr, preferredHost);
+            jobId = std::to_string(nativeJobId);
+        }
+    }
+    if (held)
+        heldForPreferredHost();
+
+    waitForBatchHost(arrayJobId, arrayTaskId);
+}
+
+void SlurmNative::waitForBatchHost(std::optional<uint32_t> arrayJobId, std::optional<uint32_t> arrayTaskId)
+{
     bool foundBatchHost = false;
-    auto sleepTime = 50ms;
+    JobPoll poll(1s);
     while (!foundBatchHost) {
         job_info_msg_t *resp;
-        if (slurm_load_job(&resp, nativeJobId, 0) || resp->record_count != 1) {
+        if (slurm_load_job(&resp, arrayJobId ? *arrayJobId : nativeJobId, 0) || (!arrayJobId && resp->record_count != 1)) {
             slurm_free_job_info_msg(resp);
             throw SlurmNativeError("slurm_load_job");
-        } else if (resp->job_array->batch_host) {
-            hostname = resp->job_array->batch_host;
-            slurm_free_job_info_msg(resp);
-            break;
-        } else {
-            slurm_free_job_info_msg(resp);
-            std::this_thread::sleep_for(sleepTime);
-            if (sleepTime < 1s) sleepTime *= 2;
+        }
+        poll.queried();
+
+        /* Pending tasks of an array share a single record, a task that
+         * started has a record and job id of its own. */
+        slurm_job_info_t *job = nullptr;
+        for (uint32_t i = 0; i < resp->record_count; i++) {
+            auto & record = resp->job_array[i];
+            if (!arrayJobId || record.array_task_id == *arrayTaskId) {
+                job = &record;
+                break;
+            } else if (!job && record.array_task_id == NO_VAL)
+                job = &record;
+        }
+
+        /* The start time of a pending job is the scheduler's estimate. */
+        auto startTime = job ? fromEpoch(job->start_time) : std::nullopt;
+        if (job && job->batch_host && (!arrayJobId || job->array_task_id == *arrayTaskId)) {
+            hostname = job->batch_host;
+            nativeJobId = job->job_id;
+            jobId = std::to_string(nativeJobId);
+            foundBatchHost = true;
+            poll.detected(startTime);
+            if (startTime && job->time_limit != INFINITE && job->time_limit != NO_VAL)
+                expectedEnd = *startTime + std::chrono::minutes(job->time_limit);
+        }
+        slurm_free_job_info_msg(resp);
+
+        if (!foundBatchHost) {
+            checkAffinity();
+            pollSleep(poll, startTime);
         }
     }
 }
 
+void SlurmNative::releasePreferredHost()
+{
+    job_desc_msg_t job_desc_msg;
+    slurm_init_job_desc_msg(&job_desc_msg);
+    job_desc_msg.job_id = nativeJobId;
+    char anyNode[] = "";
+    job_desc_msg.req_nodes = anyNode;
+    if (slurm_update_job(&job_desc_msg)) {
+        using namespace nix;
+        printError("NSH Error: unable to let job %s run on any node: %s", jobId, slurm_strerror(errno));
+    }
+}
+
+std::string SlurmNative::submitPilot(const std::string & script)
+{
+    nativeJobId = submitBatchJob(script, "/dev/null", json::object());
+    jobId = std::to_string(nativeJobId);
+    waitForBatchHost(std::nullopt, std::nullopt);
+    return ourSettings.slurmStateDir.get();
+}
+
+std::string SlurmNative::pilotLauncher(const std::string & pilotJob)
+{
+    return srunPilotLauncher(pilotJob);
+}
+
+std::vector<std::string> SlurmNative::submitArray(const std::vector<std::string> & tasks)
+{
+    /* Every task runs the script of its own job. The per-task standard
+     * error file is known to the hooks from the id of their task. */
+    json constraints = json::parse(tasks[0])["constraints"];
+    std::string script = "#!/bin/sh\ncase \"$SLURM_ARRAY_TASK_ID\" in\n";
+    for (size_t i = 0; i < tasks.size(); i++) {
+        json task = json::parse(tasks[i]);
+        script += nix::fmt("%d) exec /bin/sh -c %s;;\n", i, nix::shellEscape(task["script"].get<std::string>()));
+    }
+    script += "esac\nexit 1\n";
+
+    auto indices = nix::fmt("0-%d", tasks.size() - 1);
+    auto arrayJobId = submitBatchJob(script, ourSettings.slurmStateDir.get() + "/job-array-%A_%a.stderr", constraints, indices.c_str());
+    std::vector<std::string> jobIds;
+    for (size_t i = 0; i < tasks.size(); i++)
+        jobIds.push_back(nix::fmt("%d_%d", arrayJobId, i));
+    return jobIds;
+}
+
+void SlurmNative::cancelJob(const std::string & jobId)
+{
+    if (slurm_kill_job2(jobId.c_str(), SIGTERM, 0, nullptr))
+        throw SlurmNativeError("slurm_kill_job2");
+}
+
 static bool isLive(job_states state)
 {
     return (state == JOB_PENDING || state == JOB_RUNNING);
@@ -130,25 +275,152 @@ static uint32_t getJobReturnCode(uint32_t jobId)
 
 int SlurmNative::waitForJobFinish()
 {
-    auto sleepTime = 50ms;
+    if (auto rc = waitForPilotBuild())
+        return *rc;
+    if (auto rc = waitForJobFinishViaBroker())
+        return *rc;
+
+    JobPoll poll(1s);
     while (true) {
         auto state = getJobState(nativeJobId);
+        poll.queried();
         if (!isLive(state)) {
+            poll.detected();
             if (state != JOB_COMPLETE && state != JOB_FAILED) {
                 using namespace nix;
                 printError("NSH Error: unexpected job state %d", state);
                 return -1;
             } else
                 return getJobReturnCode(nativeJobId);
-        } else {
-            std::this_thread::sleep_for(sleepTime);
-            if (sleepTime < 1s) sleepTime *= 2;
-        }
+        } else
+            pollSleep(poll, std::nullopt, expectedEnd);
+    }
+}
+
+std::map<std::string, Scheduler::JobStatus> SlurmNative::queryJobs(const std::set<std::string> & jobIds)
+{
+    std::vector<slurm_selected_step_t> jobs;
+    for (auto & id : jobIds) {
+        uint32_t jobId = std::stoul(id);
+        jobs.push_back({nullptr, NO_VAL, NO_VAL, {0, jobId, 0, 0} });
+    }
+
+    job_state_response_msg_t *resp;
+    if (slurm_load_job_state(jobs.size(), jobs.data(), &resp)) {
+        slurm_free_job_state_response_msg(resp);
+        throw SlurmNativeError("slurm_load_job_state");
+    }
+    std::map<std::string, JobStatus> statuses;
+    for (uint32_t i = 0; i < resp->jobs_count; i++) {
+        auto id = resp->jobs[i].job_id;
+        job_states state = static_cast<job_states>(JOB_STATE_BASE & resp->jobs[i].state);
+        if (isLive(state))
+            statuses[std::to_string(id)] = {true, 0, std::to_string(state)};
+        else if (state == JOB_COMPLETE || state == JOB_FAILED)
+            statuses[std::to_string(id)] = {false, static_cast<int>(getJobReturnCode(id)), std::to_string(state)};
+        else
+            statuses[std::to_string(id)] = {false, -1, std::to_string(state)};
+    }
+    slurm_free_job_state_response_msg(resp);
+    return statuses;
+}
+
+Scheduler::QueueEstimate SlurmNative::estimateQueue()
+{
+    QueueEstimate estimate;
+    job_state_response_msg_t *resp;
+    if (slurm_load_job_state(0, nullptr, &resp)) {
+        slurm_free_job_state_response_msg(resp);
+        throw SlurmNativeError("slurm_load_job_state");
+    }
+    for (uint32_t i = 0; i < resp->jobs_count; i++)
+        if ((JOB_STATE_BASE & resp->jobs[i].state) == JOB_PENDING)
+            estimate.pendingJobs++;
+    slurm_free_job_state_response_msg(resp);
+
+    /* Ask when a job with the default parameters would start, as sbatch
+     * --test-only does. */
+    job_desc_msg_t job_desc_msg;
+    slurm_init_job_desc_msg(&job_desc_msg);
+    char pathVar[] = PATH_VAR;
+    char *vars[] = {pathVar};
+    job_desc_msg.environment = vars;
+    job_desc_msg.env_size = 1;
+    char script[] = "#!/bin/sh\ntrue\n";
+    job_desc_msg.script = script;
+    job_desc_msg.work_dir = ourSettings.slurmStateDir.get().data();
+    will_run_response_msg_t *willRun;
+    if (slurm_job_will_run2(&job_desc_msg, &willRun) == 0) {
+        estimate.startDelay = std::chrono::seconds(std::max<time_t>(willRun->start_time - time(nullptr), 0));
+        slurm_free_will_run_response_msg(willRun);
     }
+    return estimate;
+}
+
+/* @return Seconds of a duration printed by sacct, as [[D-]HH:]MM:SS[.mmm]. */
+static double parseDuration(const std::string & s)
+{
+    double seconds = 0;
+    auto rest = s;
+    if (auto dash = rest.find('-'); dash != std::string::npos) {
+        seconds = std::stod(rest.substr(0, dash)) * 86400;
+        rest = rest.substr(dash + 1);
+    }
+    double field = 0;
+    for (auto & part : nix::tokenizeString<std::vector<std::string>>(rest, ":"))
+        field = field * 60 + std::stod(part);
+    return seconds + field;
+}
+
+/* @return Bytes of a size printed by sacct, with a K, M, G or T suffix. */
+static uint64_t parseSize(const std::string & s)
+{
+    if (s.empty())
+        return 0;
+    uint64_t factor = 1;
+    switch (s.back()) {
+        case 'T': factor <<= 10; [[fallthrough]];
+        case 'G': factor <<= 10; [[fallthrough]];
+        case 'M': factor <<= 10; [[fallthrough]];
+        case 'K': factor <<= 10;
+    }
+    return std::stod(s) * factor;
+}
+
+std::optional<JobUsage> SlurmNative::queryUsage()
+{
+    /* The accounting is queried through sacct, as libslurmdb needs a
+     * connection to slurmdbd of its own. The line of the job has its
+     * elapsed and CPU time and its CPUs, the memory is the peak of its
+     * steps. */
+    auto output = nix::runProgram("sacct", true, {"-j", jobId, "-n", "-P", "-o", "JobIDRaw,Elapsed,TotalCPU,AllocCPUS,MaxRSS"});
+    std::optional<JobUsage> usage;
+    uint64_t maxRss = 0;
+    for (auto & line : nix::tokenizeString<std::vector<std::string>>(output, "\n")) {
+        /* Empty fields, such as the MaxRSS of the job, are skipped. */
+        auto fields = nix::tokenizeString<std::vector<std::string>>(line, "|");
+        if (fields.size() >= 4 && fields[0] == jobId)
+            usage = JobUsage{parseDuration(fields[2]), parseDuration(fields[1]), 0, (unsigned int) std::stoul(fields[3])};
+        else if (fields.size() == 5)
+            maxRss = std::max(maxRss, parseSize(fields[4]));
+    }
+    if (usage)
+        usage->maxRss = maxRss;
+    return usage;
 }
 
 SlurmNative::~SlurmNative()
 {
+    /* A task of a job array has no job id of its own until it starts, and
+     * is still pending if its id has the form '<array>_<task>'. */
+    if (!nativeJobId && jobId.find('_') != std::string::npos) {
+        try {
+            cancelJob(jobId);
+        } catch (std::exception & e) {
+            using namespace nix;
+            printError("error cancelling job %s: %s", jobId, e.what());
+        }
+    }
     if (nativeJobId && isLive(getJobState(nativeJobId))) {
         if (slurm_kill_job(nativeJobId, SIGTERM, 0) && isLive(getJobState(nativeJobId))) {
             using namespace nix;
@@ -2,6 +2,7 @@
 
 #include <string>
 #include <exception>
+#include <optional>
 
 #include <slurm/slurm_errno.h>
 
@@ -19,10 +20,21 @@ struct SlurmNativeConstraintError : public std::runtime_error
 
 class SlurmNative : public Scheduler
 {
-    uint32_t nativeJobId;
+    uint32_t nativeJobId = 0;
 public:
     SlurmNative();
     ~SlurmNative();
     void submit(nix::StorePath drvPath);
     int waitForJobFinish();
+    std::map<std::string, JobStatus> queryJobs(const std::set<std::string> & jobIds);
+    QueueEstimate estimateQueue();
+    std::vector<std::string> submitArray(const std::vector<std::string> & tasks);
+    void cancelJob(const std::string & jobId);
+    std::string submitPilot(const std::string & script);
+    std::string pilotLauncher(const std::string & pilotJob);
+    std::optional<JobUsage> queryUsage();
+
+private:
+    void waitForBatchHost(std::optional<uint32_t> arrayJobId, std::optional<uint32_t> arrayTaskId);
+    void releasePreferredHost();
 };
@@ -0,0 +1,34 @@
+#include "slurm-rest.hh"
+
+using namespace nlohmann;
+
+namespace SlurmFields {
+    const std::set<std::string_view> errors = {"errors", "description", "error_number", "error"};
+    const std::set<std::string_view> placement = {"jobs", "job_id", "batch_host", "start_time", "time_limit", "set", "infinite", "number"};
+    const std::set<std::string_view> exitCode = {"jobs", "exit_code", "return_code", "set", "number"};
+    const std::set<std::string_view> states = {"jobs", "job_id", "state", "current"};
+    const std::set<std::string_view> usage = {"jobs", "time", "elapsed", "total", "seconds", "microseconds", "steps", "tres", "requested", "allocated", "max", "type", "count"};
+}
+
+json parseSlurmResponse(std::string_view body, const std::set<std::string_view> & fields)
+{
+    return json::parse(body, [&](int depth, json::parse_event_t event, json & parsed) {
+        if (event != json::parse_event_t::key)
+            return true;
+        auto & key = parsed.get_ref<const std::string &>();
+        return fields.contains(key) || SlurmFields::errors.contains(key);
+    });
+}
+
+std::map<std::string, std::string> readJobStates(const json & response)
+{
+    std::map<std::string, std::string> states;
+    if (!response.contains("jobs"))
+        return states;
+    for (auto & job : response["jobs"]) {
+        std::string id = job["job_id"].is_string() ? job["job_id"].get<std::string>() : std::to_string(job["job_id"].get<int>());
+        auto & jobState = job["state"].is_object() ? job["state"]["current"] : job["state"];
+        states[id] = jobState.is_array() ? jobState[0] : jobState;
+    }
+    return states;
+}
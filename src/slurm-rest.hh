@@ -0,0 +1,32 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+
+#include <nlohmann/json.hpp>
+
+/* Fields of the Slurm REST API responses read by NSH. */
+namespace SlurmFields {
+    /* The 'errors' array of every response. */
+    extern const std::set<std::string_view> errors;
+    /* Placement and time estimates of a job in the /job/{id} response. */
+    extern const std::set<std::string_view> placement;
+    /* Exit code of a job in the /job/{id} response. */
+    extern const std::set<std::string_view> exitCode;
+    /* Job states in the /jobs/state response. */
+    extern const std::set<std::string_view> states;
+    /* Resources used by a job in the slurmdb /job/{id} response. */
+    extern const std::set<std::string_view> usage;
+}
+
+/* Parses a response of the Slurm REST API, only keeping the object members
+ * named in fields (at any depth) along with the errors. The other members
+ * are skipped while parsing, so that the full /job/{id} document, which has
+ * well over a hundred members per job, is never built in memory. */
+nlohmann::json parseSlurmResponse(std::string_view body, const std::set<std::string_view> & fields);
+
+/* @return State of every job in a /jobs/state response parsed with
+ * SlurmFields::states, by job id. */
+std::map<std::string, std::string> readJobStates(const nlohmann::json & response);
@@ -1,6 +1,7 @@
 #include "slurm.hh"
 #include "settings.hh"
 #include "sched_util.hh"
+#include "slurm-rest.hh"
 
 #include <string>
 #include <iostream>
@@ -10,6 +11,8 @@
 #include <thread>
 using namespace std::chrono_literals;
 #include <atomic>
+#include <mutex>
+#include <optional>
 #include <fcntl.h>
 
 #include <nlohmann/json.hpp>
@@ -21,30 +24,66 @@ using namespace nlohmann;
 #include <nix/store/store-open.hh>
 #include <nix/store/store-api.hh>
 #include <nix/store/derivations.hh>
+#include <nix/util/strings.hh>
 
 constexpr std::string_view SLURM_API_VERSION = "v0.0.43";
 
 static std::shared_ptr<RestClient::Connection> getConn()
 {
-    static bool init = false;
-    static std::shared_ptr<RestClient::Connection> conn;
-    if (!init) {
+    static thread_local bool init = false;
+    static thread_local pid_t initPid;
+    static thread_local std::shared_ptr<RestClient::Connection> conn;
+    // Sessions forked off the broker must not share its connection, and
+    // the threads of the broker must not share one either
+    if (!init || initPid != getpid()) {
+        static std::mutex initMutex;
+        std::lock_guard lock(initMutex);
         RestClient::init();
-        conn = std::make_shared<RestClient::Connection>(
-            nix::fmt("http://%s:%d", ourSettings.slurmApiHost.get(), ourSettings.slurmApiPort.get()));
+        // The connection is kept open across requests, which libcurl reuses
+        // as long as the handle lives
+        if (ourSettings.slurmApiSocket.get() != "") {
+            conn = std::make_shared<RestClient::Connection>("http://localhost");
+            conn->SetUnixSocketPath(ourSettings.slurmApiSocket.get());
+        } else
+            conn = std::make_shared<RestClient::Connection>(
+                nix::fmt("http://%s:%d", ourSettings.slurmApiHost.get(), ourSettings.slurmApiPort.get()));
         RestClient::HeaderFields headers;
         headers["X-SLURM-USER-TOKEN"] = ourSettings.slurmJwtToken.get();
         headers["Content-Type"] = "application/json";
         conn->SetHeaders(headers);
         init = true;
+        initPid = getpid();
     }
     return conn;
 }
 
+/* Submits a job.
+ * @return Id of the submitted job. */
+static std::string postJob(const json & req)
+{
+    RestClient::Response r = getConn()->post("/slurm/" + SLURM_API_VERSION + "/job/submit", req.dump());
+    if (r.body == "Authentication failure") {
+        throw SlurmAuthenticationError(r.body);
+    }
+    json response = json::parse(r.body);
+    if (response["errors"].size() > 0) {
+        throw SlurmAPIError(nix::fmt("%s (%d): %s",
+            response["errors"][0]["description"],
+            response["errors"][0]["error_number"],
+            response["errors"][0]["error"]));
+    }
+    int jobIdInt = response["job_id"];
+    return std::to_string(jobIdInt);
+}
+
 void Slurm::submit(nix::StorePath drvPath)
 {
-    rootPath = ourSettings.slurmStateDir.get() + "/job-" + std::string(drvPath.to_string()) + ".root";
-    jobStderr = ourSettings.slurmStateDir.get() + "/job-" + std::string(drvPath.to_string()) + ".stderr";
+    /* The files of every job have names of their own, so that a later job
+     * building the same derivation does not lose them to the cleanup of an
+     * earlier one. */
+    auto jobFiles = ourSettings.slurmStateDir.get() + "/job-" + std::string(drvPath.to_string()) + "-" + readyToken;
+    rootPath = jobFiles + ".root";
+    jobStderr = jobFiles + ".stderr";
 
     char pathVar[] = PATH_VAR;
     json req = {
@@ -52,7 +91,7 @@ void Slurm::submit(nix::StorePath drvPath)
             {"name", "Nix Build - " + std::string(drvPath.to_string())},
             {"current_working_directory", "/tmp"},
             {"environment", {pathVar}},
-            {"script", genScript(drvPath, rootPath)},
+            {"script", genScript(drvPath, rootPath, readyToken, stagedPaths)},
             {"standard_error", jobStderr},
         }}
     };
@@ -73,28 +112,70 @@ void Slurm::submit(nix::StorePath drvPath)
         }
     }
 
-    auto conn = getConn();
-    blockSignals();
-    RestClient::Response r = conn->post("/slurm/" + SLURM_API_VERSION + "/job/submit", req.dump());
-    if (r.body == "Authentication failure") {
-        throw SlurmAuthenticationError(r.body);
+    /* So do the resources, over the auto-sizing. */
+    if (sizing) {
+        if (!req["job"].contains("cpus_per_task")) {
+            req["job"]["cpus_per_task"] = sizing->cpus;
+            autoSized = true;
+        }
+        if (!req["job"].contains("memory_per_node") && !req["job"].contains("memory_per_cpu")) {
+            req["job"]["memory_per_node"] = {{"set", true}, {"number", sizing->memoryMB}};
+            autoSized = true;
+        }
+        if (!req["job"].contains("time_limit")) {
+            req["job"]["time_limit"] = {{"set", true}, {"number", sizing->timeLimitMinutes}};
+            autoSized = true;
+        }
     }
-    json response = json::parse(r.body);
-    if (response["errors"].size() > 0) {
-        throw SlurmAPIError(nix::fmt("%s (%d): %s",
-            response["errors"][0]["description"],
-            response["errors"][0]["error_number"],
-            response["errors"][0]["error"]));
+
+    /* Nodes requested by the derivation or the settings take precedence
+     * over the preferred host. */
+    bool held = preferredHost != "" && !req["job"].contains("required_nodes");
+    if (held)
+        req["job"]["required_nodes"] = {preferredHost};
+
+    /* Jobs whose parameters only differ in the fields that are set per
+     * array task can share a job array. Jobs held for a node are submitted
+     * on their own. */
+    json key = req["job"];
+    key.erase("name");
+    key.erase("script");
+    key.erase("standard_error");
+
+    {
+        SignalsBlocked blocked;
+        if (auto arrayTaskId = held ? std::optional<std::string>() : submitViaBroker(key.dump(), req.dump())) {
+            jobId = *arrayTaskId;
+            jobStderr = ourSettings.slurmStateDir.get() + "/job-array-" + jobId + ".stderr";
+        } else
+            jobId = postJob(req);
     }
-    int jobIdInt = response["job_id"];
-    jobId = std::to_string(jobIdInt);
-    unblockSignals();
+    if (held)
+        heldForPreferredHost();
 
+    waitForBatchHost();
+}
+
+/* @return Value of a number field of the REST API, or std::nullopt if it is
+ * unset or infinite. */
+static std::optional<int64_t> getNumber(const json & field)
+{
+    if (field.is_number())
+        return field.get<int64_t>();
+    if (!field.is_object() || !field.value("set", false) || field.value("infinite", false))
+        return std::nullopt;
+    return field["number"].get<int64_t>();
+}
+
+void Slurm::waitForBatchHost()
+{
+    auto conn = getConn();
     bool foundBatchHost = false;
-    auto sleepTime = 50ms;
+    JobPoll poll(1s);
     while (!foundBatchHost) {
         RestClient::Response qr = conn->get("/slurm/" + SLURM_API_VERSION + "/job/" + jobId);
-        json qresp = json::parse(qr.body);
+        poll.queried();
+        json qresp = parseSlurmResponse(qr.body, SlurmFields::placement);
         if (qresp["errors"].size() > 0) {
             throw SlurmAPIError(nix::fmt("%s (%d): %s",
                 qresp["errors"][0]["description"],
@@ -106,12 +187,100 @@ void Slurm::submit(nix::StorePath drvPath)
             qresp["jobs"][0]["batch_host"] != ""
         ) {
             hostname = qresp["jobs"][0]["batch_host"];
+            // A running array task has a job id of its own
+            int jobIdInt = qresp["jobs"][0]["job_id"];
+            jobId = std::to_string(jobIdInt);
             foundBatchHost = true;
+
+            auto startTime = getNumber(qresp["jobs"][0]["start_time"]);
+            poll.detected(fromEpoch(startTime.value_or(0)));
+            auto timeLimit = getNumber(qresp["jobs"][0]["time_limit"]);
+            if (startTime && timeLimit)
+                expectedEnd = fromEpoch(*startTime + *timeLimit * 60);
         } else {
-            std::this_thread::sleep_for(sleepTime);
-            if (sleepTime < 1s) sleepTime *= 2;
+            /* The start time of a pending job is the scheduler's estimate. */
+            std::optional<int64_t> startTime;
+            if (qresp["jobs"].size() == 1)
+                startTime = getNumber(qresp["jobs"][0]["start_time"]);
+            checkAffinity();
+            pollSleep(poll, fromEpoch(startTime.value_or(0)));
+        }
+    }
+}
+
+void Slurm::releasePreferredHost()
+{
+    try {
+        json req = {{"required_nodes", json::array()}};
+        RestClient::Response r = getConn()->post("/slurm/" + SLURM_API_VERSION + "/job/" + jobId, req.dump());
+        json response = parseSlurmResponse(r.body, {});
+        if (response["errors"].size() > 0)
+            throw SlurmAPIError(nix::fmt("%s (%d): %s",
+                response["errors"][0]["description"],
+                response["errors"][0]["error_number"],
+                response["errors"][0]["error"]));
+    } catch (std::exception & e) {
+        using namespace nix;
+        printError("NSH Error: unable to let job %s run on any node: %s", jobId, e.what());
+    }
+}
+
+std::string Slurm::submitPilot(const std::string & script)
+{
+    char pathVar[] = PATH_VAR;
+    json req = {
+        {"job", {
+            {"name", "Nix Build - pilot"},
+            {"current_working_directory", "/tmp"},
+            {"environment", {pathVar}},
+            {"script", script},
+            {"standard_error", "/dev/null"},
+        }}
+    };
+
+    if (ourSettings.slurmExtraJobSubmissionParams.get() != "") {
+        json extraParams = json::parse(ourSettings.slurmExtraJobSubmissionParams.get());
+        for (auto & [key, value] : extraParams.items()) {
+            req["job"][key] = value;
         }
     }
+
+    jobId = postJob(req);
+    waitForBatchHost();
+    return ourSettings.slurmStateDir.get();
+}
+
+std::string Slurm::pilotLauncher(const std::string & pilotJob)
+{
+    return srunPilotLauncher(pilotJob);
+}
+
+std::vector<std::string> Slurm::submitArray(const std::vector<std::string> & tasks)
+{
+    /* Every task runs the script of its own job. The per-task standard
+     * error file is known to the hooks from the id of their task. */
+    json req = json::parse(tasks[0]);
+    std::string script = "#!/bin/sh\ncase \"$SLURM_ARRAY_TASK_ID\" in\n";
+    for (size_t i = 0; i < tasks.size(); i++) {
+        json task = json::parse(tasks[i]);
+        script += nix::fmt("%d) exec /bin/sh -c %s;;\n", i, nix::shellEscape(task["job"]["script"].get<std::string>()));
+    }
+    script += "esac\nexit 1\n";
+    req["job"]["name"] = nix::fmt("Nix Build - array of %d", tasks.size());
+    req["job"]["script"] = script;
+    req["job"]["standard_error"] = ourSettings.slurmStateDir.get() + "/job-array-%A_%a.stderr";
+    req["job"]["array"] = nix::fmt("0-%d", tasks.size() - 1);
+
+    auto arrayJobId = postJob(req);
+    std::vector<std::string> jobIds;
+    for (size_t i = 0; i < tasks.size(); i++)
+        jobIds.push_back(nix::fmt("%s_%d", arrayJobId, i));
+    return jobIds;
+}
+
+void Slurm::cancelJob(const std::string & jobId)
+{
+    getConn()->del("/slurm/" + SLURM_API_VERSION + "/job/" + jobId);
 }
 
 static bool isLive(std::string state)
@@ -119,19 +288,27 @@ static bool isLive(std::string state)
     return (state == "PENDING" || state == "RUNNING");
 }
 
+/* Number of queries that may miss a job, which is not listed until slurmctld
+ * has registered it, before it is taken to be gone. */
+#define SLURM_JOB_STATE_MAX_MISSES 10
+
 static std::string getJobState(std::string jobId)
 {
     auto sleepTime = 50ms;
-    while (true) {
-        RestClient::Response qr = getConn()->get("/slurm/" + SLURM_API_VERSION + "/job/" + jobId);
-        json qresp = json::parse(qr.body);
+    for (unsigned misses = 0; ; misses++) {
+        RestClient::Response qr = getConn()->get("/slurm/" + SLURM_API_VERSION + "/jobs/state/?job_id=" + jobId);
+        json qresp = parseSlurmResponse(qr.body, SlurmFields::states);
         if (qresp["errors"].size() > 0) {
             throw SlurmAPIError(nix::fmt("%s (%d): %s",
                 qresp["errors"][0]["description"],
                 qresp["errors"][0]["error_number"],
                 qresp["errors"][0]["error"]));
-        } else if (qresp["jobs"].size() == 1) {
-            return qresp["jobs"][0]["job_state"][0];
+        }
+        auto states = readJobStates(qresp);
+        if (auto state = states.find(jobId); state != states.end()) {
+            return state->second;
+        } else if (misses + 1 >= SLURM_JOB_STATE_MAX_MISSES) {
+            throw SlurmAPIError(nix::fmt("job %s is unknown to Slurm, it may have been purged", jobId));
         } else {
             std::this_thread::sleep_for(sleepTime);
             if (sleepTime < 2s) sleepTime *= 2;
@@ -143,7 +320,7 @@ static uint32_t getJobReturnCode(std::string jobId)
 {
     while (true) {
         RestClient::Response qr = getConn()->get("/slurm/" + SLURM_API_VERSION + "/job/" + jobId);
-        json qresp = json::parse(qr.body);
+        json qresp = parseSlurmResponse(qr.body, SlurmFields::exitCode);
         if (qresp["errors"].size() > 0) {
             throw SlurmAPIError(nix::fmt("%s (%d): %s",
                 qresp["errors"][0]["description"],
@@ -165,28 +342,109 @@ Slurm::Slurm()
 
 int Slurm::waitForJobFinish()
 {
-    auto sleepTime = 50ms;
+    if (auto rc = waitForPilotBuild())
+        return *rc;
+    if (auto rc = waitForJobFinishViaBroker())
+        return *rc;
+
+    JobPoll poll(4s);
     while (true) {
         auto state = getJobState(jobId);
+        poll.queried();
         if (!isLive(state)) {
+            poll.detected();
             if (state != "COMPLETED" && state != "FAILED") {
                 using namespace nix;
                 printError("NSH Error: unexpected job state %s", state);
                 return -1;
             } else
                 return getJobReturnCode(jobId);
-        } else {
-            std::this_thread::sleep_for(sleepTime);
-            if (sleepTime < 4s) sleepTime *= 2;
-        }
+        } else
+            pollSleep(poll, std::nullopt, expectedEnd);
+    }
+}
+
+std::map<std::string, Scheduler::JobStatus> Slurm::queryJobs(const std::set<std::string> & jobIds)
+{
+    std::map<std::string, JobStatus> statuses;
+    RestClient::Response qr = getConn()->get(
+        "/slurm/" + SLURM_API_VERSION + "/jobs/state/?job_id=" + nix::concatStringsSep(",", jobIds));
+    json qresp = parseSlurmResponse(qr.body, SlurmFields::states);
+    if (qresp["errors"].size() > 0) {
+        throw SlurmAPIError(nix::fmt("%s (%d): %s",
+            qresp["errors"][0]["description"],
+            qresp["errors"][0]["error_number"],
+            qresp["errors"][0]["error"]));
+    }
+    for (auto & [id, state] : readJobStates(qresp)) {
+        if (!jobIds.contains(id))
+            continue;
+        if (isLive(state))
+            statuses[id] = {true, 0, state};
+        else if (state == "COMPLETED" || state == "FAILED")
+            statuses[id] = {false, static_cast<int>(getJobReturnCode(id)), state};
+        else
+            statuses[id] = {false, -1, state};
+    }
+    return statuses;
+}
+
+Scheduler::QueueEstimate Slurm::estimateQueue()
+{
+    /* The REST API has no test-only submission, so the start of a new job
+     * is not predicted. */
+    RestClient::Response qr = getConn()->get("/slurm/" + SLURM_API_VERSION + "/jobs/state/");
+    json qresp = parseSlurmResponse(qr.body, SlurmFields::states);
+    if (qresp["errors"].size() > 0) {
+        throw SlurmAPIError(nix::fmt("%s (%d): %s",
+            qresp["errors"][0]["description"],
+            qresp["errors"][0]["error_number"],
+            qresp["errors"][0]["error"]));
+    }
+    QueueEstimate estimate;
+    for (auto & [id, state] : readJobStates(qresp))
+        if (state == "PENDING")
+            estimate.pendingJobs++;
+    return estimate;
+}
+
+std::optional<JobUsage> Slurm::queryUsage()
+{
+    RestClient::Response qr = getConn()->get("/slurmdb/" + SLURM_API_VERSION + "/job/" + jobId);
+    json qresp = parseSlurmResponse(qr.body, SlurmFields::usage);
+    if (qresp["errors"].size() > 0) {
+        throw SlurmAPIError(nix::fmt("%s (%d): %s",
+            qresp["errors"][0]["description"],
+            qresp["errors"][0]["error_number"],
+            qresp["errors"][0]["error"]));
     }
+    if (qresp["jobs"].size() != 1)
+        return std::nullopt;
+    auto & job = qresp["jobs"][0];
+    JobUsage usage;
+    usage.elapsedSeconds = job["time"].value("elapsed", 0);
+    usage.cpuSeconds = job["time"]["total"].value("seconds", 0) + job["time"]["total"].value("microseconds", 0) / 1e6;
+    for (auto & tres : job["tres"]["allocated"])
+        if (tres.value("type", "") == "cpu")
+            usage.allocatedCpus = tres.value<unsigned int>("count", 0);
+    /* The memory of the job is the peak of its steps. */
+    for (auto & step : job["steps"])
+        for (auto & tres : step["tres"]["requested"]["max"])
+            if (tres.value("type", "") == "mem")
+                usage.maxRss = std::max(usage.maxRss, tres.value<uint64_t>("count", 0));
+    /* The accounting may not have caught up with the end of the job yet. */
+    if (usage.elapsedSeconds == 0)
+        return std::nullopt;
+    return usage;
 }
 
 Slurm::~Slurm()
 {
     try {
-        if (jobId != "" && isLive(getJobState(jobId))) {
-            getConn()->del("/slurm/" + SLURM_API_VERSION + "/job/" + jobId);
+        /* A task of a job array keeps the id '<array>_<task>' while it is
+         * pending, which has no state of its own yet. */
+        if (jobId.find('_') != std::string::npos || (jobId != "" && isLive(getJobState(jobId)))) {
+            cancelJob(jobId);
         }
     } catch (std::exception & e) {
         using namespace nix;
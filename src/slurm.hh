@@ -28,4 +28,15 @@ public:
     ~Slurm();
     void submit(nix::StorePath drvPath);
     int waitForJobFinish();
+    std::map<std::string, JobStatus> queryJobs(const std::set<std::string> & jobIds);
+    QueueEstimate estimateQueue();
+    std::vector<std::string> submitArray(const std::vector<std::string> & tasks);
+    void cancelJob(const std::string & jobId);
+    std::string submitPilot(const std::string & script);
+    std::string pilotLauncher(const std::string & pilotJob);
+    std::optional<JobUsage> queryUsage();
+
+private:
+    void waitForBatchHost();
+    void releasePreferredHost();
 };
@@ -0,0 +1,71 @@
+#include "staging.hh"
+#include "settings.hh"
+
+#include <csignal>
+#include <filesystem>
+#include <unistd.h>
+
+#include <nix/store/derivations.hh>
+#include <nix/store/globals.hh>
+#include <nix/util/environment-variables.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/fmt.hh>
+#include <nix/util/logging.hh>
+#include <nix/util/strings.hh>
+
+nix::StorePathSet getInputPaths(nix::Store & store, const nix::StorePath & drvPath)
+{
+    auto drv = store.readDerivation(drvPath);
+    nix::StorePathSet paths = drv.inputSrcs;
+    paths.insert(drvPath);
+    for (auto & [inputDrv, node] : drv.inputDrvs.map) {
+        auto outputs = store.queryPartialDerivationOutputMap(inputDrv);
+        for (auto & outputName : node.value) {
+            auto i = outputs.find(outputName);
+            if (i == outputs.end() || !i->second)
+                throw std::runtime_error(nix::fmt("output '%s' of '%s' is not known", outputName, store.printStorePath(inputDrv)));
+            paths.insert(*i->second);
+        }
+    }
+    return paths;
+}
+
+StagingUpload::StagingUpload(nix::Store & store, const nix::StorePathSet & paths)
+{
+    auto [fd, logPath] = nix::createTempFile("nsh-staging");
+    unlink(logPath.c_str());
+    log = std::move(fd);
+
+    std::filesystem::path nixBinPath = "nix";
+    if (auto nixBinDir = nix::getEnvNonEmpty("NIX_BIN_DIR"))
+        nixBinPath = std::filesystem::path(*nixBinDir) / "nix";
+    nix::Strings args{"nix", "--extra-experimental-features", "nix-command", "copy",
+        "--from", nix::settings.storeUri.get(), "--to", ourSettings.stagingStore.get()};
+    if (nix::settings.buildersUseSubstitutes)
+        args.push_back("--substitute-on-destination");
+    for (auto & path : paths)
+        args.push_back(store.printStorePath(path));
+
+    {
+        using namespace nix;
+        printTalkative("staging dependencies to '%s'", ourSettings.stagingStore.get());
+    }
+    pid = nix::startProcess([&]() {
+        if (dup2(log.get(), STDOUT_FILENO) == -1 || dup2(log.get(), STDERR_FILENO) == -1)
+            throw nix::SysError("redirecting the output of 'nix copy'");
+        execvp(nixBinPath.native().c_str(), nix::stringsToCharPtrs(args).data());
+        throw nix::SysError("executing 'nix copy'");
+    });
+    /* Let 'nix copy' interrupt its transfers when it is terminated. */
+    pid.setKillSignal(SIGTERM);
+}
+
+void StagingUpload::wait()
+{
+    int status = pid.wait();
+    if (!nix::statusOk(status)) {
+        lseek(log.get(), 0, SEEK_SET);
+        auto output = nix::trim(nix::drainFD(log.get()));
+        throw std::runtime_error(nix::fmt("'nix copy' %s: %s", nix::statusToString(status), output));
+    }
+}
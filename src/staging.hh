@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdexcept>
+
+#include <nix/store/store-api.hh>
+#include <nix/util/file-descriptor.hh>
+#include <nix/util/processes.hh>
+
+/* Computes the store paths a derivation needs on the build node: the
+ * derivation itself, its input sources and the wanted outputs of its input
+ * derivations. Copying the closure of these paths is equivalent to copying
+ * the inputs sent by Nix and the closure of the derivation. */
+nix::StorePathSet getInputPaths(nix::Store & store, const nix::StorePath & drvPath);
+
+/* Copies the closure of a set of store paths to the 'staging-store' in the
+ * background, so that the upload overlaps with the time the job spends in
+ * the queue. The copy is made by a 'nix copy' process, which is terminated
+ * when the upload is destroyed before it finished. */
+class StagingUpload
+{
+public:
+    StagingUpload(nix::Store & store, const nix::StorePathSet & paths);
+
+    /* Waits for the upload to finish, throwing if it failed. */
+    void wait();
+
+private:
+    nix::Pid pid;
+    /* Output of the process, reported if the upload fails. */
+    nix::AutoCloseFD log;
+};
@@ -0,0 +1,47 @@
+#include "state.hh"
+#include "settings.hh"
+
+#include <nix/util/fmt.hh>
+#include <nix/util/hash.hh>
+
+static std::string loadDir;
+static std::string cluster;
+
+const std::string & currentLoadDir()
+{
+    return loadDir;
+}
+
+void setCurrentLoadDir(const std::string & dir)
+{
+    loadDir = dir;
+}
+
+const std::string & currentCluster()
+{
+    return cluster;
+}
+
+void setCurrentCluster(const std::string & name)
+{
+    cluster = name;
+}
+
+std::string nodeStateFile(const std::string & host, const std::string & extension)
+{
+    /* Hash the key so that the file name has a bounded length and no
+     * slashes, whatever the remote store URL looks like. */
+    auto key = nix::fmt("ssh-ng://%s %s", host, ourSettings.remoteStore.get());
+    if (!cluster.empty())
+        key += " " + cluster;
+    auto h = nix::hashString(nix::HashAlgorithm::SHA256, key);
+    return loadDir + "/" + h.to_string(nix::HashFormat::Base16, false) + extension;
+}
+
+std::string clusterStateFile(const std::string & name)
+{
+    auto path = loadDir + "/" + name;
+    if (!cluster.empty())
+        path += "-" + cluster;
+    return path;
+}
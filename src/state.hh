@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+
+/* @return The current-load directory, which holds the state NSH shares
+ * between its processes, or the empty string if it has not been set up, in
+ * which case the features keeping such state are disabled. */
+const std::string & currentLoadDir();
+
+void setCurrentLoadDir(const std::string & dir);
+
+/* @return Cluster the build is routed to, or the empty string without
+ * clusters. The state NSH keeps about nodes and jobs is kept per cluster, as
+ * nodes of different clusters may have the same name. */
+const std::string & currentCluster();
+
+void setCurrentCluster(const std::string & cluster);
+
+/* @return Path of the file in the current-load directory holding the state
+ * NSH keeps about the remote store of host, with the given extension. */
+std::string nodeStateFile(const std::string & host, const std::string & extension);
+
+/* @return Path of the file or directory with the given name in the
+ * current-load directory holding state of the current cluster. */
+std::string clusterStateFile(const std::string & name);
@@ -0,0 +1,135 @@
+#include "trace.hh"
+#include "settings.hh"
+
+#include <cerrno>
+#include <ctime>
+#include <mutex>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <nix/util/file-descriptor.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/fmt.hh>
+#include <nix/util/logging.hh>
+
+/* State of the trace of this process. The mutex is held across fork(), so
+ * that broker sessions never start with it locked by another thread. */
+static std::mutex mutex;
+static nix::AutoCloseFD traceFd;
+static std::string tracePath;
+static nlohmann::json buildArgs = nlohmann::json::object();
+static bool traceFailed = false;
+
+static int atForkRegistered = pthread_atfork(
+    []() { mutex.lock(); },
+    []() { mutex.unlock(); },
+    []() { mutex.unlock(); });
+
+/* Opens the trace file of the current day, creating it if needed. */
+static void openTraceFile()
+{
+    char date[16];
+    time_t now = time(nullptr);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+    auto dir = ourSettings.traceDir.get();
+    auto path = nix::fmt("%s/nsh-trace-%s.json", dir, date);
+    if (traceFd && path == tracePath)
+        return;
+
+    /* The file is created complete with the opening bracket of the array
+     * and linked into place, so no event can come before the bracket. */
+    if (!nix::pathExists(path)) {
+        nix::createDirs(dir);
+        auto tmpPath = nix::fmt("%s.tmp-%d", path, getpid());
+        nix::writeFile(tmpPath, "[\n", 0644);
+        if (link(tmpPath.c_str(), path.c_str()) == -1 && errno != EEXIST) {
+            unlink(tmpPath.c_str());
+            throw nix::SysError("creating trace file '%s'", path);
+        }
+        unlink(tmpPath.c_str());
+    }
+    traceFd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (!traceFd)
+        throw nix::SysError("opening trace file '%s'", path);
+    tracePath = path;
+}
+
+/* Appends event as a single write. Called with the mutex held. */
+static void append(const nlohmann::json & event)
+{
+    if (traceFailed)
+        return;
+    try {
+        openTraceFile();
+        nix::writeFull(traceFd.get(), event.dump() + ",\n");
+    } catch (std::exception & e) {
+        traceFailed = true;
+        using namespace nix;
+        printError("NSH Error: tracing disabled: %s", e.what());
+    }
+}
+
+static int64_t micros(TraceClock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+}
+
+bool traceEnabled()
+{
+    (void) atForkRegistered;
+    return ourSettings.traceDir.get() != "";
+}
+
+void traceBuild(const std::string & drvPath)
+{
+    if (!traceEnabled())
+        return;
+    std::lock_guard lock(mutex);
+    buildArgs = {{"drv", drvPath}};
+    append({
+        {"name", "process_name"},
+        {"ph", "M"},
+        {"pid", getpid()},
+        {"args", {{"name", drvPath}}},
+    });
+}
+
+void traceJob(const std::string & jobId)
+{
+    if (!traceEnabled())
+        return;
+    std::lock_guard lock(mutex);
+    buildArgs["job"] = jobId;
+}
+
+void traceSpan(const std::string & category, const std::string & name,
+    TraceClock::time_point start, TraceClock::time_point end, nlohmann::json args)
+{
+    if (!traceEnabled())
+        return;
+    std::lock_guard lock(mutex);
+    args.update(buildArgs);
+    append({
+        {"name", name},
+        {"cat", category},
+        {"ph", "X"},
+        {"ts", micros(start)},
+        {"dur", std::max<int64_t>(micros(end) - micros(start), 0)},
+        {"pid", getpid()},
+        {"tid", gettid()},
+        {"args", std::move(args)},
+    });
+}
+
+TraceSpan::TraceSpan(std::string category, std::string name, nlohmann::json args)
+    : category(std::move(category)), name(std::move(name)), args(std::move(args)), start(TraceClock::now())
+{
+}
+
+TraceSpan::~TraceSpan()
+{
+    traceSpan(category, name, start, TraceClock::now(), std::move(args));
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+
+#include <nlohmann/json.hpp>
+
+/* Timeline of the builds, recorded when trace-dir is set. Spans are appended
+ * as they end to a trace file per day in trace-dir, in the JSON array format
+ * of the Chrome trace viewer, which Perfetto and chrome://tracing load even
+ * though the array is never closed. Every event is a single append, so that
+ * all hooks and the broker can share the file. Each process shows up named
+ * after the derivation it builds, with a track per thread, and every span
+ * carries the derivation and the job id as arguments. */
+
+using TraceClock = std::chrono::system_clock;
+
+/* @return Whether trace-dir is set. */
+bool traceEnabled();
+
+/* Names the process after drvPath in the trace and adds it to the arguments
+ * of the spans recorded from now on. */
+void traceBuild(const std::string & drvPath);
+
+/* Adds jobId to the arguments of the spans recorded from now on. */
+void traceJob(const std::string & jobId);
+
+/* Records a span that has already ended. */
+void traceSpan(const std::string & category, const std::string & name,
+    TraceClock::time_point start, TraceClock::time_point end, nlohmann::json args = nlohmann::json::object());
+
+/* Records a span from its construction to its destruction. */
+class TraceSpan
+{
+public:
+    TraceSpan(std::string category, std::string name, nlohmann::json args = nlohmann::json::object());
+    ~TraceSpan();
+
+private:
+    std::string category;
+    std::string name;
+    nlohmann::json args;
+    TraceClock::time_point start;
+};
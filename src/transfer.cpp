@@ -0,0 +1,304 @@
+#include "transfer.hh"
+
+#include <condition_variable>
+#include <cstring>
+#include <csignal>
+#include <deque>
+#include <exception>
+#include <fcntl.h>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <nix/store/nar-info.hh>
+#include <nix/store/store-open.hh>
+#include <nix/util/file-descriptor.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/fmt.hh>
+#include <nix/util/serialise.hh>
+#include <nix/util/strings.hh>
+#include <nix/util/tarfile.hh>
+
+#include "settings.hh"
+#include "trace.hh"
+
+TransferStats copyPathsParallel(
+    const std::vector<nix::ref<nix::Store>> & srcStores,
+    const std::vector<nix::ref<nix::Store>> & dstStores,
+    const nix::StorePathSet & paths)
+{
+    TransferStats stats;
+    auto start = std::chrono::steady_clock::now();
+
+    /* Count for every path how many of its references still have to be
+     * copied, and remember which paths are waiting for it. */
+    std::map<nix::StorePath, size_t> pendingRefs;
+    std::map<nix::StorePath, std::vector<nix::StorePath>> referrers;
+    std::map<nix::StorePath, uint64_t> narSizes;
+    std::deque<nix::StorePath> ready;
+    for (auto & path : paths) {
+        auto info = srcStores[0]->queryPathInfo(path);
+        narSizes.emplace(path, info->narSize);
+        size_t n = 0;
+        for (auto & ref : info->references)
+            if (ref != path && paths.contains(ref)) {
+                referrers[ref].push_back(path);
+                n++;
+            }
+        pendingRefs.emplace(path, n);
+        if (!n)
+            ready.push_back(path);
+    }
+
+    /* With a single connection the workers gain nothing, while copyPaths
+     * sends all paths in one batch instead of one request per path. */
+    if (srcStores.size() == 1 && dstStores.size() == 1) {
+        TraceSpan span("transfer", "batch", {{"paths", paths.size()}});
+        nix::copyPaths(*srcStores[0], *dstStores[0], paths, nix::NoRepair, nix::NoCheckSigs);
+        stats.paths = paths.size();
+        for (auto & [path, narSize] : narSizes)
+            stats.narBytes += narSize;
+        stats.elapsed = std::chrono::steady_clock::now() - start;
+        return stats;
+    }
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    size_t remaining = paths.size();
+    std::exception_ptr error;
+
+    auto worker = [&](size_t i) {
+        /* SIGTERM is handled by the main thread. */
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+        auto & srcStore = *srcStores[i % srcStores.size()];
+        auto & dstStore = *dstStores[i % dstStores.size()];
+        std::unique_lock lock(mutex);
+        while (true) {
+            wakeup.wait(lock, [&]() { return !ready.empty() || !remaining || error; });
+            if (!remaining || error)
+                return;
+            auto path = std::move(ready.front());
+            ready.pop_front();
+
+            lock.unlock();
+            try {
+                TraceSpan span("transfer", std::string(path.name()), {{"path", path.to_string()}, {"narSize", narSizes.at(path)}});
+                nix::copyStorePath(srcStore, dstStore, path, nix::NoRepair, nix::NoCheckSigs);
+            } catch (...) {
+                lock.lock();
+                if (!error)
+                    error = std::current_exception();
+                wakeup.notify_all();
+                return;
+            }
+            lock.lock();
+
+            stats.paths++;
+            stats.narBytes += narSizes.at(path);
+            remaining--;
+            for (auto & referrer : referrers[path])
+                if (!--pendingRefs.at(referrer))
+                    ready.push_back(referrer);
+            wakeup.notify_all();
+        }
+    };
+
+    auto nrWorkers = std::min(std::max(srcStores.size(), dstStores.size()), paths.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < nrWorkers; i++)
+        workers.emplace_back(worker, i);
+    for (auto & thread : workers)
+        thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+
+    stats.elapsed = std::chrono::steady_clock::now() - start;
+    return stats;
+}
+
+std::string showTransferStats(const TransferStats & stats)
+{
+    double mib = stats.narBytes / (1024.0 * 1024.0);
+    double seconds = stats.elapsed.count();
+    auto s = nix::fmt("%d paths, %.1f MiB in %.1f s (%.1f MiB/s)",
+        stats.paths, mib, seconds, seconds > 0 ? mib / seconds : 0.0);
+    if (stats.fileBytes)
+        s += nix::fmt(", compressed to %.1f MiB (ratio %.2f)",
+            stats.fileBytes / (1024.0 * 1024.0), (double) stats.narBytes / stats.fileBytes);
+    return s;
+}
+
+static std::string cacheUri(const std::string & dir)
+{
+    return nix::fmt("file://%s?compression=zstd&compression-level=%d&parallel-compression=true",
+        dir, ourSettings.transferCompressionLevel.get());
+}
+
+static size_t compressionThreads()
+{
+    if (auto n = ourSettings.transferCompressionThreads.get())
+        return n;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+static std::string remoteNixCommand()
+{
+    auto binDir = ourSettings.remoteNixBinDir.get();
+    return (binDir != "" ? binDir + "/" : "") + "nix --extra-experimental-features nix-command";
+}
+
+/* @return paths as a list for xargs on the build node. They are not passed
+ * on the command line, which may not be long enough for large closures. */
+static std::string remotePaths(const nix::StorePathSet & paths)
+{
+    std::string res;
+    for (auto & path : paths)
+        res += ourSettings.storeDir.get() + "/" + std::string(path.to_string()) + "\n";
+    return res;
+}
+
+/* Writes the regular files below dir to fd as a ustar archive. The binary
+ * cache only contains short relative names, so no extensions are needed. */
+static void writeTar(const std::filesystem::path & dir, int fd)
+{
+    auto octal = [](char * field, size_t width, uint64_t value) {
+        snprintf(field, width, "%0*llo", (int) width - 1, (unsigned long long) value);
+    };
+
+    for (auto & entry : std::filesystem::recursive_directory_iterator(dir)) {
+        if (!entry.is_regular_file())
+            continue;
+        auto name = std::filesystem::relative(entry.path(), dir).string();
+        if (name.size() >= 100)
+            throw std::runtime_error(nix::fmt("file name '%s' is too long for the transfer archive", name));
+        auto size = entry.file_size();
+
+        char header[512] = {};
+        memcpy(header, name.data(), name.size());
+        octal(header + 100, 8, 0644);
+        octal(header + 108, 8, 0);
+        octal(header + 116, 8, 0);
+        octal(header + 124, 12, size);
+        octal(header + 136, 12, 0);
+        header[156] = '0';
+        memcpy(header + 257, "ustar", 6);
+        memcpy(header + 263, "00", 2);
+        memset(header + 148, ' ', 8);
+        unsigned int checksum = 0;
+        for (unsigned char c : header)
+            checksum += c;
+        snprintf(header + 148, 8, "%06o", checksum);
+        nix::writeFull(fd, std::string_view(header, sizeof(header)));
+
+        nix::AutoCloseFD file = open(entry.path().c_str(), O_RDONLY | O_CLOEXEC);
+        if (!file)
+            throw nix::SysError("opening '%s'", entry.path().string());
+        nix::FdSource source(file.get());
+        nix::FdSink sink(fd);
+        source.drainInto(sink);
+        sink.flush();
+        if (auto padding = size % 512)
+            nix::writeFull(fd, std::string(512 - padding, '\0'));
+    }
+    nix::writeFull(fd, std::string(1024, '\0'));
+}
+
+static uint64_t compressedSize(nix::Store & cacheStore, const nix::StorePathSet & paths)
+{
+    uint64_t size = 0;
+    for (auto & path : paths) {
+        std::shared_ptr<const nix::ValidPathInfo> info = cacheStore.queryPathInfo(path);
+        if (auto narInfo = std::dynamic_pointer_cast<const nix::NarInfo>(info))
+            size += narInfo->fileSize;
+    }
+    return size;
+}
+
+TransferStats uploadCompressed(
+    nix::ref<nix::Store> store,
+    nix::SSHMaster & sshMaster,
+    const std::string & remoteDir,
+    const nix::StorePathSet & paths)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    nix::Path tmpDir = nix::createTempDir();
+    nix::AutoDelete deleteTmpDir(tmpDir, true);
+    auto cacheStore = nix::openStore(cacheUri(tmpDir));
+
+    /* Compress several NARs at once, all into the same cache. */
+    std::vector<nix::ref<nix::Store>> cacheStores(compressionThreads(), cacheStore);
+    auto stats = copyPathsParallel({store}, cacheStores, paths);
+    stats.fileBytes = compressedSize(*cacheStore, paths);
+
+    /* The list of paths to import travels in the archive, next to the
+     * cache. */
+    nix::writeFile(tmpDir + "/paths", remotePaths(paths));
+
+    auto dir = nix::shellEscape(remoteDir);
+    auto script = nix::fmt(
+        "rm -rf %s && mkdir -p %s && (cd %s && tar -xf - && "
+        "xargs -r %s copy --quiet --no-recursive --no-check-sigs --from \"file://$PWD\" --to %s <paths); "
+        "rc=$?; rm -rf %s; exit $rc",
+        dir, dir, dir,
+        remoteNixCommand(), nix::shellEscape(ourSettings.remoteStore.get()),
+        dir);
+    nix::Strings cmd = {"sh", "-c", nix::shellEscape(script)};
+    TraceSpan span("transfer", "send compressed inputs", {{"paths", paths.size()}, {"fileBytes", stats.fileBytes}});
+    auto conn = sshMaster.startCommand(std::move(cmd));
+    writeTar(tmpDir, conn->in.get());
+    conn->in.close();
+    if (int rc = conn->sshPid.wait())
+        throw std::runtime_error(nix::fmt("importing the compressed inputs on the build node failed with exit code %d", rc));
+
+    stats.elapsed = std::chrono::steady_clock::now() - start;
+    return stats;
+}
+
+TransferStats downloadCompressed(
+    nix::SSHMaster & sshMaster,
+    const std::string & remoteDir,
+    nix::ref<nix::Store> store,
+    const nix::StorePathSet & paths)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    auto dir = nix::shellEscape(remoteDir);
+    auto script = nix::fmt(
+        "rm -rf %s && mkdir -p %s && (cd %s && "
+        "xargs -r %s copy --quiet --no-recursive --from %s --to \"file://$PWD?compression=zstd&compression-level=%d&parallel-compression=true\" >&2 && "
+        "tar -cf - .); "
+        "rc=$?; rm -rf %s; exit $rc",
+        dir, dir, dir,
+        remoteNixCommand(), nix::shellEscape(ourSettings.remoteStore.get()), ourSettings.transferCompressionLevel.get(),
+        dir);
+    nix::Strings cmd = {"sh", "-c", nix::shellEscape(script)};
+    auto conn = sshMaster.startCommand(std::move(cmd));
+    /* Nothing is written to stdout before the list has been read. */
+    nix::writeFull(conn->in.get(), remotePaths(paths));
+    conn->in.close();
+
+    nix::Path tmpDir = nix::createTempDir();
+    nix::AutoDelete deleteTmpDir(tmpDir, true);
+    {
+        TraceSpan span("transfer", "receive compressed outputs", {{"paths", paths.size()}});
+        nix::FdSource source(conn->out.get());
+        nix::unpackTarfile(source, tmpDir);
+    }
+    if (int rc = conn->sshPid.wait())
+        throw std::runtime_error(nix::fmt("exporting the compressed outputs on the build node failed with exit code %d", rc));
+
+    auto cacheStore = nix::openStore(cacheUri(tmpDir));
+    std::vector<nix::ref<nix::Store>> cacheStores(compressionThreads(), cacheStore);
+    auto stats = copyPathsParallel(cacheStores, {store}, paths);
+    stats.fileBytes = compressedSize(*cacheStore, paths);
+
+    stats.elapsed = std::chrono::steady_clock::now() - start;
+    return stats;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <nix/store/store-api.hh>
+#include <nix/store/ssh.hh>
+
+struct TransferStats
+{
+    size_t paths = 0;
+    uint64_t narBytes = 0;
+    /* Bytes sent over the network, if the NARs were compressed. */
+    uint64_t fileBytes = 0;
+    std::chrono::duration<double> elapsed{0};
+};
+
+/* Copies paths between stores with one worker thread per connection, where
+ * srcStores and dstStores hold independent connections to the same source
+ * and destination store, and worker i uses the (i mod size)-th connection
+ * of each. A path is only copied once all of its references in paths have
+ * been copied, so the destination never sees a path before its references.
+ * With a single connection on each side, the paths are copied in one batch
+ * with nix::copyPaths instead.
+ * @return Number of paths and NAR bytes copied, and the time it took. */
+TransferStats copyPathsParallel(
+    const std::vector<nix::ref<nix::Store>> & srcStores,
+    const std::vector<nix::ref<nix::Store>> & dstStores,
+    const nix::StorePathSet & paths);
+
+/* @return Human readable summary of a transfer, including its throughput. */
+std::string showTransferStats(const TransferStats & stats);
+
+/* Copies paths to the remote store of a build node as zstd-compressed NARs.
+ * The paths are compressed into a local binary cache, which is sent to
+ * remoteDir on the node as a tar stream and imported from there with
+ * 'nix copy', so the node needs nothing besides Nix, tar, xargs and a POSIX
+ * shell. Only the given paths are imported, not their closure. */
+TransferStats uploadCompressed(
+    nix::ref<nix::Store> store,
+    nix::SSHMaster & sshMaster,
+    const std::string & remoteDir,
+    const nix::StorePathSet & paths);
+
+/* Copies paths from the remote store of a build node as zstd-compressed
+ * NARs, by exporting exactly these paths to a binary cache in remoteDir on
+ * the node and streaming it back as a tar stream. The paths are sent on
+ * stdin, as closures can be too large for a command line. */
+TransferStats downloadCompressed(
+    nix::SSHMaster & sshMaster,
+    const std::string & remoteDir,
+    nix::ref<nix::Store> store,
+    const nix::StorePathSet & paths);
@@ -0,0 +1,168 @@
+#include "upload-registry.hh"
+#include "state.hh"
+#include "trace.hh"
+
+#include <chrono>
+#include <filesystem>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std::chrono_literals;
+
+#include <nix/store/pathlocks.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/fmt.hh>
+#include <nix/util/logging.hh>
+
+UploadRegistry::UploadRegistry(const std::string & host, ValidityCache & validityCache)
+    : host(host), validityCache(validityCache)
+{
+    if (currentLoadDir().empty())
+        return;
+    directory = nodeStateFile(host, ".uploads");
+    if (mkdir(directory.c_str(), 0700) == -1 && errno != EEXIST)
+        throw nix::SysError("creating '%s'", directory);
+}
+
+std::string UploadRegistry::lockPath(const nix::StorePath & path)
+{
+    return directory + "/" + std::string(path.hashPart()) + ".lock";
+}
+
+bool UploadRegistry::claim(const nix::StorePath & path)
+{
+    auto fd = nix::openLockFile(lockPath(path), true);
+    if (!nix::lockFile(fd.get(), nix::ltWrite, false))
+        return false;
+    /* prune() may have removed the lock file after we opened it, and
+     * another process may hold the new one. */
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1 || st.st_nlink == 0)
+        return false;
+    claims.insert_or_assign(path, std::move(fd));
+    return true;
+}
+
+void UploadRegistry::uploaded(const nix::StorePathSet & paths)
+{
+    /* Recorded before the paths are released, for the processes waiting
+     * for them. */
+    validityCache.addValid(paths);
+    for (auto & path : paths)
+        claims.erase(path);
+}
+
+void UploadRegistry::prune(const std::string & host)
+{
+    if (currentLoadDir().empty())
+        return;
+    auto directory = nodeStateFile(host, ".uploads");
+    if (!nix::pathExists(directory))
+        return;
+    for (auto & entry : std::filesystem::directory_iterator(directory)) {
+        auto path = entry.path().string();
+        auto fd = nix::openLockFile(path, false);
+        if (fd && nix::lockFile(fd.get(), nix::ltWrite, false))
+            unlink(path.c_str());
+    }
+}
+
+void UploadRegistry::upload(nix::Store & store, const nix::StorePathSet & paths,
+    std::function<void(const nix::StorePathSet &)> upload,
+    std::function<nix::StorePathSet(const nix::StorePathSet &)> queryValid)
+{
+    if (directory.empty()) {
+        upload(paths);
+        validityCache.addValid(paths);
+        return;
+    }
+
+    /* Visit the paths with the references first, so that a path is ready
+     * in the same round as the references it waits for. */
+    auto sorted = store.topoSortPaths(paths);
+    std::vector<nix::StorePath> order(sorted.rbegin(), sorted.rend());
+    std::map<nix::StorePath, nix::StorePathSet> references;
+    for (auto & path : order)
+        for (auto & ref : store.queryPathInfo(path)->references)
+            if (ref != path && paths.contains(ref))
+                references[path].insert(ref);
+
+    nix::StorePathSet pending = paths;
+    /* Paths that another process was uploading at some point. */
+    nix::StorePathSet waited;
+    auto deadline = std::chrono::steady_clock::now() + 15min;
+    bool hogged = false;
+    auto backoff = 50ms;
+    while (!pending.empty()) {
+        if (!hogged && std::chrono::steady_clock::now() >= deadline) {
+            hogged = true;
+            using namespace nix;
+            printError("NSH Error: somebody is hogging the uploads of %d paths to '%s', continuing...", pending.size() - claims.size(), host);
+        }
+
+        /* Claim what nobody else is uploading. The paths that another
+         * process finished uploading before we got their locks are in the
+         * validity cache, which is read once for all of them. */
+        bool progress = false;
+        nix::StorePathSet claimed;
+        if (!hogged)
+            for (auto & path : order)
+                if (pending.contains(path) && !claims.contains(path)) {
+                    if (claim(path))
+                        claimed.insert(path);
+                    else
+                        waited.insert(path);
+                }
+        for (auto & path : validityCache.queryValid(claimed)) {
+            claims.erase(path);
+            pending.erase(path);
+            progress = true;
+        }
+
+        /* Take the claimed paths whose pending references are all claimed
+         * and ready as well. */
+        nix::StorePathSet ready;
+        for (auto & path : order) {
+            if (!pending.contains(path) || (!claims.contains(path) && !hogged))
+                continue;
+            bool refsReady = true;
+            for (auto & ref : references[path])
+                if (pending.contains(ref) && !ready.contains(ref))
+                    refsReady = false;
+            if (refsReady)
+                ready.insert(path);
+        }
+
+        /* The process we waited for may have uploaded the paths without
+         * the validity cache recording it. */
+        nix::StorePathSet recheck;
+        for (auto & path : ready)
+            if (waited.contains(path))
+                recheck.insert(path);
+        if (!recheck.empty()) {
+            auto valid = queryValid(recheck);
+            uploaded(valid);
+            for (auto & path : recheck) {
+                waited.erase(path);
+                if (valid.contains(path)) {
+                    ready.erase(path);
+                    pending.erase(path);
+                    progress = true;
+                }
+            }
+        }
+
+        if (!ready.empty()) {
+            upload(ready);
+            uploaded(ready);
+            for (auto & path : ready)
+                pending.erase(path);
+            backoff = 50ms;
+        } else if (!pending.empty() && !progress) {
+            TraceSpan span("lock", "wait for uploads", {{"host", host}, {"paths", pending.size()}});
+            std::this_thread::sleep_for(backoff);
+            backoff = std::min<std::chrono::milliseconds>(backoff * 2, 1s);
+        }
+    }
+}
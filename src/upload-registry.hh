@@ -0,0 +1,60 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <string>
+
+#include <nix/store/path.hh>
+#include <nix/store/store-api.hh>
+#include <nix/util/file-descriptor.hh>
+
+#include "validity-cache.hh"
+
+/* Registry of the store paths being uploaded to the remote store of a build
+ * node, shared by all NSH processes through a lock file per path in the
+ * current-load directory. Every path is uploaded by the process holding the
+ * lock on its file, while the others wait for it and upload their remaining
+ * paths in the meantime, so that builds with disjoint inputs do not wait for
+ * each other and shared inputs are only sent once. A finished upload is
+ * recorded in the validity cache, and a process that waited for a path asks
+ * the remote store about it before uploading it itself, so that it does not
+ * send it again when the cache is disabled or was invalidated. The lock
+ * files are kept until prune() removes the ones nobody holds. */
+class UploadRegistry
+{
+public:
+    /* Paths whose upload failed are released for other processes to retry
+     * when the UploadRegistry is destroyed. */
+    UploadRegistry(const std::string & host, ValidityCache & validityCache);
+
+    /* Makes sure that paths are in the remote store, calling upload for the
+     * ones that no other process is uploading. Every set passed to upload
+     * only refers to paths outside of it that are already in the remote
+     * store. Waiting for other processes is never done while holding a path
+     * that could be uploaded, so that processes do not wait for each other
+     * in a cycle. Paths that are still not uploaded after 15 minutes are
+     * uploaded anyway.
+     * @param queryValid Returns the subset of the given paths that are in
+     * the remote store. */
+    void upload(nix::Store & store, const nix::StorePathSet & paths,
+        std::function<void(const nix::StorePathSet &)> upload,
+        std::function<nix::StorePathSet(const nix::StorePathSet &)> queryValid);
+
+    /* Removes the lock files of host that no process holds. */
+    static void prune(const std::string & host);
+
+private:
+    std::string host;
+    std::string directory;
+    ValidityCache & validityCache;
+    std::map<nix::StorePath, nix::AutoCloseFD> claims;
+
+    std::string lockPath(const nix::StorePath & path);
+
+    /* Takes the lock of path without waiting.
+     * @return Whether it was taken. */
+    bool claim(const nix::StorePath & path);
+
+    /* Records the claimed paths as uploaded and releases them. */
+    void uploaded(const nix::StorePathSet & paths);
+};
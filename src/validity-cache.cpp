@@ -0,0 +1,80 @@
+#include "validity-cache.hh"
+#include "settings.hh"
+#include "state.hh"
+
+#include <fstream>
+#include <unistd.h>
+
+#include <nix/store/pathlocks.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/fmt.hh>
+
+ValidityCache::ValidityCache(const std::string & host)
+    : path(nodeStateFile(host, ".valid"))
+{
+}
+
+bool ValidityCache::enabled()
+{
+    return !currentLoadDir().empty() && ourSettings.validityCacheTtl.get() > 0;
+}
+
+std::map<std::string, time_t> ValidityCache::read()
+{
+    std::map<std::string, time_t> entries;
+    std::ifstream file(path);
+    auto now = std::time(nullptr);
+    time_t expiry;
+    std::string name;
+    while (file >> expiry >> name)
+        if (expiry > now)
+            entries[name] = expiry;
+    return entries;
+}
+
+nix::StorePathSet ValidityCache::queryValid(const nix::StorePathSet & paths)
+{
+    nix::StorePathSet valid;
+    if (!enabled() || paths.empty())
+        return valid;
+
+    auto lock = nix::openLockFile(path + ".lock", true);
+    nix::lockFile(lock.get(), nix::ltRead, true);
+    auto entries = read();
+    for (auto & p : paths)
+        if (entries.contains(std::string(p.to_string())))
+            valid.insert(p);
+    return valid;
+}
+
+void ValidityCache::addValid(const nix::StorePathSet & paths)
+{
+    if (!enabled() || paths.empty())
+        return;
+
+    auto lock = nix::openLockFile(path + ".lock", true);
+    nix::lockFile(lock.get(), nix::ltWrite, true);
+    auto entries = read();
+    auto expiry = std::time(nullptr) + ourSettings.validityCacheTtl.get();
+    for (auto & p : paths)
+        entries[std::string(p.to_string())] = expiry;
+
+    std::string contents;
+    for (auto & [name, e] : entries)
+        contents += nix::fmt("%d %s\n", e, name);
+    auto tmpPath = nix::fmt("%s.tmp-%d", path, getpid());
+    nix::writeFile(tmpPath, contents, 0600);
+    if (rename(tmpPath.c_str(), path.c_str()) == -1)
+        throw nix::SysError("renaming '%s' to '%s'", tmpPath, path);
+}
+
+void ValidityCache::invalidate()
+{
+    if (currentLoadDir().empty())
+        return;
+
+    auto lock = nix::openLockFile(path + ".lock", true);
+    nix::lockFile(lock.get(), nix::ltWrite, true);
+    if (unlink(path.c_str()) == -1 && errno != ENOENT)
+        throw nix::SysError("removing '%s'", path);
+}
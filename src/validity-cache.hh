@@ -0,0 +1,36 @@
+#pragma once
+
+#include <ctime>
+#include <map>
+#include <string>
+
+#include <nix/store/path.hh>
+
+/* Persistent record of the store paths known to be valid in the remote
+ * store of a build node, shared by all NSH processes through a file in the
+ * current-load directory. Entries expire after validity-cache-ttl seconds,
+ * and all entries of a node are dropped when NSH collects garbage on it or
+ * a build on it fails. */
+class ValidityCache
+{
+public:
+    explicit ValidityCache(const std::string & host);
+
+    /* @return The subset of paths recorded as valid. */
+    nix::StorePathSet queryValid(const nix::StorePathSet & paths);
+
+    /* Records paths as valid. */
+    void addValid(const nix::StorePathSet & paths);
+
+    /* Forgets all paths recorded for the node. */
+    void invalidate();
+
+private:
+    std::string path;
+
+    bool enabled();
+
+    /* @return Unexpired entries, mapping store path names to their expiry
+     * time. */
+    std::map<std::string, time_t> read();
+};
@@ -321,6 +321,69 @@ in
           print(out)
           t.assertIn("something", out)
 
+      with subtest("run_nix_build_postpone"):
+          # A held job keeps the expected wait above max-queue-wait
+          held = submit.succeed("sbatch --parsable --hold --wrap 'sleep 1'").strip()
+          submit.succeed("echo 'max-queue-wait = 1' >> /etc/nix/nsh.conf")
+          submit.succeed("echo 'pending-job-seconds = 1000' >> /etc/nix/nsh.conf")
+          submit.succeed("echo 'max-postpone-time = 10' >> /etc/nix/nsh.conf")
+          out = submit.succeed(build_derivation_simple)
+          print(out)
+          t.assertIn("not submitting the build yet", out)
+          t.assertIn("postponed for longer than max-postpone-time", out)
+          t.assertIn("something", out)
+
+      with subtest("run_nix_build_admission_fallback"):
+          submit.succeed("echo 'admission-fallback = true' >> /etc/nix/nsh.conf")
+          count_jobs = "sacct -n -X -o JobName%80 | grep -c 'Nix Build' || true"
+          jobs = submit.succeed(count_jobs)
+          # Built locally by Nix, which lacks the nsh feature
+          out = submit.succeed(build_derivation_simple.replace('requiredSystemFeatures = [ "nsh" ];', ""))
+          print(out)
+          t.assertIn("not submitting the build yet", out)
+          t.assertIn("something", out)
+          t.assertEqual(jobs, submit.succeed(count_jobs))
+          submit.succeed("scancel %s" % held)
+      submit.succeed("sed -i '/max-queue-wait/d;/pending-job-seconds/d;/max-postpone-time/d;/admission-fallback/d' /etc/nix/nsh.conf")
+
+      with subtest("run_nix_build_broker"):
+          submit.succeed("echo 'broker-socket = /run/nsh/broker.sock' >> /etc/nix/nsh.conf")
+          submit.succeed("systemd-run --unit nsh-broker ${nix-scheduler-hook}/bin/nsh daemon")
+          submit.wait_for_file("/run/nsh/broker.sock")
+          out = submit.succeed(build_derivation_simple)
+          print(out)
+          t.assertIn("something", out)
+          submit.succeed("journalctl -u nsh-broker | grep 'NSH broker listening'")
+          submit.systemctl("stop nsh-broker")
+      submit.succeed("sed -i '/broker-socket/d' /etc/nix/nsh.conf")
+
+      with subtest("run_nix_build_broker_array"):
+          submit.succeed("echo 'broker-socket = /run/nsh/broker.sock' >> /etc/nix/nsh.conf")
+          submit.succeed("echo 'submit-coalesce-window = 500' >> /etc/nix/nsh.conf")
+          submit.succeed("systemd-run --unit nsh-broker-array ${nix-scheduler-hook}/bin/nsh daemon")
+          submit.wait_for_file("/run/nsh/broker.sock")
+          out = submit.succeed(build_derivation_simple)
+          print(out)
+          t.assertIn("something", out)
+          submit.succeed("sacct -n -X -o JobName%50 | grep 'array of'")
+          submit.systemctl("stop nsh-broker-array")
+      submit.succeed("sed -i '/broker-socket/d;/submit-coalesce-window/d' /etc/nix/nsh.conf")
+
+      with subtest("run_nix_build_broker_pilot"):
+          submit.succeed("echo 'broker-socket = /run/nsh/broker.sock' >> /etc/nix/nsh.conf")
+          submit.succeed("echo 'pilot-pool-size = 1' >> /etc/nix/nsh.conf")
+          submit.succeed("systemd-run --unit nsh-broker-pilot ${nix-scheduler-hook}/bin/nsh daemon")
+          submit.wait_until_succeeds("squeue -h -t R -o %j | grep 'Nix Build - pilot'")
+          count_jobs = "sacct -n -X -o JobName%80 | grep 'Nix Build' | grep -vc pilot || true"
+          jobs = submit.succeed(count_jobs)
+          out = submit.succeed(build_derivation_simple)
+          print(out)
+          t.assertIn("something", out)
+          t.assertEqual(jobs, submit.succeed(count_jobs))
+          submit.systemctl("stop nsh-broker-pilot")
+          submit.wait_until_fails("squeue -h -o %j | grep 'Nix Build - pilot'")
+      submit.succeed("sed -i '/broker-socket/d;/pilot-pool-size/d' /etc/nix/nsh.conf")
+
       build_derivation_deps = """
         nix-build \
           --option build-hook ${nix-scheduler-hook}/bin/nsh \
@@ -399,10 +462,125 @@ in
           submit.succeed("echo 'collect-garbage = true' >> /etc/nix/nsh.conf")
           submit.succeed(build_derivation_simple)
           path = submit.succeed("readlink -f result")
+          # Garbage is collected in the background once the build is done
+          submit.wait_until_fails("ls /nix/var/nix/current-load/cleanup/*.task")
           for node in [node1, node2, node3]:
               node.fail("ls /var/store%s" % path.rstrip('\n'))
       submit.succeed("sed -i '/collect-garbage/d' /etc/nix/nsh.conf")
 
+      # More input paths than fit in a single command line argument
+      build_derivation_many_inputs = """
+        nix-build \
+          --option build-hook ${nix-scheduler-hook}/bin/nsh \
+          -E '
+            derivation {
+              name = "many-inputs";
+              builder = "/bin/sh";
+              args = ["-c" "echo many > $out; echo many"];
+              system = builtins.currentSystem;
+              requiredSystemFeatures = [ "nsh" ];
+              passAsFile = [ "inputs" ];
+              inputs = toString (builtins.genList (i: builtins.toFile "input-''${toString i}" (toString i)) 3000);
+              REBUILD = builtins.currentTime;
+            }' 2>&1
+      """
+
+      def many_inputs(prefix, count=3000):
+          return build_derivation_many_inputs.replace("input-", prefix + "-").replace("3000", str(count))
+
+      def verbose(build, flag="-v"):
+          return build.replace("nix-build", "nix-build " + flag, 1)
+
+      with subtest("run_nix_build_compressed_transfer"):
+          submit.succeed("echo 'transfer-compression = zstd' >> /etc/nix/nsh.conf")
+          out = submit.succeed(many_inputs("compressed"))
+          print(out)
+          t.assertIn("compressed to", out)
+          t.assertIn("many", out)
+      submit.succeed("sed -i '/transfer-compression/d' /etc/nix/nsh.conf")
+
+      with subtest("run_nix_build_parallel_transfer"):
+          submit.succeed("echo 'transfer-jobs = 4' >> /etc/nix/nsh.conf")
+          out = submit.succeed(many_inputs("parallel", 100))
+          print(out)
+          t.assertIn("copied dependencies", out)
+          t.assertIn("many", out)
+      submit.succeed("sed -i '/transfer-jobs/d' /etc/nix/nsh.conf")
+
+      with subtest("run_nix_build_validity_cache"):
+          submit.succeed("echo 'validity-cache-ttl = 600' >> /etc/nix/nsh.conf")
+          submit.succeed(many_inputs("cached", 10))
+          submit.succeed("ls /nix/var/nix/current-load/*.valid")
+          out = submit.succeed(many_inputs("cached", 10))
+          t.assertIn("many", out)
+      submit.succeed("sed -i '/validity-cache-ttl/d' /etc/nix/nsh.conf")
+
+      with subtest("run_nix_build_retention"):
+          submit.succeed("echo 'collect-garbage = true' >> /etc/nix/nsh.conf")
+          submit.succeed("echo 'remote-store-budget = 100000000' >> /etc/nix/nsh.conf")
+          out = submit.succeed(many_inputs("retained", 10))
+          print(out)
+          t.assertIn("inputs on", out)
+          submit.wait_until_fails("ls /nix/var/nix/current-load/cleanup/*.task")
+          # The inputs fit in the budget, so garbage collection keeps them
+          t.assertTrue(any(node.execute("ls -d /var/store/nix/store/*-retained-0")[0] == 0 for node in [node1, node2, node3]))
+      submit.succeed("sed -i '/collect-garbage/d;/remote-store-budget/d' /etc/nix/nsh.conf")
+
+      with subtest("run_nix_build_staging"):
+          for node in [node1, node2, node3]:
+              node.succeed("mkdir -p ~/.ssh")
+              node.succeed("cat ${snakeOilPrivateKey} > ~/.ssh/privkey.snakeoil")
+              node.succeed("chmod 600 ~/.ssh/privkey.snakeoil")
+              node.succeed("echo 'Host node*' >> ~/.ssh/config")
+              node.succeed("echo '  IdentityFile ~/.ssh/privkey.snakeoil' >> ~/.ssh/config")
+              node.succeed("echo '  StrictHostKeyChecking no' >> ~/.ssh/config")
+          submit.succeed("echo 'staging-store = ssh-ng://node1?remote-store=/var/staging' >> /etc/nix/nsh.conf")
+          submit.succeed("echo 'staging-outputs = true' >> /etc/nix/nsh.conf")
+          out = submit.succeed(many_inputs("staged", 10))
+          print(out)
+          t.assertIn("many", out)
+          t.assertIn("copied outputs from 'ssh-ng://node1", out)
+          node1.succeed("ls -d /var/staging/nix/store/*-staged-0")
+      submit.succeed("sed -i '/staging-store/d;/staging-outputs/d' /etc/nix/nsh.conf")
+
+      with subtest("run_nix_build_poll_pace"):
+          submit.succeed("echo 'poll-max-interval = 1' >> /etc/nix/nsh.conf")
+          out = submit.succeed(verbose(build_derivation_simple, "-vvv"))
+          t.assertIn("job state polling:", out)
+          t.assertIn("something", out)
+      submit.succeed("sed -i '/poll-max-interval/d' /etc/nix/nsh.conf")
+
+      with subtest("run_nix_build_affinity"):
+          submit.succeed("echo 'affinity-wait = 60' >> /etc/nix/nsh.conf")
+          submit.succeed(many_inputs("affinity", 10))
+          submit.succeed("ls /nix/var/nix/current-load/resident/")
+          # The same inputs, in a derivation of its own
+          out = submit.succeed(verbose(many_inputs("affinity", 10)))
+          print(out)
+          t.assertIn("preferring node", out)
+          t.assertIn("many", out)
+      submit.succeed("sed -i '/affinity-wait/d' /etc/nix/nsh.conf")
+
+      with subtest("run_nix_build_auto_sizing"):
+          submit.succeed("echo 'auto-sizing = true' >> /etc/nix/nsh.conf")
+          # Jobs that take no time leave no usage to size from
+          build_derivation_sized = build_derivation_simple.replace("echo something > $out", "sleep 2; echo something > $out")
+          submit.succeed(build_derivation_sized)
+          out = submit.succeed(verbose(build_derivation_sized))
+          print(out)
+          t.assertIn("sizing the job to", out)
+      submit.succeed("sed -i '/auto-sizing/d' /etc/nix/nsh.conf")
+
+      with subtest("run_nix_build_routing"):
+          submit.succeed("echo 'clusters = a b' >> /etc/nix/nsh.conf")
+          submit.succeed("touch /etc/nix/nsh-a.conf /etc/nix/nsh-b.conf")
+          out = submit.succeed(verbose(build_derivation_simple))
+          print(out)
+          t.assertIn("routing build to cluster", out)
+          t.assertIn("something", out)
+      submit.succeed("rm /etc/nix/nsh-a.conf /etc/nix/nsh-b.conf")
+      submit.succeed("sed -i '/clusters/d' /etc/nix/nsh.conf")
+
       with subtest("run_nix_build_static"):
           for node in [node1, node2, node3]:
               node.succeed("mount -t tmpfs hide-nix ${pkgs.nix}")
@@ -566,4 +744,57 @@ in
           submit.succeed(build_derivation_hello)
     '';
   };
+  localTests = testers.nixosTest {
+    name = "Local Scheduler Tests";
+    interactive.sshBackdoor.enable = true;
+    nodes.submit = {
+      services.openssh.enable = true;
+      services.openssh.settings.PasswordAuthentication = false;
+      users.users.root.openssh.authorizedKeys.keys = [
+        snakeOilPublicKey
+      ];
+      nix.settings.substitute = false;
+      nix.settings.build-hook = "${nix-scheduler-hook}/bin/nsh";
+    };
+    testScript = ''
+      start_all()
+      submit.wait_for_unit("multi-user.target")
+
+      submit.succeed("mkdir -p /etc/nix")
+      submit.succeed("echo 'system = %s' >> /etc/nix/nsh.conf" % "${guestSystem}")
+      submit.succeed("echo 'job-scheduler = local' >> /etc/nix/nsh.conf")
+      submit.succeed("echo 'local-state-dir = /root/nsh-local' >> /etc/nix/nsh.conf")
+      submit.succeed("echo 'local-slots = 2' >> /etc/nix/nsh.conf")
+      submit.succeed("echo 'local-queue-delay = 500' >> /etc/nix/nsh.conf")
+
+      submit.succeed("mkdir -p ~/.ssh")
+      submit.succeed("cat ${snakeOilPrivateKey} > ~/.ssh/privkey.snakeoil")
+      submit.succeed("chmod 600 ~/.ssh/privkey.snakeoil")
+      submit.succeed("echo 'Host localhost' >> ~/.ssh/config")
+      submit.succeed("echo '  IdentityFile ~/.ssh/privkey.snakeoil' >> ~/.ssh/config")
+      submit.succeed("echo '  StrictHostKeyChecking no' >> ~/.ssh/config")
+
+      build_derivation_deps = """
+        nix-build \
+          --option build-hook ${nix-scheduler-hook}/bin/nsh \
+          -E '
+            let
+              mkDrv = name: echo: derivation {
+                inherit name;
+                builder = "/bin/sh";
+                args = ["-c" ("echo " + echo + " > $out; echo " + echo)];
+                system = builtins.currentSystem;
+                requiredSystemFeatures = ["nsh"];
+                REBUILD = builtins.currentTime;
+              };
+            in mkDrv "test-deps" ((mkDrv "dep1" "dep1") + (mkDrv "dep2" "dep2") + (mkDrv "dep3" "dep3"))' 2>&1
+      """
+
+      with subtest("run_nix_build_deps"):
+          out = submit.succeed(build_derivation_deps)
+          print(out)
+          t.assertIn("dep1", out)
+          submit.fail("ls /root/nsh-local/job-*.pid")
+    '';
+  };
 }